@@ -28,6 +28,354 @@ void shuffle(std::vector<Agent> &agents, Rng& rng)
 		}
 }
 
+#ifndef NDEBUG
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Debug builds replace the global allocation functions to count the calls.
+// The nothrow and array forms of new end up in operator new(size_t), or in
+// the aligned one for over-aligned types such as the agent columns' blocks.
+static std::atomic<size_t> allocations{0};
+
+void* operator new(size_t size)
+{
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		if (void *p = std::malloc(size ? size : 1))
+				return p;
+		throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+		std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+		std::free(p);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		// aligned_alloc() wants a multiple of the alignment.
+		size_t align = (size_t) alignment;
+		size_t rounded = ((size ? size : 1) + align - 1) / align * align;
+		if (void *p = std::aligned_alloc(align, rounded))
+				return p;
+		throw std::bad_alloc();
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+		std::free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept
+{
+		std::free(p);
+}
+
+size_t allocation_count()
+{
+		return allocations.load(std::memory_order_relaxed);
+}
+#else
+size_t allocation_count()
+{
+		return 0;
+}
+#endif
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/// Reference kernel, one agent at a time. The vector kernels use it for the
+/// agents left over after their last full iteration.
+static size_t transition_hits_scalar(const uint8_t *states, size_t n,
+				const TransitionTable &table, const Philox2x32 &philox, uint64_t stream,
+				size_t first, uint64_t *hits)
+{
+		size_t total = 0;
+		for (size_t w = 0; w * 64 < n; w++)
+				hits[w] = 0;
+		for (size_t i = 0; i < n; i++) {
+				if (kernel_draw(philox, stream, first + i) < table.thresholds[states[i]]) {
+						hits[i / 64] |= (uint64_t) 1 << (i % 64);
+						++total;
+				}
+		}
+		return total;
+}
+
+/// Hands the agents from offset on to the scalar kernel. offset must be a
+/// multiple of 64.
+static size_t finish_with_scalar(const uint8_t *states, size_t n,
+				size_t offset, const TransitionTable &table, const Philox2x32 &philox,
+				uint64_t stream, size_t first, uint64_t *hits)
+{
+		if (offset >= n)
+				return 0;
+		return transition_hits_scalar(states + offset, n - offset, table, philox,
+						stream, first + offset, hits + offset / 64);
+}
+
+// The vector kernels run Philox in 32 bit lanes, one lane per counter of
+// kernel_draw(), so every lane serves two agents eight positions apart. The
+// 32x32 to 64 bit products come from two widening multiplies, one for the
+// even lanes and one for the odd lanes shifted down, whose halves are blended
+// back into lanes. Each loop iteration keeps four vectors in flight so that
+// their multiplies overlap.
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+static inline void philox_round_avx2(__m256i &x0, __m256i &x1, __m256i key)
+{
+		const __m256i multiplier = _mm256_set1_epi32(0xd256d193);
+		__m256i even = _mm256_mul_epu32(x0, multiplier);
+		__m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(x0, 32), multiplier);
+		__m256i hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xaa);
+		__m256i lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xaa);
+		x0 = _mm256_xor_si256(_mm256_xor_si256(hi, x1), key);
+		x1 = lo;
+}
+
+/// Bit mask of the eight lanes whose draws fall below their agents'
+/// thresholds. AVX2 only compares signed integers, so both sides have their
+/// sign bits flipped.
+__attribute__((target("avx2")))
+static inline uint64_t below_avx2(__m256i draws, const uint8_t *states,
+				__m256i thresholds)
+{
+		const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+		__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) states));
+		__m256i threshold = _mm256_permutevar8x32_epi32(thresholds, index);
+		__m256i below = _mm256_cmpgt_epi32(threshold, _mm256_xor_si256(draws, sign));
+		return _mm256_movemask_ps(_mm256_castsi256_ps(below));
+}
+
+/// Eight lanes, so one vector covers a group of 16 agents and an iteration
+/// covers 64.
+__attribute__((target("avx2")))
+static size_t transition_hits_avx2(const uint8_t *states, size_t n,
+				const TransitionTable &table, const Philox2x32 &philox, uint64_t stream,
+				size_t first, uint64_t *hits)
+{
+		uint32_t padded[8] = {};
+		for (size_t s = 0; s < STATE_COUNT; s++)
+				padded[s] = table.thresholds[s] ^ 0x80000000;
+		const __m256i thresholds = _mm256_loadu_si256((const __m256i *) padded);
+		const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256i high = _mm256_set1_epi32((uint32_t) stream);
+		size_t total = 0;
+		size_t i = 0;
+		for (; i + 64 <= n; i += 64) {
+				__m256i x0[4], x1[4];
+				for (int v = 0; v < 4; v++) {
+						uint32_t group = (first + i) / 16 + v;
+						x0[v] = _mm256_add_epi32(lanes, _mm256_set1_epi32(group * 8));
+						x1[v] = high;
+				}
+				uint32_t k = philox.key;
+				for (int round = 0; round < 10; round++) {
+						__m256i key = _mm256_set1_epi32(k);
+						for (int v = 0; v < 4; v++)
+								philox_round_avx2(x0[v], x1[v], key);
+						k += 0x9e3779b9;
+				}
+				uint64_t mask = 0;
+				for (int v = 0; v < 4; v++) {
+						const uint8_t *group = states + i + 16 * v;
+						mask |= below_avx2(x0[v], group, thresholds) << (16 * v);
+						mask |= below_avx2(x1[v], group + 8, thresholds) << (16 * v + 8);
+				}
+				hits[i / 64] = mask;
+				total += __builtin_popcountll(mask);
+		}
+		return total + finish_with_scalar(states, n, i, table, philox, stream,
+						first, hits);
+}
+
+// GCC 12 warns about the undefined vectors inside its own AVX-512 intrinsics.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f")))
+static inline void philox_round_avx512(__m512i &x0, __m512i &x1, __m512i key)
+{
+		const __m512i multiplier = _mm512_set1_epi32(0xd256d193);
+		__m512i even = _mm512_mul_epu32(x0, multiplier);
+		__m512i odd = _mm512_mul_epu32(_mm512_srli_epi64(x0, 32), multiplier);
+		__m512i hi = _mm512_mask_blend_epi32(0xaaaa, _mm512_srli_epi64(even, 32), odd);
+		__m512i lo = _mm512_mask_blend_epi32(0xaaaa, even, _mm512_slli_epi64(odd, 32));
+		x0 = _mm512_xor_si512(_mm512_xor_si512(hi, x1), key);
+		x1 = lo;
+}
+
+/// Bit mask of the sixteen lanes whose draws fall below their agents'
+/// thresholds. Lanes 0-7 hold the agents at low[0, 8) and lanes 8-15 those at
+/// high[0, 8).
+__attribute__((target("avx512f")))
+static inline uint64_t below_avx512(__m512i draws, const uint8_t *low,
+				const uint8_t *high, __m512i thresholds)
+{
+		__m128i bytes = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *) low),
+						_mm_loadl_epi64((const __m128i *) high));
+		__m512i threshold = _mm512_permutexvar_epi32(_mm512_cvtepu8_epi32(bytes),
+						thresholds);
+		return _mm512_cmplt_epu32_mask(draws, threshold);
+}
+
+/// Sixteen lanes, so one vector covers two groups of 16 agents and an
+/// iteration covers 128.
+__attribute__((target("avx512f")))
+static size_t transition_hits_avx512(const uint8_t *states, size_t n,
+				const TransitionTable &table, const Philox2x32 &philox, uint64_t stream,
+				size_t first, uint64_t *hits)
+{
+		uint32_t padded[16] = {};
+		for (size_t s = 0; s < STATE_COUNT; s++)
+				padded[s] = table.thresholds[s];
+		const __m512i thresholds = _mm512_loadu_si512(padded);
+		const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+						11, 12, 13, 14, 15);
+		const __m512i high = _mm512_set1_epi32((uint32_t) stream);
+		size_t total = 0;
+		size_t i = 0;
+		for (; i + 128 <= n; i += 128) {
+				__m512i x0[4], x1[4];
+				for (int v = 0; v < 4; v++) {
+						uint32_t group = (first + i) / 16 + 2 * v;
+						x0[v] = _mm512_add_epi32(lanes, _mm512_set1_epi32(group * 8));
+						x1[v] = high;
+				}
+				uint32_t k = philox.key;
+				for (int round = 0; round < 10; round++) {
+						__m512i key = _mm512_set1_epi32(k);
+						for (int v = 0; v < 4; v++)
+								philox_round_avx512(x0[v], x1[v], key);
+						k += 0x9e3779b9;
+				}
+				for (int v = 0; v < 4; v++) {
+						const uint8_t *pair = states + i + 32 * v;
+						uint64_t low = below_avx512(x0[v], pair, pair + 16, thresholds);
+						uint64_t high = below_avx512(x1[v], pair + 8, pair + 24, thresholds);
+						uint64_t mask = (low & 0xff) | (high & 0xff) << 8 |
+								(low >> 8) << 16 | (high >> 8) << 24;
+						if (v % 2 == 0)
+								hits[(i + 32 * v) / 64] = mask;
+						else
+								hits[(i + 32 * v) / 64] |= mask << 32;
+						total += __builtin_popcountll(mask);
+				}
+		}
+		return total + finish_with_scalar(states, n, i, table, philox, stream,
+						first, hits);
+}
+
+#pragma GCC diagnostic pop
+
+#elif defined(__aarch64__)
+
+static inline void philox_round_neon(uint32x4_t &x0, uint32x4_t &x1,
+				uint32x4_t key)
+{
+		const uint32x2_t multiplier = vdup_n_u32(0xd256d193);
+		uint64x2_t low_product = vmull_u32(vget_low_u32(x0), multiplier);
+		uint64x2_t high_product = vmull_u32(vget_high_u32(x0), multiplier);
+		uint32x4_t hi = vcombine_u32(vshrn_n_u64(low_product, 32),
+						vshrn_n_u64(high_product, 32));
+		uint32x4_t lo = vcombine_u32(vmovn_u64(low_product), vmovn_u64(high_product));
+		x0 = veorq_u32(veorq_u32(hi, x1), key);
+		x1 = lo;
+}
+
+/// Bit mask of the four lanes whose draws fall below their agents'
+/// thresholds.
+static inline uint64_t below_neon(uint32x4_t draws, const uint8_t *states,
+				const TransitionTable &table)
+{
+		const uint32_t bit_values[4] = {1, 2, 4, 8};
+		const uint32_t values[4] = {table.thresholds[states[0]],
+				table.thresholds[states[1]], table.thresholds[states[2]],
+				table.thresholds[states[3]]};
+		uint32x4_t below = vcltq_u32(draws, vld1q_u32(values));
+		return vaddvq_u32(vandq_u32(below, vld1q_u32(bit_values)));
+}
+
+/// Four lanes, so two vectors cover a group of 16 agents and an iteration
+/// covers 32.
+static size_t transition_hits_neon(const uint8_t *states, size_t n,
+				const TransitionTable &table, const Philox2x32 &philox, uint64_t stream,
+				size_t first, uint64_t *hits)
+{
+		const uint32_t lane_values[4] = {0, 1, 2, 3};
+		const uint32x4_t lanes = vld1q_u32(lane_values);
+		const uint32x4_t high = vdupq_n_u32((uint32_t) stream);
+		size_t total = 0;
+		size_t i = 0;
+		for (size_t w = 0; w * 64 < n; w++)
+				hits[w] = 0;
+		for (; i + 64 <= n; i += 64) {
+				for (size_t h = i; h < i + 64; h += 32) {
+						uint32x4_t x0[4], x1[4];
+						for (int v = 0; v < 4; v++) {
+								uint32_t counter = ((first + h) / 16 + v / 2) * 8 + (v % 2) * 4;
+								x0[v] = vaddq_u32(lanes, vdupq_n_u32(counter));
+								x1[v] = high;
+						}
+						uint32_t k = philox.key;
+						for (int round = 0; round < 10; round++) {
+								uint32x4_t key = vdupq_n_u32(k);
+								for (int v = 0; v < 4; v++)
+										philox_round_neon(x0[v], x1[v], key);
+								k += 0x9e3779b9;
+						}
+						uint64_t mask = 0;
+						for (int v = 0; v < 4; v++) {
+								const uint8_t *quad = states + h + 16 * (v / 2) + 4 * (v % 2);
+								size_t shift = 16 * (v / 2) + 4 * (v % 2);
+								mask |= below_neon(x0[v], quad, table) << shift;
+								mask |= below_neon(x1[v], quad + 8, table) << (shift + 8);
+						}
+						hits[h / 64] |= mask << (h % 64);
+						total += __builtin_popcountll(mask);
+				}
+		}
+		return total + finish_with_scalar(states, n, i, table, philox, stream,
+						first, hits);
+}
+
+#endif
+
+std::vector<TransitionKernel> supported_kernels()
+{
+		std::vector<TransitionKernel> kernels = {transition_hits_scalar};
+#if defined(__x86_64__)
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+				kernels.push_back(transition_hits_avx2);
+		if (__builtin_cpu_supports("avx512f"))
+				kernels.push_back(transition_hits_avx512);
+#elif defined(__aarch64__)
+		kernels.push_back(transition_hits_neon);
+#endif
+		return kernels;
+}
+
+size_t transition_hits(const uint8_t *states, size_t n,
+				const TransitionTable &table, const Philox2x32 &philox, uint64_t stream,
+				size_t first, uint64_t *hits)
+{
+		static const TransitionKernel kernel = supported_kernels().back();
+		return kernel(states, n, table, philox, stream, first, hits);
+}
+
 /// Displays the first letter of a state in upper case
 std::ostream& operator<<(std::ostream& stream,
 			 const State& state) {
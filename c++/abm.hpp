@@ -15,43 +15,36 @@
 //! This program implements a simple agent based model for the purpose of
 //! comparing programming languages.
 
+#ifndef ABM_HPP
+#define ABM_HPP
+
 #include <algorithm>
+#include <cassert>
+#include <charconv>
 #include <cstdint>
 #include <cmath>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <sstream>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
-struct Rng {
-		uint64_t seed;
-		const uint64_t a = 22695477;
-		const uint64_t c = 1;
-		const uint64_t m = 32768;
-
-		Rng(uint64_t s) {
-				seed = s;
-		}
-
-		uint64_t uint() {
-				seed = seed * 1103515245 + 12345;
-				return (seed/65536) % m;
-		}
-
-		uint64_t to(uint64_t max) {
-				uint64_t result = uint() % max;
-				return result;
-		}
-
-		double real() {
-				double result = (double) uint() / m;
-				return result;
-		}
-};
-
+#include "aggregate.hpp"
+#include "arena.hpp"
+#include "calendar.hpp"
+#include "fork_join.hpp"
+#include "mapped.hpp"
+#include "metrics.hpp"
+#include "profile.hpp"
+#include "rng.hpp"
+#include "snapshot.hpp"
+#include "writer.hpp"
 
-/// Possible agent states
-enum State {
+/// Possible agent states, one byte each
+enum State : uint8_t {
 		SUSCEPTIBLE = 0,
 		INFECTIOUS,
 		RECOVERED,
@@ -59,6 +52,9 @@ enum State {
 		DEAD
 };
 
+/// Number of agent states
+const size_t STATE_COUNT = State::DEAD + 1;
+
 std::ostream& operator<<(std::ostream&, const State&);
 
 /// Determines which infection event to call in the simulation
@@ -68,6 +64,123 @@ enum InfectionMethod {
 		TWO = 2
 };
 
+/// Determines how the agents of a simulation are laid out in memory
+enum StorageLayout {
+		ARRAY = 0, // Array of Agent structs (reference layout)
+		COLUMNS = 1, // State and identity columns with per-state index sets
+		SHARDS = 2, // Columns split into shards that are updated in parallel
+		COMPACT = 3, // A byte per agent, identities are positions
+		PACKED = 4, // Four bits per agent, identities are positions
+		DEVICE = 5 // A byte per agent resident on the device (device.hpp)
+};
+
+/// Determines how the per-agent Bernoulli events draw their random numbers
+enum Sampling {
+		EXACT = 0, // One draw per eligible agent (reference)
+		SKIP = 1 // Geometric gaps between successes over each state's index set
+};
+// SKIP is statistically equivalent to EXACT but does not reproduce its random
+// stream. It applies the nominal probabilities, while EXACT with the 15 bit
+// LegacyRng rounds them up to the next multiple of 1/32768 (0.0001 becomes
+// 4/32768). The 53 bit engines in rng.hpp match SKIP in both modes. SKIP
+// draws its gaps from gap_real(), which joins two LegacyRng draws, so its
+// gaps are quantized at 2^-30 rather than at 1/32768.
+
+/// Determines how the per-agent events are computed
+enum EventKernel {
+		SCALAR = 0, // One agent at a time with the simulation's engine
+		SIMD = 1 // Vectorized over the state column with Philox draws
+};
+
+/// Determines how the agent order is randomized
+enum Shuffle {
+		FULL = 0, // Shuffle every agent (reference)
+		PARTIAL = 1 // Sample only the positions that are read, agents stay put
+};
+// PARTIAL keeps the agents in identity order and tracks which agents sit at
+// the first encounters positions of a virtual arrangement instead. Each full
+// shuffle is a fresh uniform permutation, so that is all the state the
+// reference carries between iterations and PARTIAL is equivalent in
+// distribution, but it does not reproduce the reference's random stream.
+
+/// Determines how infect_method_one() runs its encounters
+enum EncounterMode {
+		SEQUENTIAL = 0, // One after the other, each seeing the ones before
+		BATCHED = 1 // All at once against the states before the first one
+};
+// BATCHED draws every pair of an iteration up front from Philox and reads the
+// states in parallel. An encounter infects its susceptible agent when the
+// other one was infectious before the batch, so an agent infected in an
+// iteration does not infect others until the next one, and an agent met by
+// several infectious ones is infected (and counted) once.
+
+/// Determines whether dead agents are moved out of the agent storage
+enum Compaction {
+		OFF = 0, // Dead agents stay where they are (reference)
+		LIVE = 1, // Encounters only pick living agents
+		EQUIVALENT = 2 // Encounters pick dead agents as often as before
+};
+// Compaction moves the dead agents' identities to a cold list, so the events
+// and the index picks of the encounters only go over the stored agents, and
+// reports and snapshots count the cold ones as dead. LIVE changes the model:
+// no encounter is wasted on a dead agent any more. EQUIVALENT draws every
+// position of the reference, the cold agents being the first ones, and is
+// equivalent in distribution to OFF when the positions are drawn uniformly;
+// LegacyRng, whose to() never passes 32767, would draw only cold agents once
+// enough have died. infect_method_two() needs Shuffle::PARTIAL for it. The
+// reference can infect a dead agent there, so cold agents that the
+// arrangement picks are moved back into the storage.
+
+/// Determines how print_agents() snapshots are written
+enum AgentFormat {
+		CSV = 0, // agent_filename as id,state rows, overwritten each time
+		BINARY = 1 // A snapshot.hpp file per simulation and iteration
+};
+
+/// Determines which random number engine a simulation uses
+enum Generator {
+		LEGACY = 0, // The 15 bit LCG shared with the other languages
+		XOSHIRO = 1, // xoshiro256++
+		PCG = 2 // PCG64
+};
+
+/// The events of an iteration, in an order Parameters::events gives
+enum Event {
+		EVENT_GROW = 0,
+		EVENT_INFECT, // infect_method_one() or two(), as infection_method picks
+		EVENT_RECOVER,
+		EVENT_VACCINATE,
+		EVENT_SUSCEPTIBLE,
+		EVENT_DIE
+};
+
+/// Determines how the per-agent events find the agents they change
+enum Timing {
+		STEPS = 0, // Every agent draws in every iteration (reference)
+		EVENTS = 1 // Each agent's next transition is drawn ahead and scheduled
+};
+// EVENTS composes recover(), vaccinate(), susceptible() and die() into one
+// transition per state and iteration, draws the geometric number of
+// iterations to each agent's next change and files the agent in a timing
+// wheel, so an iteration only visits the agents that change in it besides
+// the encounters. Infections and new agents are scheduled as they come. It
+// is equivalent in distribution to STEPS but follows another stream, and
+// needs agents that stay where they are: Shuffle::PARTIAL, no compaction,
+// shards or batched encounters. The timing wheel is not checkpointed, so
+// its runs cannot be resumed.
+
+/// Determines where the per-agent events and the encounters run
+enum Backend {
+		CPU = 0, // On the host, as the other options say
+		GPU = 1 // On the accelerator, the agents kept in its memory
+};
+// GPU stores the agents in StorageLayout::DEVICE and runs the SIMD kernels'
+// draws and the batched encounters there, so it implies those and the
+// options they need; its runs match the CPU's with the same options bit for
+// bit. Builds without offloading (see device.hpp) run its loops on the host.
+// It only runs InfectionMethod::ONE: method two works on the host copy of
+// the states, which it would fetch and upload in every iteration.
+
 /// Structure to hold simulation's parameters.
 struct Parameters {
 		size_t simulations = 20;
@@ -82,10 +195,61 @@ struct Parameters {
 		double vaccination_prob = 0.001;
 		double regression_prob = 0.0003;
 		InfectionMethod infection_method = InfectionMethod::BOTH;
+		StorageLayout storage = StorageLayout::ARRAY;
+		Backend backend = Backend::CPU;
+		Sampling sampling = Sampling::EXACT;
+		Generator generator = Generator::LEGACY;
+		EventKernel kernel = EventKernel::SCALAR;
+		bool fused = false; // Run the four per-agent events in one pass
+		// Events of each iteration in order (fused where the four per-agent
+		// ones follow each other in this order)
+		std::vector<Event> events = {EVENT_GROW, EVENT_INFECT, EVENT_RECOVER,
+				EVENT_VACCINATE, EVENT_SUSCEPTIBLE, EVENT_DIE};
+		bool lazy_events = false; // Also drop no-op events that draw numbers
+		Timing timing = Timing::STEPS;
+		Shuffle shuffle = Shuffle::FULL;
+		EncounterMode encounter_mode = EncounterMode::SEQUENTIAL;
+		size_t threads = 0; // Threads for several simulations (0 = one per core)
+		size_t shards = 0; // Shards of StorageLayout::SHARDS (0 = one per thread)
+		size_t report_every = 100; // Iterations between reports (0 = first and last)
+		bool aggregate = false; // Report only the aggregate over the simulations
 		int output_agents = 0;
 		std::string agent_filename = "agents.csv";
+		AgentFormat agent_format = AgentFormat::CSV;
+		bool async_output = false; // Write the output on a thread of its own
+		size_t output_queue = 4096; // Records the async writer holds
+		OutputFull output_full = OutputFull::WAIT;
+		Compaction compaction = Compaction::OFF;
+		size_t compact_every = 0; // Iterations between compactions (0 = never)
+		double compact_dead = 0.25; // Dead fraction that compacts (0 = never)
+		size_t checkpoint_every = 0; // Iterations between checkpoints (0 = never)
+		std::string checkpoint_file = "checkpoint.bin"; // Named per simulation
 };
 
+/// Longest report row format_report() writes: nine 20 digit fields
+const size_t REPORT_ROW_MAX = 9 * 21;
+
+/// Writes the csv report row of simulation identity at iteration followed by
+/// values (S, I, R, V, D, TI, TID) to out, which must have room for
+/// REPORT_ROW_MAX chars, and returns the end of the row. std::to_chars
+/// neither allocates nor looks at the locale.
+inline char* format_report(char *out, uint64_t identity, uint64_t iteration,
+				const uint64_t values[7]) {
+		// Each field has at most 20 digits
+		out = std::to_chars(out, out + 20, identity).ptr;
+		*out++ = ',';
+		out = std::to_chars(out, out + 20, iteration).ptr;
+		for (size_t i = 0; i < 7; i++) {
+				*out++ = ',';
+				out = std::to_chars(out, out + 20, values[i]).ptr;
+		}
+		*out++ = '\n';
+		return out;
+}
+
+/// The csv header of the report rows
+const char REPORT_HEADER[] = "#,iter,S,I,R,V,D,TI,TID\n";
+
 /// Holds an agent who has two attributes, a unique identity and a state.
 struct Agent {
 		Agent(int identity_, State state_) : identity(identity_), state(state_) {};
@@ -95,6 +259,11 @@ struct Agent {
 
 void shuffle(std::vector<Agent>  &agents, Rng& rng);
 
+/// Number of heap allocations the program has made so far, for checking that
+/// the iteration loop makes none. Only debug builds count them; with NDEBUG
+/// defined this is always 0.
+size_t allocation_count();
+
 /// This is used to represent a snapshot of stats for a simulation.
 struct Statistics {
 		size_t susceptible;
@@ -103,7 +272,8 @@ struct Statistics {
 		size_t vaccinated;
 		size_t dead;
 
-		Statistics(const std::vector<Agent> &agents) {
+		template <typename Allocator>
+		Statistics(const std::vector<Agent, Allocator> &agents) {
 				susceptible = std::count_if(agents.begin(), agents.end(),
 								[](const Agent &a) {
 								return a.state == State::SUSCEPTIBLE;
@@ -125,203 +295,2246 @@ struct Statistics {
 								return a.state == State::DEAD;
 								});
 		}
+
+		Statistics() : susceptible(0), infectious(0), recovered(0),
+				vaccinated(0), dead(0) {}
+
+		/// Returns the counter of agents in the given state.
+		size_t& operator[](State state) {
+				switch(state) {
+						case State::SUSCEPTIBLE: return susceptible;
+						case State::INFECTIOUS: return infectious;
+						case State::RECOVERED: return recovered;
+						case State::VACCINATED: return vaccinated;
+						default: return dead;
+				}
+		}
+
+		/// Moves one agent's count from one state to another.
+		void move(State from, State to) {
+				--(*this)[from];
+				++(*this)[to];
+		}
+
+		bool operator==(const Statistics &other) const {
+				return susceptible == other.susceptible &&
+						infectious == other.infectious &&
+						recovered == other.recovered &&
+						vaccinated == other.vaccinated &&
+						dead == other.dead;
+		}
 };
 
-/// This is the data structure for the simulation engine.
-struct Simulation {
+/// A per-agent event as a table over states, for the vectorized kernels. An
+/// agent in state s moves to targets[s] when its 32 bit draw is below
+/// thresholds[s].
+struct TransitionTable {
+		uint32_t thresholds[STATE_COUNT] = {};
+		State targets[STATE_COUNT] = {State::SUSCEPTIBLE, State::INFECTIOUS,
+				State::RECOVERED, State::VACCINATED, State::DEAD};
+
+		void add(State from, State to, double prob) {
+				targets[from] = to;
+				if (prob <= 0.0)
+						thresholds[from] = 0;
+				else if (prob >= 1.0)
+						thresholds[from] = UINT32_MAX;
+				else
+						thresholds[from] = (uint32_t) std::round(prob * 4294967296.0);
+		}
+
+		/// Whether any of the n states can change. This is much cheaper than a
+		/// kernel call, so blocks without eligible agents skip the draws.
+		bool applies(const uint8_t *states, size_t n) const {
+				uint8_t eligible[STATE_COUNT];
+				for (size_t s = 0; s < STATE_COUNT; s++)
+						eligible[s] = thresholds[s] > 0;
+				// Byte compares rather than a lookup, so that the loop vectorizes
+				uint8_t found = 0;
+				for (size_t i = 0; i < n; i++) {
+						uint8_t s = states[i];
+						found |= ((s == 0) & eligible[0]) | ((s == 1) & eligible[1]) |
+								((s == 2) & eligible[2]) | ((s == 3) & eligible[3]) |
+								((s == 4) & eligible[4]);
+				}
+				return found != 0;
+		}
+};
+
+/// What recover(), vaccinate(), susceptible() and die() do to an agent in
+/// one iteration, for Timing::EVENTS: the probability that an agent in each
+/// state ends the iteration in another, and the states it can end up in.
+/// Going round to the same state (vaccinated and back) counts as staying.
+struct IterationOutcomes {
+		struct Outcome {
+				State to;
+				double prob;
+				bool infection_death; // Died while infectious
+		};
+		Outcome outcomes[STATE_COUNT][4];
+		size_t count[STATE_COUNT] = {};
+		double leave[STATE_COUNT] = {}; // Sum of the state's outcomes
+		double log_stay[STATE_COUNT] = {}; // log(1 - leave)
+
+		IterationOutcomes() = default;
+
+		explicit IterationOutcomes(const Parameters &p) {
+				// Regressed agents go on to die as susceptible ones.
+				const double back = p.regression_prob;
+				const double die = p.death_prob_susceptible;
+				add(State::SUSCEPTIBLE, State::VACCINATED, p.vaccination_prob * (1 - back));
+				add(State::SUSCEPTIBLE, State::DEAD,
+								die * (1 - p.vaccination_prob + p.vaccination_prob * back));
+				const double stay = 1 - p.recovery_prob;
+				add(State::INFECTIOUS, State::DEAD, stay * p.death_prob_infectious, true);
+				add(State::INFECTIOUS, State::RECOVERED, p.recovery_prob * (1 - back));
+				add(State::INFECTIOUS, State::SUSCEPTIBLE,
+								p.recovery_prob * back * (1 - die));
+				add(State::INFECTIOUS, State::DEAD, p.recovery_prob * back * die);
+				for (State from: {State::RECOVERED, State::VACCINATED}) {
+						add(from, State::SUSCEPTIBLE, back * (1 - die));
+						add(from, State::DEAD, back * die);
+				}
+				for (size_t s = 0; s < STATE_COUNT; s++)
+						log_stay[s] = std::log1p(-std::min(leave[s], 1.0));
+		}
+
+		/// Index of the outcome of an agent in state from that leaves it,
+		/// u being uniform in [0, 1)
+		size_t pick(State from, double u) const {
+				u *= leave[from];
+				size_t k = 0;
+				while (k + 1 < count[from] && u >= outcomes[from][k].prob)
+						u -= outcomes[from][k++].prob;
+				return k;
+		}
+
+private:
+		void add(State from, State to, double prob, bool infection_death = false) {
+				if (prob <= 0)
+						return;
+				outcomes[from][count[from]++] = {to, prob, infection_death};
+				leave[from] += prob;
+		}
+};
+
+/// Number of agents each kernel call handles
+const size_t KERNEL_BLOCK = 256;
+
+/// The 32 bit draw of the vectorized kernels for the agent at position. Each
+/// Philox call serves two agents: within every group of 16 positions, call
+/// k gives its low word to position k and its high word to position k + 8.
+/// The layout does not depend on the vector width, so every kernel (and a
+/// scalar sweep over an index set) draws the same number for an agent.
+inline uint32_t kernel_draw(const Philox2x32 &philox, uint64_t stream,
+				size_t position) {
+		uint64_t r = philox((stream << 32) | ((position / 16) * 8 + position % 8));
+		return position % 16 < 8 ? (uint32_t) r : (uint32_t) (r >> 32);
+}
+
+/// Signature of the vectorized kernels. A kernel sets bit i of hits for every
+/// agent in states[0, n) whose draw kernel_draw(philox, stream, first + i)
+/// falls below its state's threshold, and returns how many bits it set.
+/// first must be a multiple of 16 and n at most KERNEL_BLOCK.
+typedef size_t (*TransitionKernel)(const uint8_t *states, size_t n,
+				const TransitionTable &table, const Philox2x32 &philox, uint64_t stream,
+				size_t first, uint64_t *hits);
+
+/// The kernels the running CPU supports, from the scalar fallback up to the
+/// widest vector unit (AVX2 and AVX-512 on x86-64, NEON on AArch64).
+std::vector<TransitionKernel> supported_kernels();
+
+/// Runs the widest supported kernel, which is chosen on the first call.
+size_t transition_hits(const uint8_t *states, size_t n,
+				const TransitionTable &table, const Philox2x32 &philox, uint64_t stream,
+				size_t first, uint64_t *hits);
+
+/// Reference agent storage: an array of Agent structs. Every event visits all
+/// agents in position order, which keeps the random number stream identical
+/// to the implementations in the other languages. The per-state counts are
+/// kept current on every transition, so records must only be changed through
+/// the member functions.
+struct AgentArray {
+		AgentVector<Agent> records;
+		Statistics counts;
+
+		size_t size() const {
+				return records.size();
+		}
+
+		int identity(size_t i) const {
+				return records[i].identity;
+		}
+
+		State state(size_t i) const {
+				return records[i].state;
+		}
+
+		void set_state(size_t i, State state) {
+				counts.move(records[i].state, state);
+				records[i].state = state;
+		}
+
+		void push_back(int identity, State state) {
+				records.push_back(Agent(identity, state));
+				++counts[state];
+		}
+
+		/// Appends count agents in state, with the identities identity to
+		/// identity + count - 1
+		void append(int identity, State state, size_t count) {
+				for (size_t i = 0; i < count; i++)
+						records.emplace_back(identity + i, state);
+				counts[state] += count;
+		}
+
+		/// Makes room for n agents
+		void reserve(size_t n) {
+				records.reserve(n);
+		}
+
+		/// Removes every agent but keeps the memory
+		void clear() {
+				records.clear();
+				counts = Statistics();
+		}
+
+		/// Removes the dead agents, calling removed(position, identity) for
+		/// each in position order, and keeps the others in order.
+		template <typename F>
+		void remove_dead(F removed) {
+				size_t kept = 0;
+				for (size_t i = 0; i < records.size(); i++) {
+						if (records[i].state == State::DEAD)
+								removed(i, records[i].identity);
+						else
+								records[kept++] = records[i];
+				}
+				records.erase(records.begin() + kept, records.end());
+				counts.dead = 0;
+		}
+
+		/// Hints that agent i is about to be read
+		void prefetch(size_t i) const {
+				__builtin_prefetch(&records[i]);
+		}
+
+		/// Tells the kernel how the next passes read the agents
+		void advise(Access access) const {
+				::advise(records, access);
+		}
+
+		void swap(size_t i, size_t j) {
+				Agent t = records[j];
+				records[j] = records[i];
+				records[i] = t;
+		}
+
+		/// Number of agents that are not dead
+		size_t living() const {
+				return records.size() - counts.dead;
+		}
+
+		Statistics statistics() const {
+				return counts;
+		}
+
+		/// Counts the states from scratch (for checking the counters)
+		Statistics recount() const {
+				return Statistics(records);
+		}
+
+		/// Calls f(position, state) for every agent whose state is in from, in
+		/// position order. f returns the agent's new state.
+		template <typename F>
+		void transition(std::initializer_list<State> from, F f) {
+				for (size_t i = 0; i < records.size(); i++) {
+						State state = records[i].state;
+						if (std::find(from.begin(), from.end(), state) != from.end()) {
+								State next = f(i, state);
+								counts.move(state, next);
+								records[i].state = next;
+						}
+				}
+		}
+
+		/// Moves each agent in state from to state to with probability prob and
+		/// returns the number moved. There are no index sets to skip over, so
+		/// this always draws once per agent.
+		template <typename Engine>
+		size_t sample(State from, State to, double prob, Engine &rng) {
+				size_t moved = 0;
+				transition({from}, [&](size_t, State state) {
+								if (rng.real() < prob) {
+										++moved;
+										return to;
+								}
+								return state;
+								});
+				return moved;
+		}
+
+		/// Applies table to every agent with the kernel draws, one agent at a
+		/// time. Gives the same result as AgentColumns::step. Returns how many
+		/// agents left each state.
+		Statistics step(const TransitionTable &table, const Philox2x32 &philox,
+						uint64_t stream) {
+				Statistics moved;
+				step(&table, 1, philox, stream, &moved);
+				return moved;
+		}
+
+		/// Applies count stages to every agent in one pass, stage s drawing from
+		/// stream + s, and adds the agents that left each state in stage s to
+		/// moved[s]. An agent can move in several stages.
+		void step(const TransitionTable *stages, size_t count,
+						const Philox2x32 &philox, uint64_t stream, Statistics *moved) {
+				for (size_t i = 0; i < records.size(); i++) {
+						State from = records[i].state;
+						State state = from;
+						for (size_t s = 0; s < count; s++) {
+								if (kernel_draw(philox, stream + s, i) < stages[s].thresholds[state]) {
+										++moved[s][state];
+										state = stages[s].targets[state];
+								}
+						}
+						if (state != from)
+								set_state(i, state);
+				}
+		}
+
+		void sort_by_identity() {
+				sort(records.begin(), records.end(), [](const Agent &a, const Agent &b) {
+								return a.identity < b.identity;
+								});
+		}
+};
+
+/// Structure-of-arrays agent storage. States are packed one byte per agent
+/// next to a separate identity column, and every state keeps a dense index
+/// set of the agents in it (removal swaps the last member into the hole), so
+/// events only visit the agents they can affect. Positions are 32 bit.
+struct AgentColumns {
+		AgentVector<int> identities;
+		AgentVector<uint8_t> states;
+		AgentVector<uint32_t> slots; // Position of each agent in its index set
+		AgentVector<uint32_t> members[STATE_COUNT]; // Index set of each state
+
+		/// step() sweeps the index sets rather than the whole state column
+		/// when fewer than one agent in this many can change.
+		static const size_t SPARSE_RATIO = 8;
+
+		/// Most stages step() can run in one pass
+		static const size_t MAX_STAGES = 8;
+
+		size_t size() const {
+				return states.size();
+		}
+
+		int identity(size_t i) const {
+				return identities[i];
+		}
+
+		State state(size_t i) const {
+				return (State) states[i];
+		}
+
+		void set_state(size_t i, State state) {
+				if (states[i] == state)
+						return;
+				remove_member(i);
+				add_member(i, state);
+		}
+
+		void push_back(int identity, State state) {
+				identities.push_back(identity);
+				states.push_back(state);
+				slots.push_back(0);
+				add_member(states.size() - 1, state);
+		}
+
+		void append(int identity, State state, size_t count) {
+				size_t first = states.size();
+				states.resize(first + count, state);
+				identities.resize(first + count);
+				slots.resize(first + count);
+				AgentVector<uint32_t> &set = members[state];
+				for (size_t i = first; i < first + count; i++) {
+						identities[i] = identity + (i - first);
+						slots[i] = set.size();
+						set.push_back(i);
+				}
+		}
+
+		/// Makes room for n agents in the columns and in every index set, and
+		/// for the hits of a sparse step().
+		void reserve(size_t n) {
+				identities.reserve(n);
+				states.reserve(n);
+				slots.reserve(n);
+				for (auto &set: members)
+						set.reserve(n);
+				hits.reserve(n / SPARSE_RATIO + 1);
+		}
+
+		void clear() {
+				identities.clear();
+				states.clear();
+				slots.clear();
+				for (auto &set: members)
+						set.clear();
+		}
+
+		/// As AgentArray::remove_dead(). The index sets are rebuilt in
+		/// position order.
+		template <typename F>
+		void remove_dead(F removed) {
+				size_t kept = 0;
+				for (size_t i = 0; i < states.size(); i++) {
+						if (states[i] == State::DEAD) {
+								removed(i, identities[i]);
+						} else {
+								identities[kept] = identities[i];
+								states[kept++] = states[i];
+						}
+				}
+				identities.resize(kept);
+				states.resize(kept);
+				slots.resize(kept);
+				for (auto &set: members)
+						set.clear();
+				for (size_t i = 0; i < kept; i++)
+						add_member(i, (State) states[i]);
+		}
+
+		/// Puts agent i at order[i] of its index set, which must already have
+		/// its size, as when the agents were pushed back in position order.
+		/// Restores the order the events visit the members in.
+		void set_slots(const uint32_t *order) {
+				for (size_t i = 0; i < states.size(); i++) {
+						slots[i] = order[i];
+						members[states[i]][order[i]] = i;
+				}
+		}
+
+		/// Hints that agent i is about to be read
+		void prefetch(size_t i) const {
+				__builtin_prefetch(&states[i]);
+		}
+
+		void advise(Access access) const {
+				::advise(identities, access);
+				::advise(states, access);
+				::advise(slots, access);
+				for (const auto &set: members)
+						::advise(set, access);
+		}
+
+		void swap(size_t i, size_t j) {
+				std::swap(identities[i], identities[j]);
+				std::swap(states[i], states[j]);
+				std::swap(slots[i], slots[j]);
+				members[states[i]][slots[i]] = i;
+				members[states[j]][slots[j]] = j;
+		}
+
+		size_t living() const {
+				return states.size() - members[State::DEAD].size();
+		}
+
+		Statistics statistics() const {
+				Statistics stats;
+				stats.susceptible = members[State::SUSCEPTIBLE].size();
+				stats.infectious = members[State::INFECTIOUS].size();
+				stats.recovered = members[State::RECOVERED].size();
+				stats.vaccinated = members[State::VACCINATED].size();
+				stats.dead = members[State::DEAD].size();
+				return stats;
+		}
+
+		Statistics recount() const {
+				Statistics stats;
+				for (uint8_t state: states)
+						++stats[(State) state];
+				return stats;
+		}
+
+		/// Calls f(position, state) for every agent in the index sets of from,
+		/// one state after the other. f returns the agent's new state, which
+		/// must not be one of the other states in from. Each set is walked
+		/// backwards so that swap-removals only move already visited members.
+		template <typename F>
+		void transition(std::initializer_list<State> from, F f) {
+				for (State state: from) {
+						AgentVector<uint32_t> &set = members[state];
+						for (size_t k = set.size(); k-- > 0;) {
+								size_t i = set[k];
+								set_state(i, f(i, state));
+						}
+				}
+		}
+
+		/// Moves each agent in state from to state to with probability prob and
+		/// returns the number moved. Instead of one draw per member, this draws
+		/// the geometric gap to the next success, walking the index set down
+		/// from the top so that swap-removals only move passed members.
+		template <typename Engine>
+		size_t sample(State from, State to, double prob, Engine &rng) {
+				AgentVector<uint32_t> &set = members[from];
+				size_t moved = 0;
+				if (prob <= 0.0)
+						return moved;
+				if (prob >= 1.0) {
+						while (set.size() > 0) {
+								set_state(set.back(), to);
+								++moved;
+						}
+						return moved;
+				}
+				const double denominator = std::log1p(-prob);
+				size_t k = set.size();
+				for (;;) {
+						double gap = std::floor(std::log(1.0 - gap_real(rng)) / denominator);
+						if (gap >= k)
+								break;
+						k -= (size_t) gap + 1;
+						set_state(set[k], to);
+						++moved;
+				}
+				return moved;
+		}
+
+		/// Applies table to every agent with the kernel draws and returns how
+		/// many agents left each state. Dense tables run the vectorized kernel
+		/// over the state column, touching the index sets only for blocks with
+		/// hits. Sparse ones sweep the index sets of the states they can change
+		/// instead, which gives the same result because every agent's draw
+		/// depends only on its position.
+		Statistics step(const TransitionTable &table, const Philox2x32 &philox,
+						uint64_t stream) {
+				Statistics moved;
+				if (eligible(table) * SPARSE_RATIO < states.size()) {
+						hits.clear();
+						for (size_t s = 0; s < STATE_COUNT; s++) {
+								if (table.thresholds[s] == 0)
+										continue;
+								for (uint32_t i: members[s])
+										if (kernel_draw(philox, stream, i) < table.thresholds[s])
+												hits.push_back(i);
+						}
+						for (uint32_t i: hits) {
+								State from = (State) states[i];
+								++moved[from];
+								set_state(i, table.targets[from]);
+						}
+						return moved;
+				}
+				step(&table, 1, philox, stream, &moved);
+				return moved;
+		}
+
+		/// Applies count stages to every agent in one pass over the state
+		/// column, stage s drawing from stream + s, and adds the agents that
+		/// left each state in stage s to moved[s]. Every block of the column
+		/// goes through all the stages while it is in cache, and the index sets
+		/// are updated once per agent that changed.
+		void step(const TransitionTable *stages, size_t count,
+						const Philox2x32 &philox, uint64_t stream, Statistics *moved) {
+				assert(count <= MAX_STAGES);
+				// Only stages that few agents are eligible for check each block
+				// before drawing.
+				bool check[MAX_STAGES];
+				for (size_t s = 0; s < count; s++)
+						check[s] = eligible(stages[s]) * 2 < states.size();
+				uint64_t hits[KERNEL_BLOCK / 64];
+				uint8_t block[KERNEL_BLOCK];
+				for (size_t first = 0; first < states.size(); first += KERNEL_BLOCK) {
+						size_t n = std::min(KERNEL_BLOCK, states.size() - first);
+						const uint8_t *current = &states[first];
+						for (size_t s = 0; s < count; s++) {
+								if ((check[s] && !stages[s].applies(current, n)) ||
+												transition_hits(current, n, stages[s], philox, stream + s,
+														first, hits) == 0)
+										continue;
+								if (current != block) {
+										std::copy(current, current + n, block);
+										current = block;
+								}
+								for (size_t w = 0; w * 64 < n; w++) {
+										for (uint64_t bits = hits[w]; bits; bits &= bits - 1) {
+												size_t i = w * 64 + __builtin_ctzll(bits);
+												++moved[s][(State) block[i]];
+												block[i] = stages[s].targets[block[i]];
+										}
+								}
+						}
+						if (current != block)
+								continue;
+						for (size_t i = 0; i < n; i++)
+								if (block[i] != states[first + i])
+										set_state(first + i, (State) block[i]);
+				}
+		}
+
+		/// Number of agents that table can change
+		size_t eligible(const TransitionTable &table) const {
+				size_t count = 0;
+				for (size_t s = 0; s < STATE_COUNT; s++)
+						if (table.thresholds[s] > 0)
+								count += members[s].size();
+				return count;
+		}
+
+		/// Identities are always 0 to size() - 1, so each agent can be placed
+		/// directly at its identity.
+		void sort_by_identity() {
+				AgentVector<uint8_t> sorted(states.size());
+				for (size_t i = 0; i < states.size(); i++)
+						sorted[identities[i]] = states[i];
+				states.swap(sorted);
+				for (size_t i = 0; i < identities.size(); i++)
+						identities[i] = i;
+				for (auto &set: members)
+						set.clear();
+				for (size_t i = 0; i < states.size(); i++)
+						add_member(i, (State) states[i]);
+		}
+
+private:
+		std::vector<uint32_t> hits; // Scratch of the sparse step()
+
+		void add_member(size_t i, State state) {
+				states[i] = state;
+				slots[i] = members[state].size();
+				members[state].push_back(i);
+		}
+
+		void remove_member(size_t i) {
+				AgentVector<uint32_t> &set = members[states[i]];
+				uint32_t last = set.back();
+				set[slots[i]] = last;
+				slots[last] = slots[i];
+				set.pop_back();
+		}
+};
+
+/// Agent storage of states alone, BITS (8 or 4) per agent, for populations
+/// too large for the other layouts. There is no identity column: an agent's
+/// identity is its position. swap() exchanges the states of two positions,
+/// so runs give the same results as with AgentArray, but after a full
+/// shuffle the identities in the agent output no longer follow the agents.
+/// Shuffle::PARTIAL never moves them. The per-state counts are kept as in
+/// AgentArray.
+template <unsigned BITS>
+struct AgentCompact {
+		static_assert(BITS == 8 || BITS == 4, "states take 8 or 4 bits");
+		static const size_t PER_BYTE = 8 / BITS;
+
+		AgentVector<uint8_t> bytes;
+		Statistics counts;
+
+		size_t size() const {
+				return count;
+		}
+
+		int identity(size_t i) const {
+				return i;
+		}
+
+		State state(size_t i) const {
+				if (BITS == 8)
+						return (State) bytes[i];
+				return (State) ((bytes[i / 2] >> (i % 2 * 4)) & 0xf);
+		}
+
+		void set_state(size_t i, State state) {
+				counts.move(this->state(i), state);
+				store(i, state);
+		}
+
+		/// identity must be size(), the position the agent gets
+		void push_back(int identity, State state) {
+				append(identity, state, 1);
+		}
+
+		/// identity must be size()
+		void append(int identity, State state, size_t n) {
+				assert((size_t) identity == count);
+				(void) identity;
+				if (n == 0)
+						return;
+				bytes.resize((count + n + PER_BYTE - 1) / PER_BYTE);
+				if (BITS == 8) {
+						std::fill(bytes.begin() + count, bytes.end(), state);
+				} else {
+						size_t i = count;
+						for (; i < count + n && i % 2 != 0; i++)
+								store(i, state);
+						std::fill(bytes.begin() + i / 2, bytes.end(), state * 0x11);
+				}
+				count += n;
+				counts[state] += n;
+		}
+
+		void reserve(size_t n) {
+				bytes.reserve((n + PER_BYTE - 1) / PER_BYTE);
+		}
+
+		void clear() {
+				bytes.clear();
+				count = 0;
+				counts = Statistics();
+		}
+
+		void prefetch(size_t i) const {
+				__builtin_prefetch(&bytes[i / PER_BYTE]);
+		}
+
+		void advise(Access access) const {
+				::advise(bytes, access);
+		}
+
+		void swap(size_t i, size_t j) {
+				State t = state(i);
+				store(i, state(j));
+				store(j, t);
+		}
+
+		size_t living() const {
+				return count - counts.dead;
+		}
+
+		Statistics statistics() const {
+				return counts;
+		}
+
+		Statistics recount() const {
+				Statistics stats;
+				for (size_t i = 0; i < count; i++)
+						++stats[state(i)];
+				return stats;
+		}
+
+		/// As AgentArray::transition()
+		template <typename F>
+		void transition(std::initializer_list<State> from, F f) {
+				for (size_t i = 0; i < count; i++) {
+						State state = this->state(i);
+						if (std::find(from.begin(), from.end(), state) != from.end())
+								set_state(i, f(i, state));
+				}
+		}
+
+		/// As AgentArray::sample(), one draw per agent
+		template <typename Engine>
+		size_t sample(State from, State to, double prob, Engine &rng) {
+				size_t moved = 0;
+				transition({from}, [&](size_t, State state) {
+								if (rng.real() < prob) {
+										++moved;
+										return to;
+								}
+								return state;
+								});
+				return moved;
+		}
+
+		Statistics step(const TransitionTable &table, const Philox2x32 &philox,
+						uint64_t stream) {
+				Statistics moved;
+				step(&table, 1, philox, stream, &moved);
+				return moved;
+		}
+
+		/// As AgentColumns::step(), with the vectorized kernels run on each
+		/// block of states unpacked to a byte per agent.
+		void step(const TransitionTable *stages, size_t count,
+						const Philox2x32 &philox, uint64_t stream, Statistics *moved) {
+				assert(count <= AgentColumns::MAX_STAGES);
+				bool check[AgentColumns::MAX_STAGES];
+				for (size_t s = 0; s < count; s++) {
+						size_t eligible = 0;
+						for (size_t k = 0; k < STATE_COUNT; k++)
+								if (stages[s].thresholds[k] > 0)
+										eligible += counts[(State) k];
+						check[s] = eligible * 2 < this->count;
+				}
+				uint64_t hits[KERNEL_BLOCK / 64];
+				uint8_t block[KERNEL_BLOCK], original[KERNEL_BLOCK];
+				for (size_t first = 0; first < this->count; first += KERNEL_BLOCK) {
+						size_t n = std::min(KERNEL_BLOCK, this->count - first);
+						unpack(first, n, block);
+						bool changed = false;
+						for (size_t s = 0; s < count; s++) {
+								if ((check[s] && !stages[s].applies(block, n)) ||
+												transition_hits(block, n, stages[s], philox, stream + s,
+														first, hits) == 0)
+										continue;
+								changed = true;
+								for (size_t w = 0; w * 64 < n; w++) {
+										for (uint64_t bits = hits[w]; bits; bits &= bits - 1) {
+												size_t i = w * 64 + __builtin_ctzll(bits);
+												++moved[s][(State) block[i]];
+												block[i] = stages[s].targets[block[i]];
+										}
+								}
+						}
+						if (!changed)
+								continue;
+						unpack(first, n, original);
+						for (size_t i = 0; i < n; i++)
+								if (block[i] != original[i])
+										set_state(first + i, (State) block[i]);
+				}
+		}
+
+		/// Identities are positions, so the agents are always sorted
+		void sort_by_identity() {}
+
+private:
+		size_t count = 0; // Agents, which in PACKED is not bytes.size()
+
+		/// Writes the states of the n agents from first, which must be even
+		/// when packed, to out as a byte each
+		void unpack(size_t first, size_t n, uint8_t *out) const {
+				if (BITS == 8) {
+						std::copy(&bytes[first], &bytes[first] + n, out);
+						return;
+				}
+				const uint8_t *in = &bytes[first / 2];
+				for (size_t j = 0; j < n / 2; j++) {
+						out[2 * j] = in[j] & 0xf;
+						out[2 * j + 1] = in[j] >> 4;
+				}
+				if (n % 2 != 0)
+						out[n - 1] = in[n / 2] & 0xf;
+		}
+
+		void store(size_t i, State state) {
+				if (BITS == 8) {
+						bytes[i] = state;
+						return;
+				}
+				uint8_t &byte = bytes[i / 2];
+				size_t shift = i % 2 * 4;
+				byte = (byte & ~(0xf << shift)) | (state << shift);
+		}
+};
+
+/// Shuffles any agent storage with the same draws as shuffle() above.
+template <typename Storage, typename Engine>
+void shuffle(Storage &agents, Engine &rng)
+{
+		for (size_t i = agents.size() - 1; i > 0; --i) {
+				size_t j = rng.to(i + 1);
+				agents.swap(i, j);
+		}
+}
+
+/// Writes the first k entries of a uniform random permutation of 0 to n - 1
+/// to result: a Fisher-Yates shuffle run from the front and stopped after k
+/// swaps. Only displaced entries are stored, in an open addressing table
+/// taken from arena, so this is O(k) whatever n is.
+template <typename Engine>
+void partial_shuffle(size_t n, size_t k, Engine &rng, uint32_t *result,
+				ScratchArena &arena)
+{
+		// At most 2k entries are displaced, so the table stays at most half full.
+		size_t capacity = 16;
+		while (capacity < 4 * k)
+				capacity *= 2;
+		const uint32_t EMPTY = UINT32_MAX;
+		uint32_t *keys = arena.allocate<uint32_t>(capacity);
+		uint32_t *values = arena.allocate<uint32_t>(capacity);
+		std::fill(keys, keys + capacity, EMPTY);
+		auto find = [&](uint32_t position) {
+				size_t slot = (position * 0x9e3779b9u) & (capacity - 1);
+				while (keys[slot] != EMPTY && keys[slot] != position)
+						slot = (slot + 1) & (capacity - 1);
+				return slot;
+		};
+		auto at = [&](uint32_t position) {
+				size_t slot = find(position);
+				return keys[slot] == EMPTY ? position : values[slot];
+		};
+		for (size_t i = 0; i < k; i++) {
+				uint32_t j = i + rng.to(n - i);
+				uint32_t entry = at(j);
+				uint32_t displaced = at(i);
+				size_t slot = find(j);
+				keys[slot] = j;
+				values[slot] = displaced;
+				result[i] = entry;
+		}
+}
+
+/// partial_shuffle() into a new vector
+template <typename Engine>
+std::vector<uint32_t> partial_shuffle(size_t n, size_t k, Engine &rng)
+{
+		std::vector<uint32_t> result(k);
+		ScratchArena arena;
+		partial_shuffle(n, k, rng, result.data(), arena);
+		return result;
+}
+
+/// Sets up storage for a simulation with parameters before any agent is
+/// added; pool is the simulation's threads, if it has any. Only storages with
+/// settings of their own (AgentShards) overload it.
+template <typename Storage>
+void configure(Storage&, const Parameters&, std::shared_ptr<ForkJoin>) {}
+
+/// Calls agents.remove_dead(removed) and returns true, or returns false for
+/// storages that cannot remove agents: AgentCompact, whose identities are
+/// positions, and AgentShards, whose shards are dealt out by position.
+template <typename Storage, typename F>
+bool remove_dead(Storage&, F) {
+		return false;
+}
+
+template <typename F>
+bool remove_dead(AgentArray &agents, F removed) {
+		agents.remove_dead(removed);
+		return true;
+}
+
+template <typename F>
+bool remove_dead(AgentColumns &agents, F removed) {
+		agents.remove_dead(removed);
+		return true;
+}
+
+/// Slot of agent i in the index set of its state, or 0 for storages without
+/// index sets. Checkpoints save it, as the sets' order decides the order of
+/// the draws.
+template <typename Storage>
+uint32_t index_slot(const Storage&, size_t) {
+		return 0;
+}
+
+inline uint32_t index_slot(const AgentColumns &agents, size_t i) {
+		return agents.slots[i];
+}
+
+/// Restores the index_slot() of every agent after they were pushed back in
+/// position order
+template <typename Storage>
+void set_index_slots(Storage&, const uint32_t*) {}
+
+inline void set_index_slots(AgentColumns &agents, const uint32_t *slots) {
+		agents.set_slots(slots);
+}
+
+/// Whether slots, read from a checkpoint, are the index_slot()s of agents
+/// in the count states: all 0 for storages without index sets.
+template <typename Storage>
+bool index_slots_valid(const Storage&, const uint8_t*, const uint32_t *slots,
+				size_t count) {
+		return std::all_of(slots, slots + count, [](uint32_t s) { return s == 0; });
+}
+
+/// Whether the slots of the agents in each of groups index sets, agent i
+/// being in set of(i), are each of the set's slots once
+template <typename Of>
+bool index_sets_valid(const uint32_t *slots, size_t count, size_t groups, Of of) {
+		std::vector<size_t> first(groups + 1);
+		for (size_t i = 0; i < count; i++)
+				++first[of(i) + 1];
+		for (size_t g = 0; g < groups; g++)
+				first[g + 1] += first[g];
+		std::vector<bool> seen(count);
+		for (size_t i = 0; i < count; i++) {
+				const size_t g = of(i);
+				if (slots[i] >= first[g + 1] - first[g] || seen[first[g] + slots[i]])
+						return false;
+				seen[first[g] + slots[i]] = true;
+		}
+		return true;
+}
+
+/// The slots of each state's agents are each of its set's slots once.
+inline bool index_slots_valid(const AgentColumns&, const uint8_t *states,
+				const uint32_t *slots, size_t count) {
+		return index_sets_valid(slots, count, STATE_COUNT,
+						[states](size_t i) { return states[i]; });
+}
+
+/// The position in [0, size) of encounter i's agent end (0 or 1), for
+/// the counter-based encounters below.
+inline size_t encounter_position(const Philox2x32 &philox, uint64_t stream,
+				size_t i, size_t end, size_t size) {
+		uint64_t r = philox((stream << 32) | (2 * i + end));
+		return (uint64_t) (((uint128_t) r * size) >> 64);
+}
+
+/// infect_method_one() with the encounters drawn from philox rather than the
+/// simulation's engine, so that they can be drawn in any order. Returns the
+/// number of infections. AgentShards overloads it to run in parallel.
+template <typename Storage>
+size_t encounter(Storage &agents, size_t count, const Philox2x32 &philox,
+				uint64_t stream) {
+		size_t infections = 0;
+		for (size_t i = 0; i < count; i++) {
+				size_t ind1 = encounter_position(philox, stream, i, 0, agents.size());
+				size_t ind2 = encounter_position(philox, stream, i, 1, agents.size());
+				if (agents.state(ind1) == State::SUSCEPTIBLE &&
+								agents.state(ind2) == State::INFECTIOUS) {
+						agents.set_state(ind1, State::INFECTIOUS);
+						++infections;
+				} else if (agents.state(ind1) == State::INFECTIOUS &&
+								agents.state(ind2) == State::SUSCEPTIBLE) {
+						agents.set_state(ind2, State::INFECTIOUS);
+						++infections;
+				}
+		}
+		return infections;
+}
+
+/// Infects the agents at the count sorted, distinct positions, all of them
+/// susceptible, for encounter_batch(). AgentShards overloads it to run in
+/// parallel.
+template <typename Storage>
+void infect_all(Storage &agents, const uint32_t *positions, size_t count,
+				ForkJoin&) {
+		for (size_t k = 0; k < count; k++)
+				agents.set_state(positions[k], State::INFECTIOUS);
+}
+
+/// How many encounters ahead encounter_batch() prefetches the agents
+const size_t PREFETCH_DISTANCE = 16;
+
+/// Encounters per task of encounter_batch()
+const size_t ENCOUNTER_BLOCK = 4096;
+
+/// count encounters as a batch (EncounterMode::BATCHED). The encounters are
+/// split into blocks that the pool's threads take in turn. Each block draws
+/// its pairs from its own xoshiro256++, seeded from philox, then reads their
+/// states, prefetching the agents ahead, and collects the positions to
+/// infect. Those are merged, sorted and deduplicated, so the result depends
+/// on neither the number of threads nor their timing, and only then set.
+/// Returns the number of infections. The buffers come from arena. The pairs
+/// are drawn from cold + agents.size() positions, the first cold of them
+/// being dead agents compacted away (Compaction::EQUIVALENT).
+template <typename Storage>
+size_t encounter_batch(Storage &agents, size_t count, const Philox2x32 &philox,
+				uint64_t stream, ForkJoin &pool, ScratchArena &arena, size_t cold = 0) {
+		const size_t blocks = (count + ENCOUNTER_BLOCK - 1) / ENCOUNTER_BLOCK;
+		const size_t size = agents.size();
+		// Block k collects at most one position per encounter, from
+		// infected[k * ENCOUNTER_BLOCK] on.
+		uint32_t *infected = arena.allocate<uint32_t>(count);
+		size_t *found = arena.allocate<size_t>(blocks);
+		pool.run(blocks, [&](size_t k) {
+						const size_t n = std::min(ENCOUNTER_BLOCK, count - k * ENCOUNTER_BLOCK);
+						Xoshiro256pp rng(philox((stream << 32) | k));
+						uint32_t *part = infected + k * ENCOUNTER_BLOCK;
+						size_t hits = 0;
+						uint32_t pairs[2 * ENCOUNTER_BLOCK];
+						// Cold positions wrap around to size or more
+						for (size_t i = 0; i < 2 * n; i++)
+								pairs[i] = rng.to(size + cold) - cold;
+						for (size_t i = 0; i < n; i++) {
+								if (i + PREFETCH_DISTANCE < n) {
+										agents.prefetch(std::min<size_t>(pairs[2 * (i + PREFETCH_DISTANCE)],
+																size - 1));
+										agents.prefetch(std::min<size_t>(pairs[2 * (i + PREFETCH_DISTANCE) + 1],
+																size - 1));
+								}
+								if (pairs[2 * i] >= size || pairs[2 * i + 1] >= size)
+										continue;
+								State a = agents.state(pairs[2 * i]);
+								State b = agents.state(pairs[2 * i + 1]);
+								if (a == State::SUSCEPTIBLE && b == State::INFECTIOUS)
+										part[hits++] = pairs[2 * i];
+								else if (a == State::INFECTIOUS && b == State::SUSCEPTIBLE)
+										part[hits++] = pairs[2 * i + 1];
+						}
+						found[k] = hits;
+						});
+		// Moves the parts together in place; each only moves down.
+		size_t total = 0;
+		for (size_t k = 0; k < blocks; k++) {
+				std::copy(infected + k * ENCOUNTER_BLOCK,
+								infected + k * ENCOUNTER_BLOCK + found[k], infected + total);
+				total += found[k];
+		}
+		std::sort(infected, infected + total);
+		total = std::unique(infected, infected + total) - infected;
+		infect_all(agents, infected, total, pool);
+		return total;
+}
+
+/// Where the output of a run goes besides the simulations' output streams
+struct OutputTargets {
+		AsyncWriter *writer = nullptr; // Takes reports and snapshots
+		ReportAggregator *aggregator = nullptr; // Takes the reports instead
+		ProfileCollector *profiler = nullptr; // Takes the event times
+};
+
+/// This is the data structure for the simulation engine. Storage is one of
+/// AgentArray, AgentColumns, AgentCompact or AgentShards, and Engine is one
+/// of the random number engines in rng.hpp. METHOD ONE or TWO fixes the
+/// infection method at compile time, whatever parameters.infection_method
+/// says, so that the infection event is called directly and inlined; BOTH
+/// takes it from the parameters at run time.
+template <typename Storage, typename Engine = Rng,
+		InfectionMethod METHOD = InfectionMethod::BOTH>
+struct BasicSimulation {
 		size_t identity; // Unique id of this simulation
-		std::vector<Agent> agents; // Holds the simulation's agents
+		Storage agents; // Holds the simulation's agents
 		Parameters parameters;
 		size_t total_infections;
 		size_t infection_deaths = 0;
-		Rng rng;
+		Engine rng;
+		Philox2x32 philox; // Draws of the vectorized kernels
+		uint64_t kernel_stream = 0; // Counter block of the next kernel call
+		// Agents at the first positions of the virtual arrangement, at most
+		// encounters of them (Shuffle::PARTIAL only)
+		std::vector<uint32_t> arrangement;
+		// Identities of the dead agents compaction moved out of agents. With
+		// Compaction::EQUIVALENT they take the first positions of the
+		// population the encounters draw from.
+		std::vector<int> cold;
+		std::ostream *output = &std::cout; // Where the reports go
+		std::shared_ptr<ForkJoin> pool; // Threads of a single simulation
+		AsyncWriter *writer = nullptr; // Takes the output instead of output
+		ReportAggregator *aggregator = nullptr; // Takes the reports instead
+		ReportAggregate aggregate; // Reports not yet merged into aggregator
+		ProfileCollector *profiler = nullptr; // Takes profile when finished
+		size_t worker = 0; // Of the pool running it, whose metrics slot it adds to
+		EventProfile profile; // Event times (with ABM_PROFILE only)
+		std::string reports; // Report rows not yet written to output
+		// Column put before every report row, such as the parameter set of a
+		// sweep, whose header the sweep writes itself
+		std::string tag;
+		ScratchArena scratch; // Temporary buffers of the current iteration
+		std::shared_ptr<CheckpointWriter> checkpoints; // With checkpoint_every only
+		/// An event of the pipeline
+		using EventCall = void (BasicSimulation::*)();
+		std::vector<EventCall> pipeline; // What iterate() runs, in order
+		EventCall infect = nullptr; // The infection event of this simulation
+		bool skip_idle_infections = false; // See build_pipeline()
+		// With Timing::EVENTS, the agents' next transitions, which stand in
+		// for the per-agent events while scheduled is set
+		EventCalendar calendar;
+		IterationOutcomes outcomes;
+		bool scheduled = false;
+		size_t now = 0; // Iteration being run
+
+		/// Rows are written to output once reports holds this much
+		static const size_t REPORT_BATCH = 1 << 14;
+		size_t iteration = 0; // Iterations done so far
 
 		/// Initializes the simulation with a unique identity, initial number of
 		/// agents and initial number of infections.
-		Simulation(size_t identity, const Parameters& parameters) :
-				identity (identity), parameters(parameters), rng(identity) {
-						for (size_t i = 0; i < parameters.agents; i++) {
-								Agent agent(i, State::SUSCEPTIBLE);
-								agents.push_back(agent);
-						}
+		BasicSimulation(size_t identity, const Parameters& parameters) :
+				identity (identity), parameters(parameters), rng(identity),
+				philox(identity) {
+						reports.reserve(REPORT_BATCH + REPORT_ROW_MAX);
+						reset(identity, parameters);
+				}
+
+		/// The initial population reset() makes, kept to start simulations of
+		/// the same identity and same_start() parameters from
+		struct Start {
+				Storage agents;
+				Engine rng{0}; // After the shuffle
+				std::vector<uint32_t> arrangement;
+		};
+
+		/// Starts the simulation from start, as reset(identity, parameters,
+		/// start) does
+		BasicSimulation(size_t identity, const Parameters &parameters,
+						const Start &start) :
+				identity (identity), parameters(parameters), rng(identity),
+				philox(identity) {
+						reports.reserve(REPORT_BATCH + REPORT_ROW_MAX);
+						reset(identity, parameters, start);
+				}
+
+		/// Resumes the simulation that saved checkpoint, which must have had
+		/// the same parameters. It runs on exactly as the saved one would have.
+		BasicSimulation(const Parameters &parameters,
+						const std::vector<uint8_t> &checkpoint) :
+				identity(checkpoint_header(checkpoint).state.identity),
+				parameters(parameters), rng(identity), philox(identity) {
+						reports.reserve(REPORT_BATCH + REPORT_ROW_MAX);
+						restore(parameters, checkpoint);
+				}
+
+		/// Turns this into a new BasicSimulation(identity, parameters), which
+		/// it then runs exactly like, reusing the agent storage, the scratch
+		/// space and the threads. Once a simulation of as many agents has run,
+		/// this does not allocate. Output targets are kept.
+		void reset(size_t identity, const Parameters &parameters) {
+				prepare(identity, parameters);
+				// The population starts out all susceptible in identity order, so
+				// it is written straight into the kept buffers rather than copied
+				// from a template, which would read as much memory again.
+				agents.append(0, State::SUSCEPTIBLE, parameters.agents);
+				if (parameters.shuffle == Shuffle::PARTIAL) {
+						size_t visible = std::min(parameters.encounters, agents.size());
+						arrangement.reserve(std::max(parameters.encounters,
+												parameters.infections));
+						arrangement.resize(std::max(visible, parameters.infections));
+						partial_shuffle(agents.size(), arrangement.size(), rng,
+										arrangement.data(), scratch);
+						for (size_t i = 0; i < parameters.infections; i++)
+								agents.set_state(arrangement[i], State::INFECTIOUS);
+						arrangement.resize(visible);
+				} else {
+						arrangement.clear();
 						shuffle(agents, rng);
 						for (size_t i = 0; i < parameters.infections; i++) {
-								agents[i].state = State::INFECTIOUS;
+								agents.set_state(i, State::INFECTIOUS);
+						}
+				}
+				total_infections = parameters.infections;
+		}
+
+		/// Whether simulations of the same identity with parameters a and b
+		/// start from the same population
+		static bool same_start(const Parameters &a, const Parameters &b) {
+				return a.agents == b.agents && a.infections == b.infections &&
+						a.storage == b.storage && a.generator == b.generator &&
+						a.shards == b.shards && a.shuffle == b.shuffle &&
+						(a.shuffle != Shuffle::PARTIAL || a.encounters == b.encounters);
+		}
+
+		/// Copies the initial population into start; only until the first
+		/// iteration.
+		void save_start(Start &start) const {
+				assert(iteration == 0);
+				start.agents = agents;
+				start.rng = rng;
+				start.arrangement = arrangement;
+		}
+
+		/// reset(identity, parameters) with the population copied from start,
+		/// which a simulation of the same identity and same_start() parameters
+		/// saved, rather than shuffled again. The copy reuses the kept buffers.
+		void reset(size_t identity, const Parameters &parameters,
+						const Start &start) {
+				prepare(identity, parameters);
+				agents = start.agents;
+				// The copy came with the storage settings of start's simulation.
+				configure(agents, parameters, pool);
+				rng = start.rng;
+				arrangement.reserve(std::max(parameters.encounters,
+										parameters.infections));
+				arrangement = start.arrangement;
+				total_infections = parameters.infections;
+		}
+
+		/// Everything reset() does but make the initial population: leaves
+		/// the storage empty with room for the run.
+		void prepare(size_t identity, const Parameters &parameters) {
+				this->identity = identity;
+				this->parameters = parameters;
+				rng = Engine(identity);
+				philox = Philox2x32(identity);
+				kernel_stream = 0;
+				infection_deaths = 0;
+				iteration = 0;
+				reports.clear();
+				aggregate.iterations.clear();
+				profile = EventProfile();
+				profile.simulations = 1;
+				cold.clear();
+				scratch.reset();
+				// Several simulations already use all the threads, so only a
+				// single one gets more.
+				size_t threads = parameters.simulations > 1 ? 1 : parameters.threads;
+				if (parameters.storage != StorageLayout::SHARDS &&
+								parameters.encounter_mode != EncounterMode::BATCHED)
+						pool.reset();
+				else if (!pool || (threads != 0 && pool->threads() != threads))
+						pool = std::make_shared<ForkJoin>(threads);
+				if (parameters.checkpoint_every > 0 && !checkpoints)
+						checkpoints = std::make_shared<CheckpointWriter>();
+				configure(agents, parameters, pool);
+				agents.clear();
+				agents.reserve(expected_agents(parameters));
+				calendar.clear();
+				build_pipeline();
+				if (scheduled)
+						calendar.reserve(expected_agents(parameters));
+		}
+
+		/// Builds the pipeline of parameters.events for this simulation,
+		/// resolving the infection method once. Events that cannot change a
+		/// state are dropped: grow() without growth, and the per-agent events
+		/// whose probabilities are all 0, as long as that leaves the draws of
+		/// the others as they were. The kernels draw from counters, so for
+		/// them only the stream moves on; skip sampling over index sets draws
+		/// nothing for them. The engine's per-agent draws are taken whatever
+		/// the outcome, so those events are only dropped with lazy_events,
+		/// which is equivalent in distribution but follows another stream.
+		/// The infection event is skipped on the same terms in iterations
+		/// without susceptible or infectious agents, which the counters tell.
+		void build_pipeline() {
+				const Parameters &p = parameters;
+				const InfectionMethod method = METHOD == BOTH ? p.infection_method : METHOD;
+				bool one = method == ONE || (method == BOTH && identity % 2 == 0);
+				infect = one ? &BasicSimulation::infect_method_one :
+						&BasicSimulation::infect_method_two;
+				const bool kernels = p.kernel == EventKernel::SIMD;
+				skip_idle_infections = p.lazy_events || counter_encounters();
+				const bool drop = p.lazy_events || kernels ||
+						(p.sampling == Sampling::SKIP && p.storage == StorageLayout::COLUMNS);
+				// Adds call, or the skip of its kernel calls if it is a no-op
+				auto add = [&](EventCall call, bool noop, EventCall skip) {
+						if (!noop || !drop)
+								pipeline.push_back(call);
+						else if (kernels)
+								pipeline.push_back(skip);
+				};
+				const EventCall skip = &BasicSimulation::skip_kernel_calls<1>;
+				scheduled = false;
+				pipeline.clear();
+				for (size_t k = 0; k < p.events.size(); k++) {
+						switch (p.events[k]) {
+								case EVENT_GROW:
+										if (p.growth != 0.0)
+												pipeline.push_back(&BasicSimulation::grow);
+										break;
+								case EVENT_INFECT:
+										pipeline.push_back(&BasicSimulation::infection);
+										break;
+								case EVENT_RECOVER:
+										if (schedules() && fuses(k) && !scheduled) {
+												outcomes = IterationOutcomes(p);
+												scheduled = true;
+												pipeline.push_back(&BasicSimulation::fire_events);
+												k += 3;
+										} else if (p.fused && fuses(k)) {
+												// It draws from the engine even with skip sampling.
+												add(&BasicSimulation::fused_step, (p.lazy_events || kernels) &&
+																p.recovery_prob <= 0 &&
+																p.vaccination_prob <= 0 && p.regression_prob <= 0 &&
+																p.death_prob_susceptible <= 0 &&
+																p.death_prob_infectious <= 0,
+																&BasicSimulation::skip_kernel_calls<4>);
+												k += 3;
+										} else {
+												add(&BasicSimulation::recover, p.recovery_prob <= 0, skip);
+										}
+										break;
+								case EVENT_VACCINATE:
+										add(&BasicSimulation::vaccinate, p.vaccination_prob <= 0, skip);
+										break;
+								case EVENT_SUSCEPTIBLE:
+										add(&BasicSimulation::susceptible, p.regression_prob <= 0, skip);
+										break;
+								case EVENT_DIE:
+										add(&BasicSimulation::die, p.death_prob_susceptible <= 0 &&
+														p.death_prob_infectious <= 0, skip);
+										break;
+						}
+				}
+		}
+
+		/// Whether parameters ask for Timing::EVENTS and keep the agents where
+		/// they are, as it needs; it runs in steps otherwise.
+		bool schedules() const {
+				return parameters.timing == Timing::EVENTS &&
+						parameters.shuffle == Shuffle::PARTIAL &&
+						parameters.compaction == Compaction::OFF &&
+						parameters.storage != StorageLayout::SHARDS &&
+						parameters.encounter_mode == EncounterMode::SEQUENTIAL;
+		}
+
+		/// Files the agents the calendar does not know yet, which are all of
+		/// them in the first iteration after a reset() or restore(), under
+		/// their next transition
+		void schedule_new() {
+				for (size_t i = calendar.size(); i < agents.size(); i++)
+						schedule(i, now);
+		}
+
+		/// Files agent i, in the state it has now, under the iteration of its
+		/// next transition, the earliest being first or, once fire_events()
+		/// has run in first, the one after: an event after it in the pipeline
+		/// changes agents whose transitions of this iteration are over.
+		void schedule(size_t i, size_t first) {
+				first = std::max<size_t>(first, calendar.next());
+				State state = agents.state(i);
+				double leave = outcomes.leave[state];
+				uint64_t due = EventCalendar::NEVER;
+				if (leave >= 1.0) {
+						due = first;
+				} else if (leave > 0.0) {
+						double gap = std::floor(std::log(1.0 - gap_real(rng)) /
+										outcomes.log_stay[state]);
+						if (gap < EventCalendar::NEVER)
+								due = first + (uint64_t) gap;
+				}
+				calendar.schedule(i, due);
+		}
+
+		/// Moves the agents due in this iteration to the state the per-agent
+		/// events would have left them in, which is any other than the one
+		/// they are in with the probabilities of outcomes, and schedules their
+		/// next transition.
+		void fire_events() {
+				EventTimer<> timer(profile, PROFILE_SCHEDULED, agents.size());
+				calendar.fire(now, [this](uint32_t i) {
+								State from = agents.state(i);
+								const IterationOutcomes::Outcome &outcome =
+										outcomes.outcomes[from][outcomes.pick(from, rng.real())];
+								agents.set_state(i, outcome.to);
+								if (outcome.infection_death)
+										++infection_deaths;
+								schedule(i, now + 1);
+								});
+		}
+
+		/// Whether the infection event is infect_method_one() drawing its
+		/// encounters from the kernel counters
+		bool counter_encounters() const {
+				return infect == &BasicSimulation::infect_method_one &&
+						(parameters.encounter_mode == EncounterMode::BATCHED ||
+						parameters.storage == StorageLayout::SHARDS);
+		}
+
+		/// Whether the four per-agent events follow each other in order from
+		/// parameters.events[k], so that fused_step() can take their place
+		bool fuses(size_t k) const {
+				const std::vector<Event> &events = parameters.events;
+				return k + 3 < events.size() && events[k] == EVENT_RECOVER &&
+						events[k + 1] == EVENT_VACCINATE &&
+						events[k + 2] == EVENT_SUSCEPTIBLE && events[k + 3] == EVENT_DIE;
+		}
+
+		/// Moves the kernel stream past a dropped event's CALLS kernel calls
+		template <size_t CALLS>
+		void skip_kernel_calls() {
+				kernel_stream += CALLS;
+		}
+
+		/// The checkpoint header at the start of data, which must hold a
+		/// whole one as read_checkpoint() returns
+		static CheckpointHeader checkpoint_header(const std::vector<uint8_t> &data) {
+				CheckpointHeader header;
+				std::memcpy(&header, data.data(), sizeof(header));
+				return header;
+		}
+
+		/// Writes everything the rest of the run depends on to data, reusing
+		/// its capacity. The stored agents are saved in position order with
+		/// their index set slots, so the draws resume in the same order.
+		void save_checkpoint(std::vector<uint8_t> &data) const {
+				CheckpointHeader header;
+				header.state = snapshot_header(iteration);
+				header.state.agents = agents.size();
+				header.storage = parameters.storage;
+				header.shuffle = parameters.shuffle;
+				header.cold = cold.size();
+				header.arrangement = arrangement.size();
+				header.reported = aggregate.iterations.size();
+				data.resize(checkpoint_size(header));
+				uint8_t *out = data.data();
+				auto put = [&out](const void *value, size_t size) {
+						std::memcpy(out, value, size);
+						out += size;
+				};
+				put(&header, sizeof(header));
+				// Each row holds this simulation's one report, so the means are
+				// the values themselves.
+				for (const auto &row: aggregate.iterations) {
+						uint64_t values[1 + ReportAggregate::VALUES] = {row.first};
+						for (size_t v = 0; v < ReportAggregate::VALUES; v++) {
+								assert(row.second[v].moments.count == 1);
+								values[1 + v] = row.second[v].moments.mean;
 						}
-						total_infections = parameters.infections;
+						put(values, sizeof(values));
+				}
+				for (size_t i = 0; i < agents.size(); i++) {
+						int32_t identity = agents.identity(i);
+						put(&identity, sizeof(identity));
+				}
+				for (size_t i = 0; i < agents.size(); i++) {
+						uint32_t slot = index_slot(agents, i);
+						put(&slot, sizeof(slot));
+				}
+				put(cold.data(), cold.size() * sizeof(int32_t));
+				put(arrangement.data(), arrangement.size() * sizeof(uint32_t));
+				for (size_t i = 0; i < agents.size(); i++)
+						*out++ = agents.state(i);
+				assert(out == data.data() + data.size());
+		}
+
+		/// Turns this into the simulation save_checkpoint() wrote to data.
+		/// Throws std::runtime_error if it ran with another storage, shuffle
+		/// or engine than parameters give, with Timing::EVENTS, or if data is
+		/// not consistent().
+		void restore(const Parameters &parameters, const std::vector<uint8_t> &data) {
+				static_assert(sizeof(int) == sizeof(int32_t), "identities are 32 bit");
+				CheckpointHeader header = checkpoint_header(data);
+				if (header.storage != (uint32_t) parameters.storage ||
+								header.shuffle != (uint32_t) parameters.shuffle ||
+								header.state.generator != (uint32_t) parameters.generator)
+						throw std::runtime_error("checkpoint of another --storage, "
+										"--shuffle or --rng");
+				// prepare() leaves the storage empty but configured, as
+				// consistent() needs for the index sets of the shards.
+				prepare(header.state.identity, parameters);
+				// The calendar is not saved, and drawing it anew would not
+				// carry on the run.
+				if (scheduled)
+						throw std::runtime_error("--timing events cannot resume a checkpoint");
+				if (!consistent(header, data, parameters))
+						throw std::runtime_error("not a complete checkpoint");
+				iteration = header.state.iteration;
+				ThreadCounters::add(metrics().local(worker).started, 1);
+				total_infections = header.state.total_infections;
+				infection_deaths = header.state.infection_deaths;
+				kernel_stream = header.state.kernel_stream;
+				philox.key = header.state.philox_key;
+				std::memcpy((void*) &rng, header.state.rng, sizeof(Engine));
+				const uint8_t *in = data.data() + header.header_size;
+				auto take = [&in](void *value, size_t size) {
+						std::memcpy(value, in, size);
+						in += size;
+				};
+				for (size_t k = 0; k < header.reported; k++) {
+						uint64_t values[1 + ReportAggregate::VALUES];
+						take(values, sizeof(values));
+						aggregate.add(values[0], values + 1);
+				}
+				size_t count = header.state.agents;
+				const uint8_t *identities = in;
+				const uint8_t *slots = identities + count * sizeof(int32_t);
+				const uint8_t *states = slots + count * sizeof(uint32_t) +
+						header.cold * sizeof(int32_t) +
+						header.arrangement * sizeof(uint32_t);
+				for (size_t i = 0; i < count; i++) {
+						int32_t identity;
+						std::memcpy(&identity, identities + i * sizeof(identity),
+										sizeof(identity));
+						agents.push_back(identity, (State) states[i]);
 				}
+				uint32_t *order = scratch.allocate<uint32_t>(count);
+				std::memcpy(order, slots, count * sizeof(uint32_t));
+				set_index_slots(agents, order);
+				in = slots + count * sizeof(uint32_t);
+				cold.resize(header.cold);
+				take(cold.data(), cold.size() * sizeof(int32_t));
+				arrangement.resize(header.arrangement);
+				take(arrangement.data(), arrangement.size() * sizeof(uint32_t));
+		}
 
+		/// Whether the identities, states, slots and arrangement that data
+		/// holds after header are ones a simulation with parameters can have
+		/// saved, so that restore() can use them as indices: the identities of
+		/// the stored and cold agents are each of the population once, the
+		/// slots are valid index_slot()s and the arrangement is of distinct
+		/// positions.
+		bool consistent(const CheckpointHeader &header,
+						const std::vector<uint8_t> &data, const Parameters &parameters) const {
+				if (data.size() != checkpoint_size(header))
+						return false;
+				const size_t count = header.state.agents;
+				const size_t population = count + header.cold;
+				const uint8_t *identities = data.data() + header.header_size +
+						header.reported * (1 + ReportAggregate::VALUES) * sizeof(uint64_t);
+				const uint8_t *slot_bytes = identities + count * sizeof(int32_t);
+				const uint8_t *cold = slot_bytes + count * sizeof(uint32_t);
+				const uint8_t *arrangement = cold + header.cold * sizeof(int32_t);
+				const uint8_t *states = arrangement + header.arrangement * sizeof(uint32_t);
+				std::vector<bool> seen(population);
+				auto distinct = [&seen](const uint8_t *in, size_t n, size_t bound) {
+						for (size_t i = 0; i < n; i++) {
+								uint32_t value;
+								std::memcpy(&value, in + i * sizeof(value), sizeof(value));
+								if (value >= bound || seen[value])
+										return false;
+								seen[value] = true;
+						}
+						return true;
+				};
+				if (!distinct(identities, count, population) ||
+								!distinct(cold, header.cold, population))
+						return false;
+				for (size_t i = 0; i < count; i++)
+						if (states[i] >= STATE_COUNT)
+								return false;
+				std::vector<uint32_t> slots(count);
+				std::memcpy(slots.data(), slot_bytes, count * sizeof(uint32_t));
+				if (!index_slots_valid(agents, states, slots.data(), count))
+						return false;
+				const size_t positions = count +
+						(parameters.compaction == Compaction::EQUIVALENT ? header.cold : 0);
+				seen.assign(positions, false);
+				return distinct(arrangement, header.arrangement, positions);
+		}
+
+		/// Hands a checkpoint of the iterations done so far to the checkpoint
+		/// writer, which writes it while the simulation runs on. The report
+		/// rows up to here go out first.
+		void checkpoint() {
+				EventTimer<> timer(profile, PROFILE_CHECKPOINT, agents.size());
+				flush_reports();
+				save_checkpoint(checkpoints->buffer());
+				checkpoints->write(checkpoint_filename(parameters.checkpoint_file,
+												identity));
+		}
+
+		/// Most agents the simulation can have after its iterations: grow()
+		/// adds at most round(growth * size()) per iteration. This is capped at
+		/// MAX_RESERVE times the initial agents, as deaths slow the growth and
+		/// fast growing runs should not hold memory they may never use.
+		static size_t expected_agents(const Parameters &parameters) {
+				const size_t cap = MAX_RESERVE * std::max<size_t>(parameters.agents, 1);
+				size_t size = parameters.agents;
+				for (size_t i = 0; i < parameters.iterations && size < cap; i++)
+						size += std::round(parameters.growth * size);
+				return std::min(size, cap);
+		}
+
+		static const size_t MAX_RESERVE = 8;
 
 		/// Event to grow the number of agents.
 		void grow() {
-				size_t num_agents = std::count_if(agents.begin(), agents.end(),
-								[](const Agent &a) {
-								return a.state != State::DEAD;
-								});
+				EventTimer<> timer(profile, PROFILE_GROW, agents.size());
+				size_t num_agents = agents.living();
 				size_t new_agents = std::round(parameters.growth * num_agents);
-				size_t size = agents.size();
-				for (size_t i = size; i < size + new_agents; i++)
-						agents.push_back(Agent(i, State::SUSCEPTIBLE));
+				agents.append(population(), State::SUSCEPTIBLE, new_agents);
+				if (scheduled)
+						schedule_new();
+		}
+
+		/// Number of agents, dead ones compacted away included
+		size_t population() const {
+				return agents.size() + cold.size();
+		}
+
+		/// Positions ahead of the stored agents that the encounters draw from
+		size_t cold_positions() const {
+				return parameters.compaction == Compaction::EQUIVALENT ? cold.size() : 0;
+		}
+
+		/// State of the agent at position p of the cold and stored agents
+		State position_state(size_t p) const {
+				size_t offset = cold_positions();
+				return p < offset ? State::DEAD : agents.state(p - offset);
+		}
+
+		/// The simulation's infection event, unless skip_idle_infections is set
+		/// and no agent can infect or be infected. The encounters read the
+		/// agents at random and the events after them stream through them.
+		void infection() {
+				if (skip_idle_infections) {
+						Statistics stats = agents.statistics();
+						if (stats.susceptible == 0 || stats.infectious == 0) {
+								if (counter_encounters())
+										++kernel_stream;
+								return;
+						}
+				}
+				agents.advise(Access::RANDOM);
+				if constexpr (METHOD == ONE)
+						infect_method_one();
+				else if constexpr (METHOD == TWO)
+						infect_method_two();
+				else
+						(this->*infect)();
+				agents.advise(Access::STREAM);
 		}
 
 		/// Intentionally time-consuming event to infect agents.  Agents
 		/// randomly encounter one another. If an infectious agent
 		/// encounters a susceptible one, an infection takes place.
 		void infect_method_one() {
-				for (size_t i = 0; i < parameters.encounters; i++) {
-						int ind1 = rng.to(agents.size());
-						int ind2 = rng.to(agents.size());
-						if (agents[ind1].state == State::SUSCEPTIBLE &&
-										agents[ind2].state == State::INFECTIOUS) {
-								agents[ind1].state = State::INFECTIOUS;
+				EventTimer<> timer(profile, PROFILE_INFECT_ONE, agents.size());
+				if (parameters.encounter_mode == EncounterMode::BATCHED) {
+						total_infections += encounter_batch(agents, parameters.encounters,
+										philox, kernel_stream++, *pool, scratch, cold_positions());
+						return;
+				}
+				if (parameters.storage == StorageLayout::SHARDS) {
+						total_infections += encounter(agents, parameters.encounters, philox,
+										kernel_stream++);
+						return;
+				}
+				const size_t offset = cold_positions();
+				const size_t encounters = parameters.encounters;
+				for (size_t i = 0; i < encounters; i++) {
+						size_t ind1 = rng.to(agents.size() + offset);
+						size_t ind2 = rng.to(agents.size() + offset);
+						// Cold agents are dead and infect no one
+						if (ind1 < offset || ind2 < offset)
+								continue;
+						ind1 -= offset;
+						ind2 -= offset;
+						if (agents.state(ind1) == State::SUSCEPTIBLE &&
+										agents.state(ind2) == State::INFECTIOUS) {
+								agents.set_state(ind1, State::INFECTIOUS);
 								++total_infections;
-						} else if (agents[ind1].state == State::INFECTIOUS &&
-										agents[ind2].state == State::SUSCEPTIBLE) {
-								agents[ind2].state = State::INFECTIOUS;
+								if (scheduled)
+										schedule(ind1, now);
+						} else if (agents.state(ind1) == State::INFECTIOUS &&
+										agents.state(ind2) == State::SUSCEPTIBLE) {
+								agents.set_state(ind2, State::INFECTIOUS);
 								++total_infections;
+								if (scheduled)
+										schedule(ind2, now);
 						}
 				}
 		}
 
-		/// Returns a vector of indices into an agents vector
-		/// where each entry corresponds to an agent with the given state.
-		/// Stops if max number of entries reached.
-		std::vector<size_t> get_indices(State state, size_t max) {
-				std::vector<size_t> indices;
+		/// Writes to indices the positions of the agents with the given state
+		/// among the first max ones and returns how many there are. indices
+		/// must have room for max entries.
+		size_t get_indices(State state, size_t max, size_t *indices) {
+				size_t count = 0;
 				for (size_t i = 0; i < agents.size(); i++) {
 						if (i >= max) break;
-						if (agents[i].state == state)
-								indices.push_back(i);
+						if (agents.state(i) == state)
+								indices[count++] = i;
 				}
-				return indices;
+				return count;
 		}
 
 		/// Simulation event that infects agents (2nd of 2 methods implemented)
 		void infect_method_two() {
-				std::vector<size_t> indices = get_indices(State::SUSCEPTIBLE,
-								parameters.encounters);
+				EventTimer<> timer(profile, PROFILE_INFECT_TWO, agents.size());
+				if (parameters.shuffle == Shuffle::PARTIAL) {
+						infect_method_two_partial();
+						return;
+				}
+				size_t *indices = scratch.allocate<size_t>(parameters.encounters);
+				size_t count = get_indices(State::SUSCEPTIBLE, parameters.encounters,
+								indices);
 				shuffle(agents, rng);
-				for (size_t i = 0; i < indices.size(); i++) {
-						if (agents[i].state == State::INFECTIOUS) {
-								agents[indices[i]].state = State::INFECTIOUS;
+				for (size_t i = 0; i < count; i++) {
+						if (agents.state(i) == State::INFECTIOUS) {
+								agents.set_state(indices[i], State::INFECTIOUS);
+								++total_infections;
+						}
+				}
+		}
+
+		/// infect_method_two() on the virtual arrangement. Nothing past its first
+		/// encounters positions is ever read, so only those are shuffled and the
+		/// agents themselves never move.
+		void infect_method_two_partial() {
+				// The arrangement is of the positions of position_state().
+				const size_t positions = agents.size() + cold_positions();
+				size_t visible = std::min(parameters.encounters, positions);
+				// While the arrangement holds every agent, grow() appends the new
+				// ones after it in storage order.
+				for (size_t i = arrangement.size(); i < visible; i++)
+						arrangement.push_back(i);
+				size_t *indices = scratch.allocate<size_t>(visible);
+				size_t count = 0;
+				for (size_t i = 0; i < visible; i++)
+						if (position_state(arrangement[i]) == State::SUSCEPTIBLE)
+								indices[count++] = i;
+				partial_shuffle(positions, visible, rng, arrangement.data(), scratch);
+				thaw_arrangement();
+				const size_t offset = cold_positions();
+				for (size_t i = 0; i < count; i++) {
+						if (agents.state(arrangement[i] - offset) == State::INFECTIOUS) {
+								agents.set_state(arrangement[indices[i]] - offset, State::INFECTIOUS);
 								++total_infections;
+								if (scheduled)
+										schedule(arrangement[indices[i]] - offset, now);
 						}
 				}
 		}
 
+		/// Moves the cold agents at the arrangement's positions back to the end
+		/// of agents (still dead), so that infect_method_two_partial() can set
+		/// them as the reference does. The other cold agents keep no position
+		/// of their own, so they are swap-removed.
+		void thaw_arrangement() {
+				const size_t offset = cold_positions();
+				if (offset == 0)
+						return;
+				// Entries of cold agents, in decreasing order of position so that
+				// a swap-removal never moves one still to come
+				uint32_t *thawed = scratch.allocate<uint32_t>(arrangement.size());
+				size_t count = 0;
+				for (size_t k = 0; k < arrangement.size(); k++)
+						if (arrangement[k] < offset)
+								thawed[count++] = k;
+				std::sort(thawed, thawed + count, [this](uint32_t a, uint32_t b) {
+								return arrangement[a] > arrangement[b];
+								});
+				for (size_t k = 0; k < arrangement.size(); k++)
+						arrangement[k] -= count;
+				for (size_t j = 0; j < count; j++) {
+						uint32_t &entry = arrangement[thawed[j]];
+						entry += count;
+						agents.push_back(cold[entry], State::DEAD);
+						cold[entry] = cold.back();
+						cold.pop_back();
+						entry = offset - count + agents.size() - 1;
+				}
+		}
+
+		/// Whether iterate(i) ends with a compaction
+		bool compaction_due(size_t i) {
+				if (parameters.compaction == Compaction::OFF)
+						return false;
+				if (parameters.compact_every > 0 && (i + 1) % parameters.compact_every == 0)
+						return true;
+				return parameters.compact_dead > 0 &&
+						agents.statistics().dead > parameters.compact_dead * agents.size();
+		}
+
+		/// Moves the dead agents out of agents into cold, and the arrangement's
+		/// entries along with them.
+		void compact() {
+				EventTimer<> timer(profile, PROFILE_COMPACT, agents.size());
+				const size_t offset = cold_positions();
+				// The arrangement's entries in position order
+				const size_t n = parameters.compaction == Compaction::EQUIVALENT ?
+						arrangement.size() : 0;
+				uint32_t *order = scratch.allocate<uint32_t>(n);
+				uint32_t *moved = scratch.allocate<uint32_t>(n);
+				for (size_t k = 0; k < n; k++)
+						order[k] = k;
+				std::sort(order, order + n, [this](uint32_t a, uint32_t b) {
+								return arrangement[a] < arrangement[b];
+								});
+				size_t next = std::lower_bound(order, order + n, offset,
+								[this](uint32_t k, size_t p) { return arrangement[k] < p; }) - order;
+				size_t removed = 0;
+				// moved[k] is the new stored position of a living agent or the
+				// cold position (with the top bit set) of a dead one.
+				const uint32_t DEAD_BIT = 1u << 31;
+				bool done = remove_dead(agents, [&](size_t i, int identity) {
+								for (; next < n && arrangement[order[next]] - offset < i; next++)
+										moved[order[next]] = arrangement[order[next]] - offset - removed;
+								if (next < n && arrangement[order[next]] - offset == i)
+										moved[order[next++]] = cold.size() | DEAD_BIT;
+								cold.push_back(identity);
+								++removed;
+								});
+				if (!done)
+						return;
+				for (; next < n; next++)
+						moved[order[next]] = arrangement[order[next]] - offset - removed;
+				if (parameters.compaction == Compaction::EQUIVALENT) {
+						for (size_t k = 0; k < n; k++) {
+								if (arrangement[k] < offset)
+										continue;
+								arrangement[k] = moved[k] & DEAD_BIT ? moved[k] & ~DEAD_BIT :
+										cold.size() + moved[k];
+						}
+				} else if (!arrangement.empty()) {
+						// The dead leave holes, so the arrangement is drawn afresh.
+						arrangement.resize(std::min(parameters.encounters, agents.size()));
+						partial_shuffle(agents.size(), arrangement.size(), rng,
+										arrangement.data(), scratch);
+				}
+		}
+
 		/// Simulation event that moves agents from infectious to recovered state
 		void recover() {
-				for (auto &agent: agents) {
-						if (agent.state == State::INFECTIOUS) {
-								if (rng.real() < parameters.recovery_prob)
-										agent.state = State::RECOVERED;
-						}
+				EventTimer<> timer(profile, PROFILE_RECOVER, agents.size());
+				if (parameters.kernel == EventKernel::SIMD) {
+						agents.step(recover_table(), philox, kernel_stream++);
+						return;
+				}
+				if (parameters.sampling == Sampling::SKIP) {
+						agents.sample(State::INFECTIOUS, State::RECOVERED,
+										parameters.recovery_prob, rng);
+						return;
 				}
+				// In a local, as the state writes could alias parameters
+				const double prob = parameters.recovery_prob;
+				agents.transition({State::INFECTIOUS}, [this, prob](size_t, State state) {
+								if (rng.real() < prob)
+										return State::RECOVERED;
+								return state;
+								});
 		}
 
 		/// Simulation event that moves agents from susceptible to vaccinated state
 		void vaccinate() {
-				for (auto &agent: agents) {
-						if (agent.state == State::SUSCEPTIBLE) {
-								if (rng.real() < parameters.vaccination_prob)
-										agent.state = State::VACCINATED;
-						}
+				EventTimer<> timer(profile, PROFILE_VACCINATE, agents.size());
+				if (parameters.kernel == EventKernel::SIMD) {
+						agents.step(vaccinate_table(), philox, kernel_stream++);
+						return;
+				}
+				if (parameters.sampling == Sampling::SKIP) {
+						agents.sample(State::SUSCEPTIBLE, State::VACCINATED,
+										parameters.vaccination_prob, rng);
+						return;
 				}
+				const double prob = parameters.vaccination_prob;
+				agents.transition({State::SUSCEPTIBLE}, [this, prob](size_t, State state) {
+								if (rng.real() < prob)
+										return State::VACCINATED;
+								return state;
+								});
 		}
 
 		/// Simulation event that moves vaccinated and susceptible agents back to
 		/// the susceptible state
 		void susceptible() {
-				for (auto &agent: agents) {
-						if (agent.state == State::VACCINATED ||
-										agent.state == State::RECOVERED) {
-								if (rng.real() < parameters.regression_prob)
-										agent.state = State::SUSCEPTIBLE;
-						}
+				EventTimer<> timer(profile, PROFILE_SUSCEPTIBLE, agents.size());
+				if (parameters.kernel == EventKernel::SIMD) {
+						agents.step(susceptible_table(), philox, kernel_stream++);
+						return;
 				}
+				if (parameters.sampling == Sampling::SKIP) {
+						agents.sample(State::VACCINATED, State::SUSCEPTIBLE,
+										parameters.regression_prob, rng);
+						agents.sample(State::RECOVERED, State::SUSCEPTIBLE,
+										parameters.regression_prob, rng);
+						return;
+				}
+				const double prob = parameters.regression_prob;
+				agents.transition({State::VACCINATED, State::RECOVERED},
+								[this, prob](size_t, State state) {
+								if (rng.real() < prob)
+										return State::SUSCEPTIBLE;
+								return state;
+								});
 		}
 
 		/// Simple death event that differentiates between infectious and susceptible
 		/// agents.
 		void die() {
-				for (auto & agent: agents) {
-						if (agent.state == State::SUSCEPTIBLE) {
-								if (rng.real() < parameters.death_prob_susceptible) {
-										agent.state = State::DEAD;
+				EventTimer<> timer(profile, PROFILE_DIE, agents.size());
+				if (parameters.kernel == EventKernel::SIMD) {
+						infection_deaths +=
+								agents.step(die_table(), philox, kernel_stream++).infectious;
+						return;
+				}
+				if (parameters.sampling == Sampling::SKIP) {
+						agents.sample(State::SUSCEPTIBLE, State::DEAD,
+										parameters.death_prob_susceptible, rng);
+						infection_deaths += agents.sample(State::INFECTIOUS, State::DEAD,
+										parameters.death_prob_infectious, rng);
+						return;
+				}
+				const double susceptible = parameters.death_prob_susceptible;
+				const double infectious = parameters.death_prob_infectious;
+				agents.transition({State::SUSCEPTIBLE, State::INFECTIOUS},
+								[this, susceptible, infectious](size_t, State state) {
+								if (state == State::SUSCEPTIBLE) {
+										if (rng.real() < susceptible) {
+												return State::DEAD;
+										}
+								} else if (rng.real() < infectious) {
+										++infection_deaths;
+										return State::DEAD;
 								}
-						} else if (agent.state == State::INFECTIOUS) {
-								if (rng.real() < parameters.death_prob_infectious) {
-										agent.state = State::DEAD;
+								return state;
+								});
+		}
+
+		/// Applies recover(), vaccinate(), susceptible() and die() in a single
+		/// pass over the agents. Ordering contract: every agent goes through the
+		/// four events in that order, seeing the state the previous one left it
+		/// in (so it can still recover, lose its immunity and die in one
+		/// iteration). The events never look at other agents, so this is
+		/// equivalent in distribution to the sequential calls. With the SIMD
+		/// kernels each event keeps its own counter stream, so the results are
+		/// identical to the sequential ones; with the engine only the order of
+		/// the draws differs. Sampling is always exact here.
+		void fused_step() {
+				EventTimer<> timer(profile, PROFILE_FUSED, agents.size());
+				if (parameters.kernel == EventKernel::SIMD) {
+						TransitionTable stages[4] = {recover_table(), vaccinate_table(),
+								susceptible_table(), die_table()};
+						Statistics moved[4];
+						agents.step(stages, 4, philox, kernel_stream, moved);
+						kernel_stream += 4;
+						infection_deaths += moved[3].infectious;
+						return;
+				}
+				// In locals, as the state writes could alias parameters
+				const double recovery = parameters.recovery_prob;
+				const double vaccination = parameters.vaccination_prob;
+				const double regression = parameters.regression_prob;
+				const double susceptible = parameters.death_prob_susceptible;
+				const double infectious = parameters.death_prob_infectious;
+				for (size_t i = 0; i < agents.size(); i++) {
+						State from = agents.state(i);
+						State state = from;
+						if (state == State::INFECTIOUS && rng.real() < recovery)
+								state = State::RECOVERED;
+						if (state == State::SUSCEPTIBLE && rng.real() < vaccination)
+								state = State::VACCINATED;
+						if ((state == State::VACCINATED || state == State::RECOVERED) &&
+										rng.real() < regression)
+								state = State::SUSCEPTIBLE;
+						if (state == State::SUSCEPTIBLE) {
+								if (rng.real() < susceptible)
+										state = State::DEAD;
+						} else if (state == State::INFECTIOUS) {
+								if (rng.real() < infectious) {
+										state = State::DEAD;
 										++infection_deaths;
 								}
 						}
+						if (state != from)
+								agents.set_state(i, state);
 				}
 		}
 
+		/// Transition tables of the per-agent events for the vectorized kernels
+		TransitionTable recover_table() const {
+				TransitionTable table;
+				table.add(State::INFECTIOUS, State::RECOVERED, parameters.recovery_prob);
+				return table;
+		}
+
+		TransitionTable vaccinate_table() const {
+				TransitionTable table;
+				table.add(State::SUSCEPTIBLE, State::VACCINATED, parameters.vaccination_prob);
+				return table;
+		}
+
+		TransitionTable susceptible_table() const {
+				TransitionTable table;
+				table.add(State::VACCINATED, State::SUSCEPTIBLE, parameters.regression_prob);
+				table.add(State::RECOVERED, State::SUSCEPTIBLE, parameters.regression_prob);
+				return table;
+		}
+
+		TransitionTable die_table() const {
+				TransitionTable table;
+				table.add(State::SUSCEPTIBLE, State::DEAD, parameters.death_prob_susceptible);
+				table.add(State::INFECTIOUS, State::DEAD, parameters.death_prob_infectious);
+				return table;
+		}
+
 		/// Creates the csv header for the report event
 		void report_header() {
-				std::cout << "#,iter,S,I,R,V,D,TI,TID\n";
+				if (aggregator)
+						return;
+				if (writer) {
+						OutputRecord record;
+						record.kind = OutputRecord::HEADER;
+						record.identity = identity;
+						writer->push(std::move(record));
+						return;
+				}
+				reports += REPORT_HEADER;
 		}
 
 		/// Outputs the agents to a file
 		void print_agents() {
-				sort(agents.begin(), agents.end(), [](const Agent &a, const Agent &b) {
-								return a.identity < b.identity;
-								});
+				EventTimer<> timer(profile, PROFILE_AGENT_OUTPUT, agents.size());
+				// With partial shuffling the agents are still in identity order.
+				// After a compaction they are written through states() instead.
+				if (parameters.shuffle == Shuffle::FULL && cold.empty())
+						agents.sort_by_identity();
+				if (writer) {
+						std::unique_ptr<AgentDump> dump(new AgentDump);
+						dump->path = parameters.agent_filename;
+						dump->binary = false;
+						if (cold.empty()) {
+								dump->states.resize(agents.size());
+								for (size_t i = 0; i < agents.size(); i++)
+										dump->states[i] = agents.state(i);
+						} else {
+								dump->states = states();
+						}
+						push_agents(std::move(dump));
+						return;
+				}
 				std::ofstream file(parameters.agent_filename);
 
 				file << "id,state\n";
-				for (auto &agent: agents)
-						file << agent.identity << "," << agent.state << "\n";
+				if (cold.empty()) {
+						for (size_t i = 0; i < agents.size(); i++)
+								file << agents.identity(i) << "," << agents.state(i) << "\n";
+				} else {
+						std::vector<uint8_t> by_identity = states();
+						for (size_t i = 0; i < by_identity.size(); i++)
+								file << i << "," << (State) by_identity[i] << "\n";
+				}
+				ThreadCounters::add(metrics().local(worker).bytes, file.tellp());
 				file.close();
 		}
 
+		/// The state of every agent, cold ones included, by identity
+		std::vector<uint8_t> states() const {
+				std::vector<uint8_t> states(population(), State::DEAD);
+				for (size_t i = 0; i < agents.size(); i++)
+						states[agents.identity(i)] = agents.state(i);
+				return states;
+		}
+
+		/// Writes the agents as a binary snapshot named after agent_filename,
+		/// identity and iteration. Unlike print_agents() this leaves the agents
+		/// where they are, so it does not change the rest of the run.
+		void write_snapshot(size_t iteration) {
+				EventTimer<> timer(profile, PROFILE_AGENT_OUTPUT, agents.size());
+				SnapshotHeader header = snapshot_header(iteration);
+				// Identities are 0 to population() - 1, so no sort is needed.
+				std::vector<uint8_t> states = this->states();
+				std::string path = snapshot_filename(parameters.agent_filename,
+								identity, iteration);
+				if (writer) {
+						std::unique_ptr<AgentDump> dump(new AgentDump);
+						dump->path = path;
+						dump->binary = true;
+						dump->header = header;
+						dump->states.swap(states);
+						push_agents(std::move(dump));
+						return;
+				}
+				::write_snapshot(path, header, states);
+				ThreadCounters::add(metrics().local(worker).bytes,
+								sizeof(header) + states.size());
+		}
+
+		/// The snapshot header of the simulation at iteration
+		SnapshotHeader snapshot_header(size_t iteration) const {
+				static_assert(sizeof(Engine) <= sizeof(SnapshotHeader::rng),
+								"engine state does not fit the snapshot header");
+				SnapshotHeader header;
+				header.identity = identity;
+				header.iteration = iteration;
+				header.agents = population();
+				header.total_infections = total_infections;
+				header.infection_deaths = infection_deaths;
+				header.kernel_stream = kernel_stream;
+				header.generator = parameters.generator;
+				header.philox_key = philox.key;
+				std::memcpy(header.rng, (const void*) &rng, sizeof(Engine));
+				return header;
+		}
+
+		/// Hands a copy of the agents to the writer
+		void push_agents(std::unique_ptr<AgentDump> dump) {
+				OutputRecord record;
+				record.kind = OutputRecord::AGENTS;
+				record.identity = identity;
+				record.agents = std::move(dump);
+				writer->push(std::move(record));
+		}
+
 		/// Prints out the vital statistics.
 		void report(int iteration) {
-				Statistics stats = Statistics(agents);
-				// We want to send one string to cout to prevent data races on stdout
-				std::stringstream ss;
-				ss << identity << "," << iteration << ","
-						<< stats.susceptible << "," << stats.infectious << ","
-						<< stats.recovered << "," << stats.vaccinated << ","
-						<< stats.dead << "," << total_infections << ","
-						<< infection_deaths << "\n";
-				std::cout << ss.str();
+				{
+						EventTimer<> timer(profile, PROFILE_REPORT, agents.size());
+						Statistics stats = agents.statistics();
+						assert(stats == agents.recount());
+						stats.dead += cold.size();
+						uint64_t values[7] = {stats.susceptible, stats.infectious,
+								stats.recovered, stats.vaccinated, stats.dead, total_infections,
+								infection_deaths};
+						if (aggregator) {
+								aggregate.add(iteration, values);
+						} else if (writer) {
+								OutputRecord record;
+								record.kind = OutputRecord::REPORT;
+								record.identity = identity;
+								record.iteration = iteration;
+								std::copy(values, values + 7, record.values);
+								writer->push(std::move(record));
+						} else {
+								char row[REPORT_ROW_MAX];
+								reports += tag;
+								reports.append(row, format_report(row, identity, iteration,
+														values));
+								if (reports.size() >= REPORT_BATCH)
+										flush_reports();
+						}
+				}
 				if (parameters.output_agents > 0) {
 						if (iteration > 0 && iteration % parameters.output_agents == 0) {
-								print_agents();
+								if (parameters.agent_format == AgentFormat::BINARY)
+										write_snapshot(iteration);
+								else
+										print_agents();
 						}
 				}
 		}
 
+		/// Writes the buffered report rows to output. We want to send whole
+		/// rows in one string to prevent data races on stdout.
+		void flush_reports() {
+				if (reports.empty())
+						return;
+				output->write(reports.data(), reports.size());
+				ThreadCounters::add(metrics().local(worker).bytes, reports.size());
+				reports.clear();
+		}
+
 		/// Simulation engine that repeatedly executes all the events
 		/// for specified number of iterations.
 		void simulate() {
-				if (identity == 0)
+				start();
+				advance(parameters.iterations);
+				finish();
+		}
+
+		/// Reports the initial state (simulate() in steps: start(), advance()
+		/// until done(), finish())
+		void start() {
+				ThreadCounters::add(metrics().local(worker).started, 1);
+				if (identity == 0 && tag.empty())
 						report_header();
 				report(0);
-				for (size_t i = 0; i < parameters.iterations; i++) {
-						grow();
-						switch(parameters.infection_method) {
-								case BOTH:
-										if (identity % 2 == 0)
-												infect_method_one();
-										else
-												infect_method_two();
-										break;
-								case ONE: infect_method_one(); break;
-								case TWO: infect_method_two(); break;
-						}
-						recover();
-						vaccinate();
-						susceptible();
-						die();
-						if (i != 0 && i % 100 == 0) {
-								report(i);
-						}
+		}
+
+		/// Runs up to count more iterations
+		void advance(size_t count) {
+				ThreadCounters &counters = metrics().local(worker);
+				for (; count > 0 && !done(); --count) {
+						iterate(iteration++);
+						ThreadCounters::add(counters.iterations, 1);
+						ThreadCounters::add(counters.agents, agents.size());
 				}
+		}
+
+		bool done() const {
+				return iteration >= parameters.iterations;
+		}
+
+		/// Reports the final state
+		void finish() {
 				report(parameters.iterations);
+				flush_reports();
+				ThreadCounters::add(metrics().local(worker).finished, 1);
+				if (checkpoints)
+						checkpoints->wait();
+				if (aggregator)
+						aggregator->merge(aggregate);
+				if (profiler)
+						profiler->merge(profile);
+				if (writer) {
+						OutputRecord record;
+						record.kind = OutputRecord::FINISHED;
+						record.identity = identity;
+						writer->push(std::move(record));
+				}
+		}
+
+		/// Executes all the events once
+		void iterate(size_t i) {
+				scratch.reset();
+				now = i;
+				if (PROFILING)
+						profile.agent_iterations += agents.size();
+				if (scheduled)
+						schedule_new();
+				for (EventCall event: pipeline)
+						(this->*event)();
+				if (compaction_due(i))
+						compact();
+				if (i != 0 && parameters.report_every > 0 &&
+								i % parameters.report_every == 0) {
+						report(i);
+				}
+				if (parameters.checkpoint_every > 0 &&
+								(i + 1) % parameters.checkpoint_every == 0)
+						checkpoint();
 		}
 };
 
+/// The reference simulation, which stores its agents in an AgentArray.
+using Simulation = BasicSimulation<AgentArray>;
 
+#endif
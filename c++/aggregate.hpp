@@ -0,0 +1,213 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//! Streaming aggregation of the reports across simulations: per reported
+//! iteration and statistic, the mean and variance (Welford) and quantiles
+//! from a relative-error sketch. Every part can be merged, so simulations
+//! aggregate on their own and are merged once at the end.
+
+#ifndef ABM_AGGREGATE_HPP
+#define ABM_AGGREGATE_HPP
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+/// Count, mean and sum of squared deviations, updated one value at a time
+/// and merged with Chan et al.'s formula.
+struct Moments {
+		uint64_t count = 0;
+		double mean = 0.0;
+		double m2 = 0.0;
+
+		void add(double x) {
+				++count;
+				double delta = x - mean;
+				mean += delta / count;
+				m2 += delta * (x - mean);
+		}
+
+		void merge(const Moments &other) {
+				if (other.count == 0)
+						return;
+				uint64_t total = count + other.count;
+				double delta = other.mean - mean;
+				mean += delta * other.count / total;
+				m2 += other.m2 + delta * delta * count * other.count / total;
+				count = total;
+		}
+
+		/// Sample variance (0 for fewer than two values)
+		double variance() const {
+				return count > 1 ? m2 / (count - 1) : 0.0;
+		}
+};
+
+/// DDSketch (Masson et al.) for non-negative values: a value x > 0 counts in
+/// bucket ceil(log(x) / log(gamma)), so every quantile it returns is within
+/// ACCURACY of a value of the right rank, relative to the value. Merging adds
+/// the buckets. Answers are clamped to the smallest and largest value seen,
+/// so a sample of equal values gives that value back exactly.
+class QuantileSketch {
+public:
+		static constexpr double ACCURACY = 0.01;
+
+		void add(double x) {
+				lowest = count == 0 ? x : std::min(lowest, x);
+				highest = count == 0 ? x : std::max(highest, x);
+				++count;
+				if (x <= 0.0)
+						++zeros;
+				else
+						++buckets[(int) std::ceil(std::log(x) / log_gamma())];
+		}
+
+		void merge(const QuantileSketch &other) {
+				if (other.count == 0)
+						return;
+				lowest = count == 0 ? other.lowest : std::min(lowest, other.lowest);
+				highest = count == 0 ? other.highest : std::max(highest, other.highest);
+				count += other.count;
+				zeros += other.zeros;
+				for (const auto &bucket: other.buckets)
+						buckets[bucket.first] += bucket.second;
+		}
+
+		/// The value of rank q * (count - 1), q in [0, 1]
+		double quantile(double q) const {
+				if (count == 0)
+						return 0.0;
+				uint64_t rank = (uint64_t) (q * (count - 1));
+				// The extremes are known exactly
+				if (rank == 0)
+						return lowest;
+				if (rank + 1 >= count)
+						return highest;
+				if (rank < zeros)
+						return 0.0;
+				uint64_t seen = zeros;
+				for (const auto &bucket: buckets) {
+						seen += bucket.second;
+						if (seen > rank) {
+								double x = 2.0 * std::exp(bucket.first * log_gamma()) /
+										(1.0 + std::exp(log_gamma()));
+								return std::min(highest, std::max(lowest, x));
+						}
+				}
+				return highest;
+		}
+
+private:
+		uint64_t count = 0;
+		uint64_t zeros = 0;
+		double lowest = 0.0, highest = 0.0;
+		std::map<int, uint64_t> buckets;
+
+		static double log_gamma() {
+				return std::log((1.0 + ACCURACY) / (1.0 - ACCURACY));
+		}
+};
+
+/// Moments and quantiles of one statistic
+struct Summary {
+		Moments moments;
+		QuantileSketch sketch;
+
+		void add(double x) {
+				moments.add(x);
+				sketch.add(x);
+		}
+
+		void merge(const Summary &other) {
+				moments.merge(other.moments);
+				sketch.merge(other.sketch);
+		}
+};
+
+/// Summaries of the report values (S, I, R, V, D, TI, TID) by iteration
+struct ReportAggregate {
+		static constexpr size_t VALUES = 7;
+		std::map<uint64_t, std::array<Summary, VALUES>> iterations;
+
+		void add(uint64_t iteration, const uint64_t values[VALUES]) {
+				std::array<Summary, VALUES> &row = iterations[iteration];
+				for (size_t i = 0; i < VALUES; i++)
+						row[i].add(values[i]);
+		}
+
+		void merge(const ReportAggregate &other) {
+				for (const auto &row: other.iterations) {
+						std::array<Summary, VALUES> &into = iterations[row.first];
+						for (size_t i = 0; i < VALUES; i++)
+								into[i].merge(row.second[i]);
+				}
+		}
+
+		/// Writes the table as csv, one row per iteration and statistic. The
+		/// tables of a sweep put the parameter set in a column before the rows
+		/// and share the first one's header.
+		void write(std::ostream &out, const std::string &set = "",
+						bool header = true) const {
+				static const char *names[VALUES] = {"S", "I", "R", "V", "D", "TI", "TID"};
+				std::string text;
+				if (header)
+						text = set.empty() ? "iter,stat,n,mean,var,p5,p50,p95\n" :
+										"set,iter,stat,n,mean,var,p5,p50,p95\n";
+				std::string tag = set.empty() ? set : set + ",";
+				for (const auto &row: iterations) {
+						for (size_t i = 0; i < VALUES; i++) {
+								const Summary &s = row.second[i];
+								text += tag + std::to_string(row.first) + "," + names[i] + "," +
+										std::to_string(s.moments.count);
+								for (double x: {s.moments.mean, s.moments.variance(),
+														s.sketch.quantile(0.05), s.sketch.quantile(0.5),
+														s.sketch.quantile(0.95)}) {
+										char number[32];
+										text += ',';
+										text.append(number, std::to_chars(number, number + sizeof(number),
+																		x, std::chars_format::general, 10).ptr);
+								}
+								text += '\n';
+						}
+				}
+				out << text;
+		}
+};
+
+/// The aggregate of all the simulations of a run. Simulations aggregate
+/// their own reports and merge them in once, when they finish.
+class ReportAggregator {
+public:
+		void merge(const ReportAggregate &aggregate) {
+				std::lock_guard<std::mutex> lock(mutex);
+				total.merge(aggregate);
+		}
+
+		void write(std::ostream &out, const std::string &set = "",
+						bool header = true) {
+				std::lock_guard<std::mutex> lock(mutex);
+				total.write(out, set, header);
+		}
+
+private:
+		std::mutex mutex;
+		ReportAggregate total;
+};
+
+#endif
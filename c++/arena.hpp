@@ -0,0 +1,69 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Scratch memory for the temporary buffers of a simulation iteration.
+
+#ifndef ABM_ARENA_HPP
+#define ABM_ARENA_HPP
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/// A bump allocator that reset() empties all at once. A request that does
+/// not fit gets a block of its own until the next reset(), which replaces
+/// the buffer by one big enough for everything asked for since the last
+/// reset. Once an iteration has seen its largest requests the arena stops
+/// allocating.
+class ScratchArena {
+public:
+		/// Room for n values of T, uninitialized and valid until reset()
+		template <typename T>
+		T* allocate(size_t n) {
+				static_assert(std::is_trivially_destructible<T>::value,
+								"the arena never runs destructors");
+				static_assert(alignof(T) <= alignof(std::max_align_t),
+								"over-aligned types are not supported");
+				size_t bytes = n * sizeof(T);
+				size_t offset = (used + alignof(T) - 1) / alignof(T) * alignof(T);
+				demand += bytes + alignof(T);
+				if (offset + bytes <= capacity) {
+						used = offset + bytes;
+						return (T*) (buffer.get() + offset);
+				}
+				overflow.emplace_back(new char[bytes]);
+				return (T*) overflow.back().get();
+		}
+
+		/// Frees everything allocated since the last reset()
+		void reset() {
+				if (!overflow.empty()) {
+						buffer.reset(new char[demand]);
+						capacity = demand;
+						overflow.clear();
+				}
+				used = 0;
+				demand = 0;
+		}
+
+private:
+		std::unique_ptr<char[]> buffer;
+		size_t capacity = 0;
+		size_t used = 0; // Bytes of buffer in use
+		size_t demand = 0; // Bytes asked for since the last reset(), with padding
+		std::vector<std::unique_ptr<char[]>> overflow;
+};
+
+#endif
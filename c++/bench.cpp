@@ -0,0 +1,148 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//! Google Benchmark microbenchmarks of the engines, the shuffle, every
+//! event of the reference Simulation, Statistics, report() and
+//! print_agents(), over 1e3 to 1e8 agents. The simulations are set up
+//! outside the timed loops, so startup, option parsing and the terminal are
+//! not in the numbers. make bench writes them to bench.json.
+
+#include <benchmark/benchmark.h>
+
+#include <fstream>
+
+#include "abm.hpp"
+
+/// Agent counts 1e3, 1e4, ... 1e8
+static void agent_counts(benchmark::internal::Benchmark *benchmark) {
+		benchmark->RangeMultiplier(10)->Range(1000, 100000000)
+				->Unit(benchmark::kMicrosecond);
+}
+
+template <typename Engine>
+static void BM_uint(benchmark::State &state) {
+		Engine rng(1);
+		for (auto _: state)
+				benchmark::DoNotOptimize(rng.uint());
+}
+
+template <typename Engine>
+static void BM_to(benchmark::State &state) {
+		Engine rng(1);
+		uint64_t max = 10000;
+		for (auto _: state)
+				benchmark::DoNotOptimize(rng.to(max++));
+}
+
+template <typename Engine>
+static void BM_real(benchmark::State &state) {
+		Engine rng(1);
+		for (auto _: state)
+				benchmark::DoNotOptimize(rng.real());
+}
+
+BENCHMARK_TEMPLATE(BM_uint, LegacyRng);
+BENCHMARK_TEMPLATE(BM_uint, Xoshiro256pp);
+BENCHMARK_TEMPLATE(BM_uint, Pcg64);
+BENCHMARK_TEMPLATE(BM_to, LegacyRng);
+BENCHMARK_TEMPLATE(BM_to, Xoshiro256pp);
+BENCHMARK_TEMPLATE(BM_to, Pcg64);
+BENCHMARK_TEMPLATE(BM_real, LegacyRng);
+BENCHMARK_TEMPLATE(BM_real, Xoshiro256pp);
+BENCHMARK_TEMPLATE(BM_real, Pcg64);
+
+/// A single simulation of state.range(0) agents that writes its reports
+/// and agent output to /dev/null
+static Parameters bench_parameters(const benchmark::State &state) {
+		Parameters parameters;
+		parameters.simulations = 1;
+		parameters.agents = state.range(0);
+		parameters.infections = std::max<size_t>(parameters.agents / 1000, 1);
+		parameters.agent_filename = "/dev/null";
+		return parameters;
+}
+
+static void BM_shuffle(benchmark::State &state) {
+		AgentArray agents;
+		agents.append(0, State::SUSCEPTIBLE, state.range(0));
+		Rng rng(1);
+		for (auto _: state)
+				shuffle(agents, rng);
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_shuffle)->Apply(agent_counts);
+
+/// Times one event of a Simulation. The population drifts from call to
+/// call as it would over a run, and every run length of calls the
+/// simulation is reset (untimed), so the time is the event's mean over a
+/// run. Items are agents, or encounters for infect_method_one().
+template <void (Simulation::*event)()>
+static void BM_event(benchmark::State &state) {
+		Parameters parameters = bench_parameters(state);
+		Simulation simulation(0, parameters);
+		size_t calls = 0;
+		for (auto _: state) {
+				if (++calls % parameters.iterations == 0) {
+						state.PauseTiming();
+						simulation.reset(0, parameters);
+						state.ResumeTiming();
+				}
+				simulation.scratch.reset();
+				(simulation.*event)();
+		}
+		size_t items = event == &Simulation::infect_method_one ?
+				parameters.encounters : parameters.agents;
+		state.SetItemsProcessed(state.iterations() * items);
+}
+
+BENCHMARK_TEMPLATE(BM_event, &Simulation::grow)->Apply(agent_counts);
+BENCHMARK_TEMPLATE(BM_event, &Simulation::infect_method_one)->Apply(agent_counts);
+BENCHMARK_TEMPLATE(BM_event, &Simulation::infect_method_two)->Apply(agent_counts);
+BENCHMARK_TEMPLATE(BM_event, &Simulation::recover)->Apply(agent_counts);
+BENCHMARK_TEMPLATE(BM_event, &Simulation::vaccinate)->Apply(agent_counts);
+BENCHMARK_TEMPLATE(BM_event, &Simulation::susceptible)->Apply(agent_counts);
+BENCHMARK_TEMPLATE(BM_event, &Simulation::die)->Apply(agent_counts);
+BENCHMARK_TEMPLATE(BM_event, &Simulation::fused_step)->Apply(agent_counts);
+
+static void BM_statistics(benchmark::State &state) {
+		Simulation simulation(0, bench_parameters(state));
+		for (auto _: state)
+				benchmark::DoNotOptimize(Statistics(simulation.agents.records));
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_statistics)->Apply(agent_counts);
+
+static void BM_report(benchmark::State &state) {
+		Simulation simulation(0, bench_parameters(state));
+		std::ofstream null("/dev/null");
+		simulation.output = &null;
+		int iteration = 0;
+		for (auto _: state)
+				simulation.report(++iteration);
+		simulation.flush_reports();
+}
+
+BENCHMARK(BM_report)->Arg(1000)->Arg(100000000);
+
+static void BM_print_agents(benchmark::State &state) {
+		Simulation simulation(0, bench_parameters(state));
+		for (auto _: state)
+				simulation.print_agents();
+		state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_print_agents)->Apply(agent_counts);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,112 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Timing wheel of the agents' next transitions, for the next-event timing.
+
+#ifndef ABM_CALENDAR_HPP
+#define ABM_CALENDAR_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// The iteration each agent next changes in. An agent has at most one live
+/// due iteration, and its position sits in the bucket of that iteration
+/// modulo WHEEL, so scheduling is O(1) and an iteration only visits the
+/// entries of its bucket. Entries of agents rescheduled since are stale and
+/// are dropped when their bucket comes round; those due WHEEL or more
+/// iterations later stay in the bucket until their round. Agents scheduled
+/// for an iteration that has fired already are filed under next(), so none
+/// is lost. Cleared buckets keep their capacity.
+class EventCalendar {
+public:
+		/// Due iteration of agents that never change
+		static constexpr uint32_t NEVER = UINT32_MAX;
+		static constexpr size_t WHEEL = 1024;
+
+		EventCalendar() : buckets(WHEEL) {}
+
+		/// Forgets every agent
+		void clear() {
+				for (std::vector<uint32_t> &bucket: buckets)
+						bucket.clear();
+				due.clear();
+				unfired = 0;
+		}
+
+		/// Makes room for agents so that scheduling them does not allocate
+		void reserve(size_t agents) {
+				due.reserve(agents);
+		}
+
+		/// Agents with a due iteration, NEVER included
+		size_t size() const {
+				return due.size();
+		}
+
+		/// Due iteration of agent
+		uint32_t when(uint32_t agent) const {
+				return due[agent];
+		}
+
+		/// The first iteration that has not fired
+		uint64_t next() const {
+				return unfired;
+		}
+
+		/// Sets the due iteration of agent, growing the calendar to it.
+		/// Iterations from NEVER on are never; those before next() are next().
+		void schedule(uint32_t agent, uint64_t iteration) {
+				if (agent >= due.size())
+						due.resize(agent + 1, NEVER);
+				if (iteration >= NEVER) {
+						due[agent] = NEVER;
+						return;
+				}
+				iteration = std::max(iteration, unfired);
+				due[agent] = iteration;
+				buckets[iteration % WHEEL].push_back(agent);
+		}
+
+		/// Calls f(agent) for every agent due at iteration or overdue in its
+		/// bucket, in the order they were scheduled, after unscheduling it.
+		/// From then on next() is past iteration. f may schedule agents again,
+		/// even into this bucket.
+		template <typename F>
+		void fire(uint32_t iteration, F f) {
+				std::vector<uint32_t> &bucket = buckets[iteration % WHEEL];
+				firing.swap(bucket);
+				unfired = std::max<uint64_t>(unfired, iteration + 1);
+				for (uint32_t agent: firing) {
+						uint32_t at = due[agent];
+						if (at <= iteration) {
+								due[agent] = NEVER;
+								f(agent);
+						} else if (at != NEVER && at > iteration &&
+										at % WHEEL == iteration % WHEEL) {
+								bucket.push_back(agent);
+						}
+				}
+				firing.clear();
+		}
+
+private:
+		std::vector<uint32_t> due; // By agent position
+		std::vector<std::vector<uint32_t>> buckets;
+		std::vector<uint32_t> firing; // The bucket being fired
+		uint64_t unfired = 0;
+};
+
+#endif
@@ -0,0 +1,405 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Agent storage resident on an accelerator, for --backend gpu. The state
+//! column lives in device memory and the per-agent events and batched
+//! encounters run there as OpenMP target regions. Builds with -fopenmp and
+//! an offload target (make abm_gpu) run them on the device; other builds,
+//! and builds without a device at run time, run the same loops on the host.
+//! Infection method two has no device kernel, so --backend gpu runs method
+//! one only.
+
+#ifndef ABM_DEVICE_HPP
+#define ABM_DEVICE_HPP
+
+#include "abm.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <utility>
+
+#ifdef _OPENMP
+#define DEVICE_PRAGMA(...) _Pragma(#__VA_ARGS__)
+#else
+#define DEVICE_PRAGMA(...)
+#endif
+
+/// A byte per agent, as AgentCompact<8>, kept on the device. Identities are
+/// positions. The kernels draw the same Philox numbers as the CPU kernels
+/// and the encounters the same xoshiro256++ pairs as encounter_batch(), so
+/// a run matches --storage compact --kernel simd --encounter_mode batched
+/// bit for bit. The per-state counts are kept on the host from what the
+/// kernels report, so reports do not copy the states back; the host copy
+/// of the states is only brought up to date when the host reads them, for
+/// snapshots, checkpoints and the events without a device kernel.
+struct AgentDevice {
+		Statistics counts;
+
+		AgentDevice() = default;
+
+		AgentDevice(const AgentDevice &other) {
+				*this = other;
+		}
+
+		AgentDevice(AgentDevice &&other) noexcept {
+				swap_with(other);
+		}
+
+		AgentDevice& operator=(const AgentDevice &other) {
+				if (this == &other)
+						return *this;
+				other.fetch();
+				clear();
+				reserve(other.count);
+				std::copy(other.states, other.states + other.count, states);
+				count = other.count;
+				counts = other.counts;
+				upload(0, count);
+				return *this;
+		}
+
+		AgentDevice& operator=(AgentDevice &&other) noexcept {
+				swap_with(other);
+				return *this;
+		}
+
+		~AgentDevice() {
+				release();
+		}
+
+		size_t size() const {
+				return count;
+		}
+
+		int identity(size_t i) const {
+				return i;
+		}
+
+		/// Copies the whole column to the host first if a kernel changed it
+		State state(size_t i) const {
+				fetch();
+				return (State) states[i];
+		}
+
+		void set_state(size_t i, State state) {
+				uint8_t *p = states;
+				if (!host_current) {
+						DEVICE_PRAGMA(omp target update from(p[i:1]))
+				}
+				counts.move((State) p[i], state);
+				p[i] = state;
+				upload(i, 1);
+		}
+
+		/// identity must be size(), the position the agent gets
+		void push_back(int identity, State state) {
+				append(identity, state, 1);
+		}
+
+		/// identity must be size()
+		void append(int identity, State state, size_t n) {
+				assert((size_t) identity == count);
+				(void) identity;
+				if (n == 0)
+						return;
+				if (count + n > capacity)
+						reserve(std::max(count + n, 2 * capacity));
+				uint8_t *p = states;
+				const size_t first = count;
+				DEVICE_PRAGMA(omp target teams distribute parallel for)
+				for (size_t i = first; i < first + n; i++)
+						p[i] = state;
+				// Filled on both sides rather than marked stale
+				std::fill(p + first, p + first + n, (uint8_t) state);
+				count += n;
+				counts[state] += n;
+		}
+
+		void reserve(size_t n) {
+				if (n <= capacity)
+						return;
+				fetch();
+				uint8_t *bigger = new uint8_t[n];
+				std::copy(states, states + count, bigger);
+				release();
+				states = bigger;
+				capacity = n;
+				DEVICE_PRAGMA(omp target enter data map(alloc: bigger[0:n]))
+				upload(0, count);
+		}
+
+		/// Keeps the device memory
+		void clear() {
+				count = 0;
+				counts = Statistics();
+				host_current = true;
+		}
+
+		void prefetch(size_t) const {}
+
+		void advise(Access) const {}
+
+		void swap(size_t i, size_t j) {
+				State t = state(i);
+				store(i, state(j));
+				store(j, t);
+		}
+
+		size_t living() const {
+				return count - counts.dead;
+		}
+
+		Statistics statistics() const {
+				return counts;
+		}
+
+		/// Counts the states on the device
+		Statistics recount() const {
+				size_t found[STATE_COUNT] = {};
+				const uint8_t *p = states;
+				const size_t n = count;
+				DEVICE_PRAGMA(omp target teams distribute parallel for \
+								map(tofrom: found[0:STATE_COUNT]) \
+								reduction(+: found[0:STATE_COUNT]))
+				for (size_t i = 0; i < n; i++)
+						found[p[i]]++;
+				Statistics stats;
+				for (size_t s = 0; s < STATE_COUNT; s++)
+						stats[(State) s] = found[s];
+				return stats;
+		}
+
+		/// As AgentArray::transition(), on the host copy
+		template <typename F>
+		void transition(std::initializer_list<State> from, F f) {
+				fetch();
+				bool changed = false;
+				for (size_t i = 0; i < count; i++) {
+						State state = (State) states[i];
+						if (std::find(from.begin(), from.end(), state) == from.end())
+								continue;
+						State to = f(i, state);
+						if (to == state)
+								continue;
+						counts.move(state, to);
+						states[i] = to;
+						changed = true;
+				}
+				if (changed)
+						upload(0, count);
+		}
+
+		/// As AgentArray::sample(), one draw per agent
+		template <typename Engine>
+		size_t sample(State from, State to, double prob, Engine &rng) {
+				size_t moved = 0;
+				transition({from}, [&](size_t, State state) {
+								if (rng.real() < prob) {
+										++moved;
+										return to;
+								}
+								return state;
+								});
+				return moved;
+		}
+
+		Statistics step(const TransitionTable &table, const Philox2x32 &philox,
+						uint64_t stream) {
+				Statistics moved;
+				step(&table, 1, philox, stream, &moved);
+				return moved;
+		}
+
+		/// As AgentColumns::step(), in one pass over the states on the device,
+		/// which reduces the moves of each stage there
+		void step(const TransitionTable *stages, size_t count,
+						const Philox2x32 &philox, uint64_t stream, Statistics *moved) {
+				assert(count <= AgentColumns::MAX_STAGES);
+				const size_t TABLE = AgentColumns::MAX_STAGES * STATE_COUNT;
+				uint32_t thresholds[TABLE] = {};
+				uint8_t targets[TABLE] = {};
+				size_t left[TABLE] = {};
+				for (size_t s = 0; s < count; s++) {
+						for (size_t k = 0; k < STATE_COUNT; k++) {
+								thresholds[s * STATE_COUNT + k] = stages[s].thresholds[k];
+								targets[s * STATE_COUNT + k] = stages[s].targets[k];
+						}
+				}
+				const Philox2x32 key = philox;
+				const size_t stage_count = count;
+				uint8_t *p = states;
+				const size_t n = this->count;
+				DEVICE_PRAGMA(omp target teams distribute parallel for \
+								firstprivate(key) map(to: thresholds, targets) \
+								map(tofrom: left) reduction(+: left[0:TABLE]))
+				for (size_t i = 0; i < n; i++) {
+						uint8_t state = p[i];
+						const uint8_t from = state;
+						for (size_t s = 0; s < stage_count; s++) {
+								const size_t k = s * STATE_COUNT + state;
+								if (thresholds[k] > 0 &&
+												kernel_draw(key, stream + s, i) < thresholds[k]) {
+										++left[k];
+										state = targets[k];
+								}
+						}
+						if (state != from)
+								p[i] = state;
+				}
+				for (size_t s = 0; s < count; s++) {
+						for (size_t k = 0; k < STATE_COUNT; k++) {
+								const size_t c = left[s * STATE_COUNT + k];
+								if (c == 0)
+										continue;
+								moved[s][(State) k] += c;
+								counts[(State) k] -= c;
+								counts[(State) targets[s * STATE_COUNT + k]] += c;
+						}
+				}
+				mark_stale();
+		}
+
+		/// encounter_batch() on the device: each block of encounters draws its
+		/// pairs from the same xoshiro256++ as there and reads the states. The
+		/// positions to infect come back to be sorted and deduplicated, and go
+		/// out again to be set.
+		size_t encounter_batch(size_t count, const Philox2x32 &philox,
+						uint64_t stream, ScratchArena &arena, size_t cold) {
+				// A copy, as the device cannot see the host's globals
+				const size_t BLOCK = ENCOUNTER_BLOCK;
+				const size_t blocks = (count + BLOCK - 1) / BLOCK;
+				const size_t size = this->count;
+				uint32_t *infected = arena.allocate<uint32_t>(count);
+				size_t *found = arena.allocate<size_t>(blocks);
+				const Philox2x32 key = philox;
+				const uint8_t *p = states;
+				DEVICE_PRAGMA(omp target teams distribute parallel for firstprivate(key) \
+								map(from: infected[0:count], found[0:blocks]))
+				for (size_t k = 0; k < blocks; k++) {
+						const size_t n = std::min(BLOCK, count - k * BLOCK);
+						Xoshiro256pp rng(key((stream << 32) | k));
+						uint32_t *part = infected + k * BLOCK;
+						size_t hits = 0;
+						for (size_t i = 0; i < n; i++) {
+								// Cold positions wrap around to size or more
+								const uint32_t first = rng.to(size + cold) - cold;
+								const uint32_t second = rng.to(size + cold) - cold;
+								if (first >= size || second >= size)
+										continue;
+								const uint8_t a = p[first];
+								const uint8_t b = p[second];
+								if (a == State::SUSCEPTIBLE && b == State::INFECTIOUS)
+										part[hits++] = first;
+								else if (a == State::INFECTIOUS && b == State::SUSCEPTIBLE)
+										part[hits++] = second;
+						}
+						found[k] = hits;
+				}
+				size_t total = 0;
+				for (size_t k = 0; k < blocks; k++) {
+						std::copy(infected + k * ENCOUNTER_BLOCK,
+										infected + k * ENCOUNTER_BLOCK + found[k], infected + total);
+						total += found[k];
+				}
+				std::sort(infected, infected + total);
+				total = std::unique(infected, infected + total) - infected;
+				uint8_t *q = states;
+				DEVICE_PRAGMA(omp target teams distribute parallel for \
+								map(to: infected[0:total]))
+				for (size_t k = 0; k < total; k++)
+						q[infected[k]] = State::INFECTIOUS;
+				if (host_current)
+						for (size_t k = 0; k < total; k++)
+								q[infected[k]] = State::INFECTIOUS;
+				counts.susceptible -= total;
+				counts.infectious += total;
+				return total;
+		}
+
+		/// Identities are positions, so the agents are always sorted
+		void sort_by_identity() {}
+
+private:
+		uint8_t *states = nullptr; // Host copy, mapped to the device
+		size_t count = 0;
+		size_t capacity = 0;
+		// Whether the host copy matches the device. Without a device they are
+		// the same memory and the copies are no-ops.
+		mutable bool host_current = true;
+
+		void mark_stale() {
+#ifdef _OPENMP
+				host_current = false;
+#endif
+		}
+
+		/// Brings the host copy up to date
+		void fetch() const {
+				if (host_current)
+						return;
+				uint8_t *p = states;
+				const size_t n = count;
+				DEVICE_PRAGMA(omp target update from(p[0:n]))
+				(void) p;
+				(void) n;
+				host_current = true;
+		}
+
+		/// Copies the host states of the n agents from first to the device
+		void upload(size_t first, size_t n) {
+				if (n == 0)
+						return;
+				uint8_t *p = states;
+				DEVICE_PRAGMA(omp target update to(p[first:n]))
+				(void) p;
+				(void) first;
+		}
+
+		/// Sets a state on the host copy and the device, counts untouched
+		void store(size_t i, State state) {
+				states[i] = state;
+				upload(i, 1);
+		}
+
+		/// Frees the host copy and the device memory
+		void release() {
+				if (states == nullptr)
+						return;
+				uint8_t *p = states;
+				const size_t n = capacity;
+				DEVICE_PRAGMA(omp target exit data map(delete: p[0:n]))
+				(void) n;
+				delete[] p;
+				states = nullptr;
+				capacity = 0;
+		}
+
+		void swap_with(AgentDevice &other) {
+				std::swap(counts, other.counts);
+				std::swap(states, other.states);
+				std::swap(count, other.count);
+				std::swap(capacity, other.capacity);
+				std::swap(host_current, other.host_current);
+		}
+};
+
+/// Runs the batch on the device rather than on the pool
+inline size_t encounter_batch(AgentDevice &agents, size_t count,
+				const Philox2x32 &philox, uint64_t stream, ForkJoin&,
+				ScratchArena &arena, size_t cold = 0) {
+		return agents.encounter_batch(count, philox, stream, arena, cold);
+}
+
+#endif
@@ -0,0 +1,132 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! A pool of threads for the data-parallel parts of a single simulation.
+
+#ifndef ABM_FORK_JOIN_HPP
+#define ABM_FORK_JOIN_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "placement.hpp"
+
+/// A fixed set of threads for data-parallel loops. run(count, f) calls f(0) to
+/// f(count - 1) on the calling thread and the workers and returns once all the
+/// calls are done. Calls are handed out one index at a time, so uneven ones
+/// balance out.
+class ForkJoin {
+public:
+		/// threads = 0 uses default_threads(). The calling thread is one of
+		/// them; the others are placed as workers 1 to threads - 1.
+		explicit ForkJoin(size_t threads) {
+				if (threads == 0)
+						threads = default_threads();
+				for (size_t i = 1; i < threads; i++)
+						workers.emplace_back([this, i]() {
+										place_worker(i);
+										work();
+										});
+		}
+
+		~ForkJoin() {
+				{
+						std::lock_guard<std::mutex> lock(mutex);
+						stopping = true;
+				}
+				start.notify_all();
+				for (auto &worker: workers)
+						worker.join();
+		}
+
+		ForkJoin(const ForkJoin&) = delete;
+		ForkJoin& operator=(const ForkJoin&) = delete;
+
+		size_t threads() const {
+				return workers.size() + 1;
+		}
+
+		/// f is called through a plain function pointer rather than a
+		/// std::function, so that running a job never allocates.
+		template <typename F>
+		void run(size_t count, const F &f) {
+				if (workers.empty() || count <= 1) {
+						for (size_t i = 0; i < count; i++)
+								f(i);
+						return;
+				}
+				Job job = {&f, [](const void *f, size_t i) { (*(const F*) f)(i); }};
+				{
+						std::lock_guard<std::mutex> lock(mutex);
+						current = job;
+						calls = count;
+						next = 0;
+						active = workers.size();
+						++generation;
+				}
+				start.notify_all();
+				share(job, count);
+				std::unique_lock<std::mutex> lock(mutex);
+				finished.wait(lock, [this]() { return active == 0; });
+		}
+
+private:
+		struct Job {
+				const void *f;
+				void (*call)(const void*, size_t);
+		};
+
+		std::vector<std::thread> workers;
+		std::mutex mutex; // Guards the fields below but next
+		std::condition_variable start, finished;
+		Job current = {nullptr, nullptr};
+		size_t calls = 0;
+		std::atomic<size_t> next{0}; // Next index to hand out
+		size_t active = 0; // Workers still on the current job
+		uint64_t generation = 0; // Number of jobs started
+		bool stopping = false;
+
+		void share(Job job, size_t count) {
+				for (size_t i = next++; i < count; i = next++)
+						job.call(job.f, i);
+		}
+
+		void work() {
+				uint64_t seen = 0;
+				for (;;) {
+						Job job;
+						size_t count;
+						{
+								std::unique_lock<std::mutex> lock(mutex);
+								start.wait(lock, [&]() { return stopping || generation != seen; });
+								if (stopping)
+										return;
+								seen = generation;
+								job = current;
+								count = calls;
+						}
+						share(job, count);
+						std::lock_guard<std::mutex> lock(mutex);
+						if (--active == 0)
+								finished.notify_one();
+				}
+		}
+};
+
+#endif
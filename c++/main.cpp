@@ -1,21 +1,109 @@
-#include <boost/asio.hpp>
-
 #include "abm.hpp"
+#include "device.hpp"
+#include "scheduler.hpp"
+#include "shards.hpp"
 
 #include "CLI11.hpp"
 
+#include <fstream>
+#include <sstream>
 
-/// Gets command line arguments and then runs the simulations in a parallel pool.
-int main(int argc, char **argv) {
-		Parameters parameters;
-		size_t identity = 0;
-		CLI::App app{"Agent based model in C++"};
-		argv = app.ensure_utf8(argv);
+/// The parameter sets of --sweep and where the output of each one goes
+struct Sweep {
+		std::vector<Parameters> sets;
+		std::vector<OutputTargets> targets;
+};
+
+/// Runs one simulation, or all of them on the work-stealing pool, or resumes
+/// the one in checkpoint if there is one, or runs the sweep if there is
+/// one. Output goes to the targets there are.
+template <typename SimulationType>
+void run(size_t identity, const Parameters &parameters,
+				OutputTargets targets, const std::vector<uint8_t> &checkpoint,
+				const Sweep &sweep) {
+		if (!sweep.sets.empty()) {
+				run_sweep<SimulationType>(sweep.sets, std::cout, sweep.targets);
+		} else if (!checkpoint.empty()) {
+				SimulationType simulation(parameters, checkpoint);
+				metrics().plan(1, parameters.iterations - simulation.iteration);
+				simulation.writer = targets.writer;
+				simulation.aggregator = targets.aggregator;
+				simulation.profiler = targets.profiler;
+				simulation.advance(parameters.iterations);
+				simulation.finish();
+		} else if (parameters.simulations <= 1) {
+				metrics().plan(1, parameters.iterations);
+				SimulationType simulation(identity, parameters);
+				simulation.writer = targets.writer;
+				simulation.aggregator = targets.aggregator;
+				simulation.profiler = targets.profiler;
+				simulation.simulate();
+		} else {
+				run_simulations<SimulationType>(parameters, std::cout, targets);
+		}
+}
+
+/// Runs the simulations with the infection method fixed at compile time,
+/// as the parameters and every set of a sweep give it. BOTH picks the
+/// method by identity, so it, and sweeps over the method, stay run time
+/// choices.
+template <typename Storage, typename Engine>
+void run_with_engine(size_t identity, const Parameters &parameters,
+				OutputTargets targets, const std::vector<uint8_t> &checkpoint,
+				const Sweep &sweep) {
+		InfectionMethod method = sweep.sets.empty() ? parameters.infection_method :
+				sweep.sets[0].infection_method;
+		for (const Parameters &set: sweep.sets)
+				if (set.infection_method != method)
+						method = BOTH;
+		switch(method) {
+				case ONE:
+						run<BasicSimulation<Storage, Engine, ONE>>(identity, parameters,
+										targets, checkpoint, sweep);
+						break;
+				case TWO:
+						run<BasicSimulation<Storage, Engine, TWO>>(identity, parameters,
+										targets, checkpoint, sweep);
+						break;
+				case BOTH:
+						run<BasicSimulation<Storage, Engine>>(identity, parameters,
+										targets, checkpoint, sweep);
+						break;
+		}
+}
+
+/// Runs the simulations with the random number engine chosen on the command
+/// line.
+template <typename Storage>
+void run_with_storage(size_t identity, const Parameters &parameters,
+				OutputTargets targets, const std::vector<uint8_t> &checkpoint,
+				const Sweep &sweep) {
+		switch(parameters.generator) {
+				case LEGACY:
+						run_with_engine<Storage, LegacyRng>(identity, parameters,
+										targets, checkpoint, sweep);
+						break;
+				case XOSHIRO:
+						run_with_engine<Storage, Xoshiro256pp>(identity, parameters,
+										targets, checkpoint, sweep);
+						break;
+				case PCG:
+						run_with_engine<Storage, Pcg64>(identity, parameters,
+										targets, checkpoint, sweep);
+						break;
+		}
+}
 
+/// Adds the options that set parameters to app
+static void add_parameter_options(CLI::App &app, Parameters &parameters) {
 		app.add_option("-s,--simulations", parameters.simulations,
 						"Number of simulations");
-		app.add_option("--identity", identity,
-						"Id number of simulation (if running only one)");
+		app.add_option("--threads", parameters.threads,
+						"Threads to run the simulations on (0 = one per hardware thread)");
+		app.add_option("--shards", parameters.shards,
+						"Split a single simulation into this many shards that run on "
+						"--threads threads (implies --storage shards; results depend on "
+						"the number of shards, not of threads)");
 		app.add_option("-i,--iterations", parameters.iterations,
 						"Number of iterations in a simulation");
 		app.add_option("-a,--agents", parameters.agents,
@@ -42,21 +130,534 @@ int main(int argc, char **argv) {
 						"Iteration frequency to write out agents (0 = never)");
 		app.add_option("--agent_filename", parameters.agent_filename,
 						"Agent output file name");
+		app.add_option("--agent_format", parameters.agent_format,
+						"Agent output format (csv = agent_filename, binary = one "
+						"snapshot per simulation and iteration named after "
+						"agent_filename; snapshot_csv converts them)")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, AgentFormat>{
+										{"csv", AgentFormat::CSV},
+										{"binary", AgentFormat::BINARY}},
+										CLI::ignore_case));
+		app.add_option("--storage", parameters.storage,
+						"Agent storage layout (array = reference, columns = state "
+						"columns with per-state index sets, shards = columns split into "
+						"shards updated in parallel, which implies --kernel simd, compact "
+						"= a byte per agent and packed = four bits per agent, both with "
+						"identities implied by position, which implies --shuffle "
+						"partial; --sampling skip samples exactly on them)")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, StorageLayout>{
+										{"array", StorageLayout::ARRAY},
+										{"columns", StorageLayout::COLUMNS},
+										{"shards", StorageLayout::SHARDS},
+										{"compact", StorageLayout::COMPACT},
+										{"packed", StorageLayout::PACKED}},
+										CLI::ignore_case));
+		app.add_option("--backend", parameters.backend,
+						"Where the per-agent events and encounters run (cpu = on the "
+						"host, gpu = on the accelerator with the agents kept in its "
+						"memory, which implies --kernel simd, --encounter_mode batched "
+						"and --shuffle partial and gives the same results as they do; "
+						"--infection_method 1 and builds with ABM_GPU defined only, such "
+						"as make abm_gpu)")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, Backend>{
+										{"cpu", Backend::CPU},
+										{"gpu", Backend::GPU}},
+										CLI::ignore_case));
+		app.add_option("--sampling", parameters.sampling,
+						"Sampling of the per-agent events (exact = one draw per agent, "
+						"skip = geometric gaps between successes, which is statistically "
+						"equivalent but not the same random stream; implies --storage "
+						"columns)")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, Sampling>{
+										{"exact", Sampling::EXACT},
+										{"skip", Sampling::SKIP}},
+										CLI::ignore_case));
+
+		app.add_option("--rng", parameters.generator,
+						"Random number engine (legacy = 15 bit LCG shared with the other "
+						"languages, xoshiro = xoshiro256++, pcg = PCG64)")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, Generator>{
+										{"legacy", Generator::LEGACY},
+										{"xoshiro", Generator::XOSHIRO},
+										{"pcg", Generator::PCG}},
+										CLI::ignore_case));
+
+		app.add_option("--kernel", parameters.kernel,
+						"Per-agent event kernels (scalar = one agent at a time, simd = "
+						"vectorized over the state column with Philox draws; takes "
+						"precedence over --sampling and implies --storage columns)")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, EventKernel>{
+										{"scalar", EventKernel::SCALAR},
+										{"simd", EventKernel::SIMD}},
+										CLI::ignore_case));
+
+		app.add_flag("--fused", parameters.fused,
+						"Apply recover, vaccinate, susceptible and die in one pass over "
+						"the agents (in that order for each agent), where --events runs "
+						"them one after the other in that order (not with --sampling "
+						"skip, which has no fused pass)");
+		app.add_option("--events", parameters.events,
+						"Events of each iteration in order, separated by spaces (grow, "
+						"infect, recover, vaccinate, susceptible, die; all of them by "
+						"default); events that cannot change a state are dropped")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, Event>{
+										{"grow", EVENT_GROW},
+										{"infect", EVENT_INFECT},
+										{"recover", EVENT_RECOVER},
+										{"vaccinate", EVENT_VACCINATE},
+										{"susceptible", EVENT_SUSCEPTIBLE},
+										{"die", EVENT_DIE}},
+										CLI::ignore_case));
+		app.add_flag("--lazy_events", parameters.lazy_events,
+						"Also drop the events with zero probabilities that draw a number "
+						"per agent, and the infections while no agent is susceptible or "
+						"infectious (equivalent in distribution, but other draws)");
+		app.add_option("--timing", parameters.timing,
+						"How the per-agent events find their agents (steps = every agent "
+						"draws every iteration, events = each agent's next transition "
+						"is drawn ahead and kept in a timing wheel, so an iteration only "
+						"visits the agents that change; equivalent in distribution, "
+						"implies --shuffle partial)")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, Timing>{
+										{"steps", Timing::STEPS},
+										{"events", Timing::EVENTS}},
+										CLI::ignore_case));
+
+		app.add_option("--shuffle", parameters.shuffle,
+						"Agent shuffling of infect_method_two (full = every agent, "
+						"partial = only the positions read, which is statistically "
+						"equivalent, keeps the agents in order and is not the same "
+						"random stream)")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, Shuffle>{
+										{"full", Shuffle::FULL},
+										{"partial", Shuffle::PARTIAL}},
+										CLI::ignore_case));
+
+		app.add_option("--encounter_mode", parameters.encounter_mode,
+						"Encounters of infect_method_one (sequential = one after the "
+						"other, batched = all at once against the states before them, "
+						"drawn and read in parallel on --threads threads)")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, EncounterMode>{
+										{"sequential", EncounterMode::SEQUENTIAL},
+										{"batched", EncounterMode::BATCHED}},
+										CLI::ignore_case));
+
+		app.add_option("--compaction", parameters.compaction,
+						"Moving dead agents out of the agent storage (off = never, live = "
+						"encounters only pick living agents, equivalent = encounters "
+						"still pick dead ones as often, which is equivalent in "
+						"distribution to off and implies --shuffle partial, with --rng "
+						"xoshiro or pcg only; array and columns storage only)")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, Compaction>{
+										{"off", Compaction::OFF},
+										{"live", Compaction::LIVE},
+										{"equivalent", Compaction::EQUIVALENT}},
+										CLI::ignore_case));
+		app.add_option("--compact_every", parameters.compact_every,
+						"Iterations between compactions (0 = only by --compact_dead)");
+		app.add_option("--compact_dead", parameters.compact_dead,
+						"Compact once this fraction of the stored agents is dead (0 = "
+						"only by --compact_every)");
+
+		app.add_option("--checkpoint_every", parameters.checkpoint_every,
+						"Iterations between checkpoints of each simulation, written "
+						"on a thread of their own (0 = never)");
+		app.add_option("--checkpoint_file", parameters.checkpoint_file,
+						"Checkpoint file name, which gets the simulation's identity");
+
+		app.add_option("--report_every", parameters.report_every,
+						"Iterations between reports (0 = only the first and last)");
+		app.add_flag("--aggregate", parameters.aggregate,
+						"Instead of a row per simulation, report the mean, variance and "
+						"5th, 50th and 95th percentiles of each statistic over the "
+						"simulations, per reported iteration");
+		app.add_flag("--async_output", parameters.async_output,
+						"Format and write reports and agent snapshots on a thread of "
+						"their own");
+		app.add_option("--output_queue", parameters.output_queue,
+						"Records the asynchronous writer can hold before --output_full "
+						"applies");
+		app.add_option("--output_full", parameters.output_full,
+						"What a simulation does when the asynchronous writer is full "
+						"(wait = wait for room, drop = drop agent snapshots but not reports)")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, OutputFull>{
+										{"wait", OutputFull::WAIT},
+										{"drop", OutputFull::DROP}},
+										CLI::ignore_case));
+}
+
+/// Applies the options that imply others, for a run that resumes a
+/// checkpoint if resuming
+static void imply_options(Parameters &parameters, bool resuming = false) {
+		// Skipping needs the per-state index sets and the kernels need the
+		// packed state column. Shards only run the kernels in parallel. The
+		// compact layouts run the kernels on their own states. The device
+		// only runs the kernels and the batched encounters, and a full
+		// shuffle would copy a state to it per swap.
+		// Method two reads and writes the states through the arrangement on
+		// the host, which would copy the whole state column off the device
+		// and back every iteration.
+		if (parameters.backend == Backend::GPU &&
+						parameters.infection_method != InfectionMethod::ONE) {
+				std::cerr << "--backend gpu needs --infection_method 1, ignored\n";
+				parameters.backend = Backend::CPU;
+		}
+		if (parameters.backend == Backend::GPU) {
+				parameters.storage = StorageLayout::DEVICE;
+				parameters.shards = 0;
+				parameters.kernel = EventKernel::SIMD;
+				parameters.encounter_mode = EncounterMode::BATCHED;
+				parameters.shuffle = Shuffle::PARTIAL;
+		}
+		if (parameters.shards > 0)
+				parameters.storage = StorageLayout::SHARDS;
+		if (parameters.storage == StorageLayout::SHARDS)
+				parameters.kernel = EventKernel::SIMD;
+		else if (parameters.storage == StorageLayout::ARRAY &&
+						(parameters.sampling == Sampling::SKIP ||
+						parameters.kernel == EventKernel::SIMD))
+				parameters.storage = StorageLayout::COLUMNS;
+		// The fused pass draws once per agent and event, which would quietly
+		// drop skip sampling.
+		if (parameters.fused && parameters.sampling == Sampling::SKIP &&
+						parameters.kernel == EventKernel::SCALAR) {
+				std::cerr << "--fused cannot skip sample, use --kernel simd or "
+								"--sampling exact; ignored\n";
+				parameters.fused = false;
+		}
+		// The compact layouts' identities are positions, which a full shuffle
+		// would hand to other agents in the agent output.
+		if (parameters.storage == StorageLayout::COMPACT ||
+						parameters.storage == StorageLayout::PACKED)
+				parameters.shuffle = Shuffle::PARTIAL;
+		// The legacy engine only draws positions below 32768, so with more
+		// agents the cold ones, which take the first positions, would crowd
+		// the living out of every encounter.
+		if (parameters.compaction == Compaction::EQUIVALENT &&
+						parameters.generator == Generator::LEGACY) {
+				std::cerr << "--compaction equivalent needs --rng xoshiro or pcg, "
+								"ignored\n";
+				parameters.compaction = Compaction::OFF;
+		}
+		// A full shuffle would have to move the compacted agents too, and
+		// the scheduled agents.
+		if (parameters.compaction == Compaction::EQUIVALENT)
+				parameters.shuffle = Shuffle::PARTIAL;
+		// The calendar is not part of a checkpoint, so a resumed run would
+		// draw every agent's next transition anew.
+		if (parameters.timing == Timing::EVENTS &&
+						(parameters.checkpoint_every > 0 || resuming)) {
+				std::cerr << "--timing events cannot be checkpointed or resumed, "
+								"ignored\n";
+				parameters.timing = Timing::STEPS;
+		}
+		if (parameters.timing == Timing::EVENTS) {
+				if (parameters.compaction != Compaction::OFF ||
+								parameters.storage == StorageLayout::SHARDS ||
+								parameters.encounter_mode == EncounterMode::BATCHED) {
+						std::cerr << "--timing events needs agents that stay put, without "
+										"--compaction, --storage shards or --encounter_mode batched, "
+										"ignored\n";
+						parameters.timing = Timing::STEPS;
+				} else {
+						parameters.shuffle = Shuffle::PARTIAL;
+				}
+		}
+		if (parameters.compaction != Compaction::OFF &&
+						parameters.storage != StorageLayout::ARRAY &&
+						parameters.storage != StorageLayout::COLUMNS) {
+				std::cerr << "--compaction needs --storage array or columns, ignored\n";
+				parameters.compaction = Compaction::OFF;
+		}
+}
+
+/// Reads the parameter sets of a sweep from path. Each line that is not
+/// empty or a # comment holds options as on the command line, which apply
+/// on top of base; a value list such as --infections 10,100,1000 makes a
+/// set of each value, and several lists make a set of each combination.
+/// Throws std::runtime_error for lines that cannot be read or that change
+/// an option of the whole run.
+static std::vector<Parameters> read_sweep(const std::string &path,
+				const Parameters &base) {
+		std::ifstream in(path);
+		if (!in)
+				throw std::runtime_error(path + ": cannot be read");
+		std::vector<Parameters> sets;
+		std::string line;
+		for (size_t number = 1; std::getline(in, line); number++) {
+				std::istringstream words(line);
+				std::vector<std::vector<std::string>> choices;
+				std::string word;
+				while (words >> word && word[0] != '#') {
+						choices.emplace_back();
+						std::istringstream values(word);
+						std::string value;
+						while (std::getline(values, value, ','))
+								choices.back().push_back(value);
+				}
+				if (choices.empty())
+						continue;
+				std::string where = path + ":" + std::to_string(number) + ": ";
+				// Counts through the combinations, the last list fastest
+				std::vector<size_t> choice(choices.size(), 0);
+				for (;;) {
+						std::vector<std::string> args;
+						for (size_t k = choices.size(); k-- > 0;)
+								args.push_back(choices[k][choice[k]]);
+						Parameters parameters = base;
+						CLI::App app;
+						add_parameter_options(app, parameters);
+						try {
+								app.parse(args);
+						} catch (const CLI::ParseError &e) {
+								throw std::runtime_error(where + e.what());
+						}
+						imply_options(parameters);
+						if (parameters.storage != base.storage ||
+										parameters.generator != base.generator ||
+										parameters.threads != base.threads ||
+										parameters.aggregate != base.aggregate ||
+										parameters.async_output != base.async_output ||
+										parameters.checkpoint_every != base.checkpoint_every)
+								throw std::runtime_error(where + "--storage, --backend, --rng, "
+												"--threads, --aggregate, --async_output and --checkpoint_every are "
+												"options of the whole sweep");
+						sets.push_back(parameters);
+						size_t k = choices.size();
+						while (k-- > 0 && ++choice[k] == choices[k].size())
+								choice[k] = 0;
+						if (k == (size_t) -1)
+								break;
+				}
+		}
+		if (sets.empty())
+				throw std::runtime_error(path + ": no parameter sets");
+		return sets;
+}
+
+/// Gets command line arguments and then runs the simulations.
+int main(int argc, char **argv) {
+		Parameters parameters;
+		size_t identity = 0;
+		CLI::App app{"Agent based model in C++"};
+		argv = app.ensure_utf8(argv);
+
+		add_parameter_options(app, parameters);
+		app.add_option("--identity", identity,
+						"Id number of simulation (if running only one)");
+		MappingPolicy &mapping = mapping_policy();
+		app.add_option("--agent_memory", mapping.memory,
+						"Memory of the agent columns of 2 MiB or more (heap, hugepages = "
+						"anonymous mappings in transparent huge pages, which take fewer "
+						"TLB entries for the encounters, file = mappings of unlinked "
+						"files in --map_directory, which the kernel pages out to when "
+						"the agents do not fit in RAM)")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, AgentMemory>{
+										{"heap", AgentMemory::HEAP},
+										{"hugepages", AgentMemory::HUGE_PAGES},
+										{"file", AgentMemory::FILE_BACKED}},
+										CLI::ignore_case));
+		app.add_option("--map_directory", mapping.directory,
+						"Directory of the files of --agent_memory file");
+		PlacementPolicy &placement = placement_policy();
+		app.add_option("--pin", placement.pinning,
+						"CPUs of the worker threads (none = as the kernel likes, compact "
+						"= the CPUs of one NUMA node before the next, scatter = one CPU of "
+						"each node in turn); a pinned worker's simulations keep their "
+						"agents on its node")
+				->transform(CLI::CheckedTransformer(
+										std::map<std::string, Pinning>{
+										{"none", PIN_NONE},
+										{"compact", PIN_COMPACT},
+										{"scatter", PIN_SCATTER}},
+										CLI::ignore_case));
+		std::string cpus;
+		app.add_option("--cpus", cpus,
+						"Pin the worker threads to these CPUs in turn, such as 0-7,16-23 "
+						"(one thread per CPU unless --threads says otherwise)")
+				->excludes("--pin");
+		app.add_flag("--sticky", placement.sticky,
+						"Run each simulation on the worker that starts it to the end, "
+						"rather than letting idle workers steal it");
+		std::string resume;
+		app.add_option("--resume", resume,
+						"Carry on the simulation checkpointed in this file, which must "
+						"be run with the same options; only its reports after the "
+						"checkpoint are written");
+		std::string sweep_file;
+		app.add_option("--sweep", sweep_file,
+						"Run every parameter set in this file, a line of options per "
+						"set or per combination of comma separated values, on one pool "
+						"of --threads threads, the report rows tagged with the set's "
+						"index; sets with the same initial population share it")
+				->excludes("--resume");
+		bool profile = false;
+		app.add_flag("--profile", profile,
+						"Print the calls, total, mean and 99th percentile time of every "
+						"event and the agents processed per second to stderr at the end "
+						"(builds with ABM_PROFILE defined only, such as make abm_profile)");
+
+		double status_every = 0;
+		app.add_option("--status_every", status_every,
+						"Seconds between status lines on stderr: iterations done and "
+						"per second, agents per second, simulations finished, running "
+						"and queued, output written and the time left (0 = none)");
+		int metrics_port = 0;
+		app.add_option("--metrics_port", metrics_port,
+						"Serve the progress counters, and the iterations of each "
+						"thread, to Prometheus over HTTP on this port of "
+						"--metrics_address while the run lasts (0 = none)")
+				->check(CLI::Range(0, 65535));
+		std::string metrics_address = "127.0.0.1";
+		app.add_option("--metrics_address", metrics_address,
+						"IPv4 address --metrics_port listens on (0.0.0.0 = every "
+						"interface)");
 
 		CLI11_PARSE(app, argc, argv);
 
-		if (parameters.simulations <= 1) {
-				Simulation simulation(identity, parameters);
-				simulation.simulate();
-		} else {
-				boost::asio::thread_pool pool(std::thread::hardware_concurrency());
-				for (size_t i = 0; i < parameters.simulations; i++) {
-						boost::asio::post(pool, [i, &parameters]() {
-										Simulation simulation(i, parameters);
-										simulation.simulate();
-										});
-				}
-				pool.join();
+		imply_options(parameters, !resume.empty());
+
+		if (!cpus.empty()) {
+				try {
+						placement.cpus = parse_cpu_list(cpus);
+				} catch (const std::exception &e) {
+						std::cerr << "--cpus: " << cpus << " is not a cpu list\n";
+						return 1;
+				}
+				placement.pinning = PIN_LIST;
+		}
+
+		std::vector<uint8_t> checkpoint;
+		if (!resume.empty()) {
+				try {
+						checkpoint = read_checkpoint(resume);
+				} catch (const std::exception &e) {
+						std::cerr << e.what() << "\n";
+						return 1;
+				}
+				parameters.simulations = 1;
+		}
+
+		Sweep sweep;
+		if (!sweep_file.empty()) {
+				// Every set would write the same checkpoint files, and the
+				// writer orders the simulations of one set only.
+				if (parameters.checkpoint_every > 0 || parameters.async_output) {
+						std::cerr << "--checkpoint_every and --async_output do not apply "
+										"to sweeps, ignored\n";
+						parameters.checkpoint_every = 0;
+						parameters.async_output = false;
+				}
+				try {
+						sweep.sets = read_sweep(sweep_file, parameters);
+				} catch (const std::exception &e) {
+						std::cerr << e.what() << "\n";
+						return 1;
+				}
+		}
+
+		std::unique_ptr<AsyncWriter> writer;
+		if (parameters.async_output)
+				writer.reset(new AsyncWriter(std::cout, parameters.simulations,
+										parameters.output_queue, parameters.output_full));
+
+		ReportAggregator aggregator;
+		OutputTargets targets;
+		targets.writer = writer.get();
+		if (parameters.aggregate)
+				targets.aggregator = &aggregator;
+		ProfileCollector profiler;
+		if (profile && PROFILING)
+				targets.profiler = &profiler;
+		else if (profile)
+				std::cerr << "--profile needs a build with ABM_PROFILE defined, ignored\n";
+		std::vector<ReportAggregator> aggregators(sweep.sets.size());
+		for (size_t s = 0; s < sweep.sets.size(); s++) {
+				sweep.targets.push_back(targets);
+				if (parameters.aggregate)
+						sweep.targets[s].aggregator = &aggregators[s];
+		}
+
+		std::unique_ptr<MetricsServer> server;
+		if (metrics_port > 0) {
+				try {
+						server.reset(new MetricsServer(metrics_port, metrics_address));
+				} catch (const std::exception &e) {
+						std::cerr << e.what() << "\n";
+						return 1;
+				}
+		}
+		std::unique_ptr<StatusLine> status;
+		if (status_every > 0)
+				status.reset(new StatusLine(std::cerr, status_every));
+
+		try {
+				switch(parameters.storage) {
+						case SHARDS:
+								run_with_storage<AgentShards>(identity, parameters, targets,
+												checkpoint, sweep);
+								break;
+						case COLUMNS:
+								run_with_storage<AgentColumns>(identity, parameters, targets,
+												checkpoint, sweep);
+								break;
+						case COMPACT:
+								run_with_storage<AgentCompact<8>>(identity, parameters, targets,
+												checkpoint, sweep);
+								break;
+						case PACKED:
+								run_with_storage<AgentCompact<4>>(identity, parameters, targets,
+												checkpoint, sweep);
+								break;
+						case ARRAY:
+								run_with_storage<AgentArray>(identity, parameters, targets,
+												checkpoint, sweep);
+								break;
+						case DEVICE:
+#ifdef ABM_GPU
+								run_with_storage<AgentDevice>(identity, parameters, targets,
+												checkpoint, sweep);
+								break;
+#else
+								std::cerr << "--backend gpu needs a build with ABM_GPU defined, "
+												"such as make abm_gpu\n";
+								return 1;
+#endif
+				}
+		} catch (const std::exception &e) {
+				std::cerr << e.what() << "\n";
+				return 1;
+		}
+		// The last status line
+		status.reset();
+
+		if (parameters.aggregate && sweep.sets.empty())
+				aggregator.write(std::cout);
+		if (parameters.aggregate)
+				for (size_t s = 0; s < aggregators.size(); s++)
+						aggregators[s].write(std::cout, std::to_string(s), s == 0);
+
+		if (targets.profiler)
+				profiler.write(std::cerr);
+
+		// The final flush
+		if (writer) {
+				writer->close();
+				if (writer->dropped() > 0)
+						std::cerr << writer->dropped() << " agent snapshots dropped\n";
 		}
 		return 0;
 }
@@ -0,0 +1,185 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Memory of the agent storages. Large columns can be mapped rather than
+//! taken from the heap: anonymous memory in transparent huge pages, which
+//! take fewer TLB entries for the random reads of the encounters, or an
+//! unlinked file, which the kernel can page out to when the populations of
+//! the running simulations do not fit in RAM.
+
+#ifndef ABM_MAPPED_HPP
+#define ABM_MAPPED_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <new>
+#include <string>
+#include <sys/mman.h>
+#include <system_error>
+#include <type_traits>
+#include <unistd.h>
+#include <vector>
+
+/// Where the agent columns live
+enum AgentMemory {
+		HEAP = 0, // operator new
+		HUGE_PAGES = 1, // Anonymous mappings in transparent huge pages
+		FILE_BACKED = 2 // Shared mappings of unlinked files in the map directory
+};
+
+/// How the next passes over a column read it
+enum Access {
+		STREAM = 0, // In order, so the kernel reads ahead and drops behind
+		RANDOM = 1 // At random, so read-ahead would be wasted
+};
+
+/// The memory of the agent columns, for the whole program. Columns created
+/// after a change get the new setting, existing ones keep theirs.
+struct MappingPolicy {
+		AgentMemory memory = AgentMemory::HEAP;
+		std::string directory = "."; // Of the files (AgentMemory::FILE_BACKED)
+		size_t threshold = 1 << 21; // Smaller columns stay on the heap
+};
+
+inline MappingPolicy& mapping_policy() {
+		static MappingPolicy policy;
+		return policy;
+}
+
+/// Size of a huge page, which huge page mappings are aligned to
+const size_t HUGE_PAGE_SIZE = 1 << 21;
+
+/// bytes rounded up to whole huge pages
+inline size_t mapped_size(size_t bytes) {
+		return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+/// Maps mapped_size(bytes) of zeroed memory as memory says. Throws
+/// std::bad_alloc if there is no memory and std::system_error if the file
+/// cannot be made.
+inline void* map_region(size_t bytes, AgentMemory memory) {
+		size_t size = mapped_size(bytes);
+		if (memory == AgentMemory::FILE_BACKED) {
+				const std::string &directory = mapping_policy().directory;
+				int fd = ::open(directory.c_str(), O_TMPFILE | O_RDWR, 0600);
+				if (fd < 0) {
+						// Not every file system has O_TMPFILE.
+						std::string path = directory + "/abm_agents_XXXXXX";
+						fd = ::mkstemp(&path[0]);
+						if (fd >= 0)
+								::unlink(path.c_str());
+				}
+				if (fd < 0)
+						throw std::system_error(errno, std::generic_category(), directory);
+				if (::ftruncate(fd, size) != 0) {
+						int error = errno;
+						::close(fd);
+						throw std::system_error(error, std::generic_category(), directory);
+				}
+				void *region = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+								MAP_SHARED, fd, 0);
+				::close(fd);
+				if (region == MAP_FAILED)
+						throw std::bad_alloc();
+				return region;
+		}
+		// Map a huge page more than asked for and trim it to an aligned range,
+		// as only aligned huge pages can be backed by one.
+		char *start = (char*) ::mmap(nullptr, size + HUGE_PAGE_SIZE,
+						PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+						-1, 0);
+		if (start == MAP_FAILED)
+				throw std::bad_alloc();
+		char *region = (char*) (((uintptr_t) start + HUGE_PAGE_SIZE - 1) /
+						HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+		if (region > start)
+				::munmap(start, region - start);
+		::munmap(region + size, start + HUGE_PAGE_SIZE - region);
+		::madvise(region, size, MADV_HUGEPAGE);
+		return region;
+}
+
+inline void unmap_region(void *region, size_t bytes) {
+		::munmap(region, mapped_size(bytes));
+}
+
+/// An allocator that maps the allocations of at least the policy's
+/// threshold and takes the others from the heap. Each allocator keeps the
+/// memory of the policy it was made under, and containers carry it along
+/// when they are moved or swapped.
+template <typename T>
+struct MappedAllocator {
+		using value_type = T;
+		using propagate_on_container_copy_assignment = std::true_type;
+		using propagate_on_container_move_assignment = std::true_type;
+		using propagate_on_container_swap = std::true_type;
+
+		AgentMemory memory = mapping_policy().memory;
+		size_t threshold = mapping_policy().threshold;
+
+		MappedAllocator() = default;
+
+		template <typename U>
+		MappedAllocator(const MappedAllocator<U> &other) :
+				memory(other.memory), threshold(other.threshold) {}
+
+		/// Whether n values are mapped
+		bool maps(size_t n) const {
+				return memory != AgentMemory::HEAP && n * sizeof(T) >= threshold;
+		}
+
+		T* allocate(size_t n) {
+				if (maps(n))
+						return (T*) map_region(n * sizeof(T), memory);
+				return (T*) ::operator new(n * sizeof(T));
+		}
+
+		void deallocate(T *p, size_t n) {
+				if (maps(n))
+						unmap_region(p, n * sizeof(T));
+				else
+						::operator delete(p);
+		}
+
+		template <typename U>
+		bool operator==(const MappedAllocator<U> &other) const {
+				return memory == other.memory && threshold == other.threshold;
+		}
+
+		template <typename U>
+		bool operator!=(const MappedAllocator<U> &other) const {
+				return !(*this == other);
+		}
+};
+
+/// A column of an agent storage
+template <typename T>
+using AgentVector = std::vector<T, MappedAllocator<T>>;
+
+/// Tells the kernel how column will be read next. Only file mappings read
+/// ahead, so this is a system call for those only.
+template <typename T>
+void advise(const AgentVector<T> &column, Access access) {
+		const MappedAllocator<T> &allocator = column.get_allocator();
+		if (allocator.memory != AgentMemory::FILE_BACKED ||
+						!allocator.maps(column.capacity()))
+				return;
+		::madvise((void*) column.data(), mapped_size(column.capacity() * sizeof(T)),
+						access == Access::STREAM ? MADV_SEQUENTIAL : MADV_RANDOM);
+}
+
+#endif
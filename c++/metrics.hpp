@@ -0,0 +1,343 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Live progress of a run: counters that each thread adds to as its
+//! simulations go, read by a status line printed every few seconds and by
+//! an optional HTTP endpoint in the Prometheus text format.
+
+#ifndef ABM_METRICS_HPP
+#define ABM_METRICS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#define ABM_METRICS_SOCKETS
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+/// Counters of the threads that share a slot, normally just one. Each slot
+/// has a cache line of its own, so adding to it is a relaxed atomic add on
+/// a line no other thread writes: no lock and no contention.
+struct alignas(64) ThreadCounters {
+		std::atomic<uint64_t> iterations{0};
+		std::atomic<uint64_t> agents{0}; // Agents of every iteration, summed
+		std::atomic<uint64_t> started{0}; // Simulations
+		std::atomic<uint64_t> finished{0};
+		std::atomic<uint64_t> bytes{0}; // Of report rows and agent output
+
+		static void add(std::atomic<uint64_t> &counter, uint64_t n) {
+				counter.fetch_add(n, std::memory_order_relaxed);
+		}
+};
+
+/// The counters summed over the threads at one time
+struct MetricsSample {
+		double seconds = 0; // Since the counters were created
+		uint64_t iterations = 0;
+		uint64_t agents = 0;
+		uint64_t started = 0;
+		uint64_t finished = 0;
+		uint64_t bytes = 0;
+		uint64_t planned = 0; // Simulations announced by plan()
+		uint64_t planned_iterations = 0;
+};
+
+/// The counters of every worker of the program, and of the asynchronous
+/// writer. Readers sum the slots, so their totals may be a moment behind.
+class Metrics {
+public:
+		static constexpr size_t SLOTS = 256;
+
+		Metrics() : origin(std::chrono::steady_clock::now()) {}
+
+		/// The counters of the pool worker with index worker, as tasks are
+		/// given it; a run without a pool is worker 0. Workers past SLOTS
+		/// share the slots.
+		ThreadCounters& local(size_t worker) {
+				const size_t slot = worker % SLOTS;
+				size_t seen = used.load(std::memory_order_relaxed);
+				while (seen <= slot && !used.compare_exchange_weak(seen, slot + 1,
+												std::memory_order_relaxed)) {}
+				return slots[slot];
+		}
+
+		/// The counters of the asynchronous writer's thread
+		ThreadCounters& writer() {
+				return output;
+		}
+
+		/// Announces simulations about to run, iterations in all
+		void plan(uint64_t simulations, uint64_t iterations) {
+				ThreadCounters::add(planned, simulations);
+				ThreadCounters::add(planned_iterations, iterations);
+		}
+
+		MetricsSample sample() const {
+				MetricsSample sample;
+				sample.seconds = std::chrono::duration<double>(
+								std::chrono::steady_clock::now() - origin).count();
+				for (size_t k = 0; k < threads(); k++) {
+						sample.iterations += load(slots[k].iterations);
+						sample.agents += load(slots[k].agents);
+						sample.started += load(slots[k].started);
+						sample.finished += load(slots[k].finished);
+						sample.bytes += load(slots[k].bytes);
+				}
+				sample.bytes += load(output.bytes);
+				sample.planned = load(planned);
+				sample.planned_iterations = load(planned_iterations);
+				return sample;
+		}
+
+		/// Slots up to the highest one used so far
+		size_t threads() const {
+				return used.load(std::memory_order_relaxed);
+		}
+
+		const ThreadCounters& slot(size_t k) const {
+				return slots[k];
+		}
+
+		static uint64_t load(const std::atomic<uint64_t> &counter) {
+				return counter.load(std::memory_order_relaxed);
+		}
+
+private:
+		std::chrono::steady_clock::time_point origin;
+		ThreadCounters slots[SLOTS];
+		ThreadCounters output;
+		std::atomic<size_t> used{0};
+		std::atomic<uint64_t> planned{0};
+		std::atomic<uint64_t> planned_iterations{0};
+};
+
+/// The counters of the program
+inline Metrics& metrics() {
+		static Metrics metrics;
+		return metrics;
+}
+
+/// A status line of now, with the rates since before: elapsed time,
+/// iterations done of those planned, iterations and agents per second,
+/// simulations finished, running and queued, output written and the time
+/// left at the mean rate so far.
+inline std::string format_status(const MetricsSample &now,
+				const MetricsSample &before) {
+		const double period = std::max(now.seconds - before.seconds, 1e-9);
+		const uint64_t running = now.started - std::min(now.finished, now.started);
+		const uint64_t queued = now.planned - std::min(now.started, now.planned);
+		char line[256];
+		int size = std::snprintf(line, sizeof(line),
+						"abm: %.1f s, %llu/%llu iterations, %.0f iterations/s, "
+						"%.3g agents/s, simulations %llu finished %llu running %llu queued, "
+						"%.1f MB written",
+						now.seconds, (unsigned long long) now.iterations,
+						(unsigned long long) now.planned_iterations,
+						(now.iterations - before.iterations) / period,
+						(now.agents - before.agents) / period,
+						(unsigned long long) now.finished, (unsigned long long) running,
+						(unsigned long long) queued, now.bytes / 1e6);
+		std::string status(line, std::min<size_t>(size, sizeof(line) - 1));
+		if (now.iterations > 0 && now.planned_iterations > now.iterations) {
+				double left = (now.planned_iterations - now.iterations) *
+						now.seconds / now.iterations;
+				std::snprintf(line, sizeof(line), ", eta %.0f s", left);
+				status += line;
+		}
+		return status + "\n";
+}
+
+/// The counters in the Prometheus text format, the totals and each
+/// worker's iterations, which show the stragglers
+inline std::string format_prometheus(const Metrics &metrics) {
+		const MetricsSample sample = metrics.sample();
+		std::ostringstream out;
+		auto put = [&out](const char *name, const char *type, const char *help,
+						uint64_t value) {
+				out << "# HELP abm_" << name << " " << help << "\n"
+						<< "# TYPE abm_" << name << " " << type << "\n"
+						<< "abm_" << name << " " << value << "\n";
+		};
+		put("iterations_total", "counter", "Iterations run", sample.iterations);
+		put("agents_total", "counter", "Agents of every iteration run",
+						sample.agents);
+		put("simulations_started_total", "counter", "Simulations started",
+						sample.started);
+		put("simulations_finished_total", "counter", "Simulations finished",
+						sample.finished);
+		put("simulations_planned", "gauge", "Simulations of the run",
+						sample.planned);
+		put("iterations_planned", "gauge", "Iterations of the run",
+						sample.planned_iterations);
+		put("output_bytes_total", "counter", "Report and agent output written",
+						sample.bytes);
+		out << "# HELP abm_thread_iterations_total Iterations run by each worker\n"
+				<< "# TYPE abm_thread_iterations_total counter\n";
+		for (size_t k = 0; k < metrics.threads(); k++)
+				out << "abm_thread_iterations_total{thread=\"" << k << "\"} "
+						<< Metrics::load(metrics.slot(k).iterations) << "\n";
+		return out.str();
+}
+
+/// Writes format_status() to out every so many seconds on a thread of its
+/// own, and once more when destroyed.
+class StatusLine {
+public:
+		StatusLine(std::ostream &out, double every, const Metrics &metrics = ::metrics()) :
+				out(out), every(every), metrics(metrics) {
+				thread = std::thread([this]() { run(); });
+		}
+
+		~StatusLine() {
+				{
+						std::lock_guard<std::mutex> lock(mutex);
+						stopping = true;
+				}
+				wake.notify_one();
+				thread.join();
+		}
+
+private:
+		std::ostream &out;
+		const double every;
+		const Metrics &metrics;
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable wake;
+		bool stopping = false;
+
+		void run() {
+				MetricsSample before = metrics.sample();
+				std::unique_lock<std::mutex> lock(mutex);
+				for (bool last = false; !last;) {
+						last = wake.wait_for(lock, std::chrono::duration<double>(every),
+										[this]() { return stopping; });
+						MetricsSample now = metrics.sample();
+						out << format_status(now, before) << std::flush;
+						before = now;
+				}
+		}
+};
+
+/// Serves format_prometheus() over HTTP on a port of one address, the
+/// loopback one unless told otherwise, to any request, on a thread of its
+/// own.
+class MetricsServer {
+public:
+		/// Listens on port of the IPv4 address host, port 0 for any free one
+		/// and 0.0.0.0 for every interface. Throws std::runtime_error if it
+		/// cannot.
+		explicit MetricsServer(uint16_t port, const std::string &host = "127.0.0.1",
+						const Metrics &metrics = ::metrics()) :
+				metrics(metrics) {
+#ifdef ABM_METRICS_SOCKETS
+				sockaddr_in address = {};
+				address.sin_family = AF_INET;
+				address.sin_port = htons(port);
+				if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1)
+						throw std::runtime_error("metrics: " + host + " is not an IPv4 address");
+				listener = socket(AF_INET, SOCK_STREAM, 0);
+				int on = 1;
+				setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+				socklen_t length = sizeof(address);
+				if (listener < 0 ||
+								bind(listener, (sockaddr*) &address, sizeof(address)) != 0 ||
+								listen(listener, 16) != 0 ||
+								getsockname(listener, (sockaddr*) &address, &length) != 0) {
+						if (listener >= 0)
+								close(listener);
+						throw std::runtime_error("metrics: cannot listen on " + host +
+										":" + std::to_string(port));
+				}
+				bound = ntohs(address.sin_port);
+				thread = std::thread([this]() { run(); });
+#else
+				(void) port;
+				(void) host;
+				throw std::runtime_error("metrics: the endpoint needs POSIX sockets");
+#endif
+		}
+
+		~MetricsServer() {
+#ifdef ABM_METRICS_SOCKETS
+				stopping.store(true);
+				thread.join();
+				close(listener);
+#endif
+		}
+
+		/// The port it listens on
+		uint16_t port() const {
+				return bound;
+		}
+
+private:
+		const Metrics &metrics;
+		int listener = -1;
+		uint16_t bound = 0;
+		std::atomic<bool> stopping{false};
+		std::thread thread;
+
+#ifdef ABM_METRICS_SOCKETS
+		/// Answers one connection at a time, looking for stopping in between
+		void run() {
+				while (!stopping.load()) {
+						pollfd waiting = {listener, POLLIN, 0};
+						if (poll(&waiting, 1, 100) <= 0)
+								continue;
+						int client = accept(listener, nullptr, nullptr);
+						if (client < 0)
+								continue;
+						// The request is read but not looked at.
+						pollfd request = {client, POLLIN, 0};
+						char ignored[1024];
+						if (poll(&request, 1, 1000) > 0)
+								recv(client, ignored, sizeof(ignored), 0);
+						const std::string body = format_prometheus(metrics);
+						const std::string response = "HTTP/1.0 200 OK\r\n"
+								"Content-Type: text/plain; version=0.0.4\r\n"
+								"Content-Length: " + std::to_string(body.size()) + "\r\n"
+								"Connection: close\r\n\r\n" + body;
+						for (size_t sent = 0; sent < response.size();) {
+								ssize_t n = send(client, response.data() + sent,
+												response.size() - sent, MSG_NOSIGNAL);
+								if (n <= 0)
+										break;
+								sent += n;
+						}
+						close(client);
+				}
+		}
+#endif
+};
+
+#endif
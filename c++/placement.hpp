@@ -0,0 +1,187 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Placement of the worker threads on the CPUs. Pinned workers stay on one
+//! CPU, so the agents of the simulations they build, which they touch
+//! first, are allocated on their NUMA node and stay local to them.
+
+#ifndef ABM_PLACEMENT_HPP
+#define ABM_PLACEMENT_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+/// Determines which CPU each worker thread runs on
+enum Pinning {
+		PIN_NONE = 0, // Wherever the kernel puts it
+		PIN_COMPACT = 1, // The CPUs of the first NUMA node first, then the next
+		PIN_SCATTER = 2, // One CPU of each node in turn
+		PIN_LIST = 3 // The CPUs of PlacementPolicy::cpus in turn
+};
+
+/// The placement of the worker threads, for the whole program. Pools
+/// started after a change get the new setting.
+struct PlacementPolicy {
+		Pinning pinning = PIN_NONE;
+		std::vector<int> cpus; // Of PIN_LIST
+		// Whether a simulation runs all its chunks on the worker that starts
+		// it rather than being stolen by idle ones, so that its agents stay
+		// on that worker's node
+		bool sticky = false;
+};
+
+inline PlacementPolicy& placement_policy() {
+		static PlacementPolicy policy;
+		return policy;
+}
+
+/// The CPUs of a list such as "0-3,8,10-11". Throws std::invalid_argument
+/// if it is not one.
+inline std::vector<int> parse_cpu_list(const std::string &list) {
+		std::vector<int> cpus;
+		std::istringstream in(list);
+		std::string range;
+		while (std::getline(in, range, ',')) {
+				if (range.empty() || range == "\n")
+						continue;
+				size_t dash = range.find('-');
+				int first = std::stoi(range.substr(0, dash));
+				int last = dash == std::string::npos ? first :
+						std::stoi(range.substr(dash + 1));
+				if (first < 0 || last < first)
+						throw std::invalid_argument("bad cpu range " + range);
+				for (int cpu = first; cpu <= last; cpu++)
+						cpus.push_back(cpu);
+		}
+		return cpus;
+}
+
+/// Whether the process may run on cpu. This asks for the main thread's
+/// CPUs, which placement never narrows, as pinned threads pass theirs on.
+inline bool cpu_allowed(int cpu) {
+#ifdef __linux__
+		cpu_set_t set;
+		if (sched_getaffinity(getpid(), sizeof(set), &set) != 0 || cpu >= CPU_SETSIZE)
+				return false;
+		return CPU_ISSET(cpu, &set);
+#else
+		return cpu >= 0 && (unsigned) cpu < std::thread::hardware_concurrency();
+#endif
+}
+
+/// The CPUs of each NUMA node that the process may run on, nodes without
+/// any left out. Without the node list in sysfs this is a single node of
+/// every allowed CPU.
+inline std::vector<std::vector<int>> numa_nodes() {
+		std::vector<std::vector<int>> nodes;
+		for (int node = 0;; node++) {
+				std::ifstream file("/sys/devices/system/node/node" +
+								std::to_string(node) + "/cpulist");
+				std::string list;
+				if (!file || !std::getline(file, list))
+						break;
+				std::vector<int> cpus;
+				for (int cpu: parse_cpu_list(list))
+						if (cpu_allowed(cpu))
+								cpus.push_back(cpu);
+				if (!cpus.empty())
+						nodes.push_back(cpus);
+		}
+		if (nodes.empty()) {
+				nodes.emplace_back();
+				for (unsigned cpu = 0; cpu < std::max(1u,
+										std::thread::hardware_concurrency()); cpu++)
+						if (cpu_allowed(cpu))
+								nodes.back().push_back(cpu);
+		}
+		return nodes;
+}
+
+/// The CPUs the workers 0, 1, ... take in turn under pinning, on a machine
+/// of nodes; empty for PIN_NONE
+inline std::vector<int> worker_cpus(Pinning pinning,
+				const std::vector<std::vector<int>> &nodes,
+				const std::vector<int> &list = {}) {
+		std::vector<int> cpus;
+		switch (pinning) {
+				case PIN_NONE:
+						break;
+				case PIN_COMPACT:
+						for (const std::vector<int> &node: nodes)
+								cpus.insert(cpus.end(), node.begin(), node.end());
+						break;
+				case PIN_SCATTER:
+						for (size_t k = 0;; k++) {
+								size_t before = cpus.size();
+								for (const std::vector<int> &node: nodes)
+										if (k < node.size())
+												cpus.push_back(node[k]);
+								if (cpus.size() == before)
+										break;
+						}
+						break;
+				case PIN_LIST:
+						cpus = list;
+						break;
+		}
+		return cpus;
+}
+
+/// Pins the calling thread to cpu and returns whether it could
+inline bool pin_thread(int cpu) {
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+		(void) cpu;
+		return false;
+#endif
+}
+
+/// Pins the calling thread as worker slot of a pool under the program's
+/// policy. Slots past the CPUs wrap round.
+inline void place_worker(size_t slot) {
+		const PlacementPolicy &policy = placement_policy();
+		if (policy.pinning == PIN_NONE)
+				return;
+		static const std::vector<std::vector<int>> nodes = numa_nodes();
+		std::vector<int> cpus = worker_cpus(policy.pinning, nodes, policy.cpus);
+		if (!cpus.empty())
+				pin_thread(cpus[slot % cpus.size()]);
+}
+
+/// Threads of a pool asked for 0 threads: one per CPU of the list with
+/// PIN_LIST, otherwise one per hardware thread
+inline size_t default_threads() {
+		const PlacementPolicy &policy = placement_policy();
+		if (policy.pinning == PIN_LIST && !policy.cpus.empty())
+				return policy.cpus.size();
+		return std::max(1u, std::thread::hardware_concurrency());
+}
+
+#endif
@@ -0,0 +1,175 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Timing of the simulation events. Builds with ABM_PROFILE defined time
+//! every call of an event with steady_clock into the simulation's
+//! EventProfile; in other builds EventTimer is empty and compiles to nothing.
+
+#ifndef ABM_PROFILE_HPP
+#define ABM_PROFILE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <ostream>
+
+#include "aggregate.hpp"
+
+#ifdef ABM_PROFILE
+constexpr bool PROFILING = true;
+#else
+constexpr bool PROFILING = false;
+#endif
+
+/// The events that are timed
+enum ProfiledEvent {
+		PROFILE_GROW = 0,
+		PROFILE_INFECT_ONE,
+		PROFILE_INFECT_TWO,
+		PROFILE_RECOVER,
+		PROFILE_VACCINATE,
+		PROFILE_SUSCEPTIBLE,
+		PROFILE_DIE,
+		PROFILE_FUSED, // fused_step(), in place of the four above
+		PROFILE_SCHEDULED, // fire_events(), in place of the four above
+		PROFILE_COMPACT,
+		PROFILE_REPORT,
+		PROFILE_AGENT_OUTPUT, // print_agents() and write_snapshot()
+		PROFILE_CHECKPOINT,
+		PROFILED_EVENTS // Number of events
+};
+
+const char* const PROFILED_EVENT_NAMES[PROFILED_EVENTS] = {"grow",
+		"infect_method_one", "infect_method_two", "recover", "vaccinate",
+		"susceptible", "die", "fused_step", "fire_events", "compact", "report",
+		"agent_output", "checkpoint"};
+
+/// Calls of one event
+struct EventTimes {
+		uint64_t calls = 0;
+		uint64_t nanoseconds = 0;
+		uint64_t agents = 0; // Stored agents at each call, summed
+		QuantileSketch sketch; // Of the nanoseconds of each call
+
+		void add(uint64_t time, size_t stored) {
+				++calls;
+				nanoseconds += time;
+				agents += stored;
+				sketch.add(time);
+		}
+
+		void merge(const EventTimes &other) {
+				calls += other.calls;
+				nanoseconds += other.nanoseconds;
+				agents += other.agents;
+				sketch.merge(other.sketch);
+		}
+};
+
+/// The event times of a simulation or of several
+struct EventProfile {
+		EventTimes events[PROFILED_EVENTS];
+		size_t simulations = 0; // Merged into this
+		uint64_t agent_iterations = 0; // Stored agents of every iteration, summed
+
+		void merge(const EventProfile &other) {
+				for (size_t e = 0; e < PROFILED_EVENTS; e++)
+						events[e].merge(other.events[e]);
+				simulations += other.simulations;
+				agent_iterations += other.agent_iterations;
+		}
+
+		/// Writes a table of the calls, total, mean and 99th percentile time
+		/// and agents per second of every event that ran, then the agents per
+		/// second of whole iterations.
+		void write(std::ostream &out) const {
+				char line[160];
+				std::snprintf(line, sizeof(line), "%-18s %10s %11s %11s %11s %12s\n",
+								"event", "calls", "total s", "mean us", "p99 us", "agents/s");
+				out << line;
+				uint64_t total = 0;
+				for (size_t e = 0; e < PROFILED_EVENTS; e++) {
+						const EventTimes &times = events[e];
+						if (times.calls == 0)
+								continue;
+						total += times.nanoseconds;
+						std::snprintf(line, sizeof(line),
+										"%-18s %10llu %11.3f %11.1f %11.1f %12.4g\n",
+										PROFILED_EVENT_NAMES[e], (unsigned long long) times.calls,
+										times.nanoseconds * 1e-9,
+										times.nanoseconds * 1e-3 / times.calls,
+										times.sketch.quantile(0.99) * 1e-3,
+										times.agents * 1e9 / std::max<uint64_t>(times.nanoseconds, 1));
+						out << line;
+				}
+				std::snprintf(line, sizeof(line),
+								"%zu simulations, %.3f s in events, %.4g agent iterations/s\n",
+								simulations, total * 1e-9,
+								agent_iterations * 1e9 / std::max<uint64_t>(total, 1));
+				out << line;
+		}
+};
+
+/// Times its scope into profile's event when PROFILING
+template <bool enabled = PROFILING>
+class EventTimer {
+public:
+		EventTimer(EventProfile&, ProfiledEvent, size_t) {}
+};
+
+template <>
+class EventTimer<true> {
+public:
+		/// stored = agents the event works on
+		EventTimer(EventProfile &profile, ProfiledEvent event, size_t stored) :
+				times(profile.events[event]), stored(stored),
+				start(std::chrono::steady_clock::now()) {}
+
+		~EventTimer() {
+				auto time = std::chrono::steady_clock::now() - start;
+				times.add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+												time).count(), stored);
+		}
+
+		EventTimer(const EventTimer&) = delete;
+		EventTimer& operator=(const EventTimer&) = delete;
+
+private:
+		EventTimes &times;
+		size_t stored;
+		std::chrono::steady_clock::time_point start;
+};
+
+/// The profile of all the simulations of a run. Simulations time their own
+/// events and merge them in once, when they finish, from whichever thread
+/// ran them last.
+class ProfileCollector {
+public:
+		void merge(const EventProfile &profile) {
+				std::lock_guard<std::mutex> lock(mutex);
+				total.merge(profile);
+		}
+
+		void write(std::ostream &out) {
+				std::lock_guard<std::mutex> lock(mutex);
+				total.write(out);
+		}
+
+private:
+		std::mutex mutex;
+		EventProfile total;
+};
+
+#endif
@@ -0,0 +1,67 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//! Microbenchmark of the cost per report row: the stringstream that
+//! report() used to build for every row and write to the stream, against
+//! format_report() into a reused buffer that is written in batches. Rows go
+//! to /dev/null so the numbers are formatting and write calls only.
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "abm.hpp"
+
+/// Nanoseconds per row of f(row number, out) over rows rows
+template <typename F>
+double time_rows(size_t rows, F f) {
+		std::ofstream out("/dev/null");
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < rows; i++)
+				f(i, out);
+		out.flush();
+		std::chrono::duration<double, std::nano> elapsed =
+				std::chrono::steady_clock::now() - start;
+		return elapsed.count() / rows;
+}
+
+int main(int argc, char **argv) {
+		size_t rows = argc > 1 ? std::stoul(argv[1]) : 10000000;
+		// Typical values of a 10000 agent run
+		uint64_t values[7] = {2856, 131, 3526, 3748, 1790, 8606, 479};
+
+		double before = time_rows(rows, [&values](size_t i, std::ostream &out) {
+						std::stringstream ss;
+						ss << 17 << "," << i << "," << values[0] << "," << values[1] << ","
+								<< values[2] << "," << values[3] << "," << values[4] << ","
+								<< values[5] << "," << values[6] << "\n";
+						out << ss.str();
+						});
+
+		std::string reports;
+		const size_t batch = 1 << 14;
+		reports.reserve(batch + REPORT_ROW_MAX);
+		double after = time_rows(rows, [&](size_t i, std::ostream &out) {
+						char row[REPORT_ROW_MAX];
+						reports.append(row, format_report(row, 17, i, values));
+						if (reports.size() >= batch) {
+								out.write(reports.data(), reports.size());
+								reports.clear();
+						}
+						});
+
+		std::cout << "stringstream per row: " << before << " ns/row\n"
+				<< "to_chars, batched:    " << after << " ns/row\n";
+		return 0;
+}
@@ -0,0 +1,203 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Random number engines for the simulation. Every engine provides uint(),
+//! to(max) for a number in [0, max), real() for a number in [0, 1) and
+//! fill(out, n) to draw n numbers at once.
+
+#ifndef ABM_RNG_HPP
+#define ABM_RNG_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+__extension__ typedef unsigned __int128 uint128_t;
+
+/// The 15 bit linear congruential generator that every language version of
+/// this model implements. Keep it for comparison runs: to() is a biased
+/// modulo that can only return 32768 distinct values, and real() has 15 bits.
+struct LegacyRng {
+		uint64_t seed;
+		static constexpr uint64_t a = 22695477;
+		static constexpr uint64_t c = 1;
+		static constexpr uint64_t m = 32768;
+
+		LegacyRng(uint64_t s) {
+				seed = s;
+		}
+
+		uint64_t uint() {
+				seed = seed * 1103515245 + 12345;
+				return (seed/65536) % m;
+		}
+
+		uint64_t to(uint64_t max) {
+				uint64_t result = uint() % max;
+				return result;
+		}
+
+		double real() {
+				double result = (double) uint() / m;
+				return result;
+		}
+
+		void fill(uint64_t *out, size_t n) {
+				for (size_t i = 0; i < n; i++)
+						out[i] = uint();
+		}
+};
+
+/// A uniform draw in [0, 1) fine enough for the geometric gaps of small
+/// probabilities: real() of the 64 bit engines, and two 15 bit draws of
+/// LegacyRng combined into 30 bits, as with 15 bits alone every gap of a
+/// probability below 1/32768 would be one of 32768 lengths.
+template <typename Engine>
+double gap_real(Engine &rng) {
+		return rng.real();
+}
+
+inline double gap_real(LegacyRng &rng) {
+		double high = rng.real();
+		return high + rng.real() / LegacyRng::m;
+}
+
+/// The default engine is the legacy one so that output matches the other
+/// languages.
+using Rng = LegacyRng;
+
+/// Used to expand a single 64 bit seed into an engine's state.
+inline uint64_t splitmix64(uint64_t &x) {
+		uint64_t z = (x += 0x9e3779b97f4a7c15);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+		return z ^ (z >> 31);
+}
+
+/// Bounded and real draws shared by the engines with full 64 bit output.
+/// Engine must provide uint().
+template <typename Engine>
+struct Engine64 {
+		/// Lemire's nearly divisionless method: an unbiased number in [0, max)
+		/// that costs one multiplication in all but a tiny fraction of calls.
+		uint64_t to(uint64_t max) {
+				uint128_t m = (uint128_t) engine().uint() * max;
+				uint64_t low = (uint64_t) m;
+				if (low < max) {
+						uint64_t threshold = -max % max;
+						while (low < threshold) {
+								m = (uint128_t) engine().uint() * max;
+								low = (uint64_t) m;
+						}
+				}
+				return m >> 64;
+		}
+
+		/// A number in [0, 1) from the top 53 bits
+		double real() {
+				return (engine().uint() >> 11) * (1.0 / 9007199254740992.0);
+		}
+
+		void fill(uint64_t *out, size_t n) {
+				for (size_t i = 0; i < n; i++)
+						out[i] = engine().uint();
+		}
+
+private:
+		Engine& engine() {
+				return static_cast<Engine&>(*this);
+		}
+};
+
+/// xoshiro256++ by Blackman and Vigna.
+struct Xoshiro256pp : Engine64<Xoshiro256pp> {
+		uint64_t s[4];
+
+		Xoshiro256pp(uint64_t seed) {
+				for (auto &word: s)
+						word = splitmix64(seed);
+		}
+
+		uint64_t uint() {
+				uint64_t result = rotl(s[0] + s[3], 23) + s[0];
+				uint64_t t = s[1] << 17;
+				s[2] ^= s[0];
+				s[3] ^= s[1];
+				s[1] ^= s[2];
+				s[0] ^= s[3];
+				s[2] ^= t;
+				s[3] = rotl(s[3], 45);
+				return result;
+		}
+
+private:
+		static uint64_t rotl(uint64_t x, int k) {
+				return (x << k) | (x >> (64 - k));
+		}
+};
+
+/// PCG64 (XSL RR 128/64) by O'Neill.
+struct Pcg64 : Engine64<Pcg64> {
+		uint128_t state;
+		uint128_t increment;
+
+		Pcg64(uint64_t seed) {
+				uint64_t x = seed;
+				uint128_t sequence = ((uint128_t) splitmix64(x) << 64) | splitmix64(x);
+				uint128_t initial = ((uint128_t) splitmix64(x) << 64) | splitmix64(x);
+				state = 0;
+				increment = (sequence << 1) | 1;
+				step();
+				state += initial;
+				step();
+		}
+
+		uint64_t uint() {
+				step();
+				uint64_t x = (uint64_t) (state >> 64) ^ (uint64_t) state;
+				unsigned rotation = state >> 122;
+				return (x >> rotation) | (x << ((-rotation) & 63));
+		}
+
+private:
+		void step() {
+				const uint128_t multiplier =
+						((uint128_t) 0x2360ed051fc65da4 << 64) | 0x4385df649fccf645;
+				state = state * multiplier + increment;
+		}
+};
+
+/// Philox2x32-10 by Salmon et al. A counter-based generator: every output is
+/// a pure function of the key and a 64 bit counter, so numbers can be drawn in
+/// any order or in parallel lanes and still be reproducible.
+struct Philox2x32 {
+		uint32_t key;
+
+		Philox2x32(uint64_t seed) : key((uint32_t) seed ^ (uint32_t) (seed >> 32)) {}
+
+		uint64_t operator()(uint64_t counter) const {
+				uint32_t x0 = (uint32_t) counter;
+				uint32_t x1 = (uint32_t) (counter >> 32);
+				uint32_t k = key;
+#pragma GCC unroll 10
+				for (int round = 0; round < 10; round++) {
+						uint64_t product = (uint64_t) 0xd256d193 * x0;
+						x0 = (uint32_t) (product >> 32) ^ k ^ x1;
+						x1 = (uint32_t) product;
+						k += 0x9e3779b9;
+				}
+				return ((uint64_t) x1 << 32) | x0;
+		}
+};
+
+#endif
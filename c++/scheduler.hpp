@@ -0,0 +1,351 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Runs many simulations in parallel. Simulations are split into chunks of
+//! iterations that a work-stealing pool schedules, and their report rows are
+//! collected and written in (identity, iteration) order, so the output does
+//! not depend on the number of threads or on timing.
+
+#ifndef ABM_SCHEDULER_HPP
+#define ABM_SCHEDULER_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "abm.hpp"
+#include "placement.hpp"
+
+/// A fixed set of worker threads, each with its own deque of tasks. A worker
+/// takes the newest task from the back of its own deque and, when that is
+/// empty, steals the oldest task that is not pinned from the front of
+/// another worker's deque. Tasks may post further tasks to their own worker.
+/// Workers are placed on the CPUs as placement_policy() says.
+class WorkStealingPool {
+public:
+		/// Tasks are called with the index of the worker running them
+		using Task = std::function<void(size_t)>;
+
+		/// threads = 0 uses default_threads()
+		explicit WorkStealingPool(size_t threads) {
+				if (threads == 0)
+						threads = default_threads();
+				queues = std::vector<Queue>(threads);
+				pinned = std::vector<size_t>(threads, 0);
+		}
+
+		size_t threads() const {
+				return queues.size();
+		}
+
+		/// Adds a task to the back of worker's deque. A pinned task is only
+		/// ever run by that worker.
+		void post(Task task, size_t worker, bool pin = false) {
+				{
+						std::lock_guard<std::mutex> lock(queues[worker].mutex);
+						queues[worker].tasks.push_back({std::move(task), pin});
+				}
+				{
+						std::lock_guard<std::mutex> lock(mutex);
+						if (pin)
+								++pinned[worker];
+						else
+								++queued;
+						++pending;
+				}
+				// Only that worker can take a pinned task, so wake them all.
+				if (pin)
+						wake.notify_all();
+				else
+						wake.notify_one();
+		}
+
+		/// Runs the tasks until every one, including those posted by tasks,
+		/// has finished.
+		void run() {
+				std::vector<std::thread> workers;
+				for (size_t i = 0; i < queues.size(); i++)
+						workers.emplace_back([this, i]() {
+										place_worker(i);
+										work(i);
+										});
+				for (auto &worker: workers)
+						worker.join();
+		}
+
+private:
+		struct Entry {
+				Task task;
+				bool pinned;
+		};
+
+		struct Queue {
+				std::mutex mutex;
+				std::deque<Entry> tasks;
+		};
+
+		std::vector<Queue> queues;
+		std::mutex mutex; // Guards the counts below
+		std::condition_variable wake;
+		size_t queued = 0; // Tasks in the deques that can be stolen
+		std::vector<size_t> pinned; // Pinned tasks in each deque
+		size_t pending = 0; // Tasks posted and not finished
+
+		bool take(size_t worker, Entry &entry) {
+				for (size_t i = 0; i < queues.size(); i++) {
+						Queue &queue = queues[(worker + i) % queues.size()];
+						std::lock_guard<std::mutex> lock(queue.mutex);
+						if (i == 0) {
+								if (queue.tasks.empty())
+										continue;
+								entry = std::move(queue.tasks.back());
+								queue.tasks.pop_back();
+								return true;
+						}
+						auto stealable = std::find_if(queue.tasks.begin(), queue.tasks.end(),
+										[](const Entry &e) { return !e.pinned; });
+						if (stealable == queue.tasks.end())
+								continue;
+						entry = std::move(*stealable);
+						queue.tasks.erase(stealable);
+						return true;
+				}
+				return false;
+		}
+
+		void work(size_t worker) {
+				for (;;) {
+						{
+								std::unique_lock<std::mutex> lock(mutex);
+								wake.wait(lock, [this, worker]() {
+												return queued > 0 || pinned[worker] > 0 || pending == 0;
+												});
+								if (pending == 0)
+										return;
+						}
+						Entry entry;
+						if (!take(worker, entry))
+								continue;
+						{
+								std::lock_guard<std::mutex> lock(mutex);
+								if (entry.pinned)
+										--pinned[worker];
+								else
+										--queued;
+						}
+						entry.task(worker);
+						std::lock_guard<std::mutex> lock(mutex);
+						if (--pending == 0)
+								wake.notify_all();
+				}
+		}
+};
+
+/// Gathers the report rows of simulations 0 to count - 1 and writes them in
+/// identity order. Rows of the lowest unfinished simulation are written as
+/// they arrive, later ones are held back until it finishes.
+class ReportCollector {
+public:
+		ReportCollector(std::ostream &out, size_t count) :
+				out(out), buffered(count), finished(count, false) {}
+
+		/// Adds rows of simulation identity, done = it has no more rows
+		void add(size_t identity, const std::string &rows, bool done) {
+				std::lock_guard<std::mutex> lock(mutex);
+				buffered[identity] += rows;
+				finished[identity] = done;
+				while (next < buffered.size()) {
+						out << buffered[next];
+						buffered[next].clear();
+						if (!finished[next])
+								break;
+						++next;
+				}
+				out.flush();
+		}
+
+private:
+		std::ostream &out;
+		std::mutex mutex;
+		std::vector<std::string> buffered;
+		std::vector<bool> finished;
+		size_t next = 0; // Lowest unfinished simulation
+};
+
+/// Iterations a simulation runs before it goes back to the pool
+const size_t CHUNK_ITERATIONS = 100;
+
+/// Runs simulations 0 to sets[s].simulations - 1 of every parameter set s on
+/// one pool of sets[0].threads threads and writes their reports to out in
+/// (set, identity, iteration) order, or hands them to the set's targets (a
+/// writer orders them itself, and only takes a single set). tagged puts the
+/// set in a column before the rows, under one header for all of them. A
+/// finished simulation goes to its worker's idle list and is reset() for
+/// the next one that worker starts, so a batch only builds about as many
+/// simulations as it has threads. Simulations of the same identity in sets
+/// whose parameters are same_start() are started from one population: the
+/// first one's task copies it for the others and posts their starts.
+template <typename SimulationType>
+void run_sets(const std::vector<Parameters> &parameter_sets, std::ostream &out,
+				const std::vector<OutputTargets> &targets, bool tagged) {
+		using Start = typename SimulationType::Start;
+		struct Run {
+				SimulationType simulation;
+				std::ostringstream rows;
+				size_t row = 0; // Of the simulation in the collector
+
+				Run(size_t identity, const Parameters &parameters, const Start *start) :
+						simulation(start ? SimulationType(identity, parameters, *start) :
+										SimulationType(identity, parameters)) {
+								simulation.output = &rows;
+						}
+
+				void attach(OutputTargets targets) {
+						simulation.writer = targets.writer;
+						simulation.aggregator = targets.aggregator;
+						simulation.profiler = targets.profiler;
+				}
+		};
+		// Several simulations already use all the threads, so each gets one.
+		std::vector<Parameters> sets = parameter_sets;
+		std::vector<size_t> first(sets.size()); // Of each set in the collector
+		size_t count = 0, most = 0;
+		for (size_t s = 0; s < sets.size(); s++) {
+				first[s] = count;
+				count += sets[s].simulations;
+				most = std::max(most, sets[s].simulations);
+				metrics().plan(sets[s].simulations,
+								sets[s].simulations * sets[s].iterations);
+		}
+		if (count > 1)
+				for (Parameters &parameters: sets)
+						parameters.threads = 1;
+		// Groups of the sets that start from the same populations
+		std::vector<std::vector<size_t>> groups;
+		for (size_t s = 0; s < sets.size(); s++) {
+				size_t g = 0;
+				while (g < groups.size() &&
+								!SimulationType::same_start(sets[groups[g][0]], sets[s]))
+						++g;
+				if (g == groups.size())
+						groups.emplace_back();
+				groups[g].push_back(s);
+		}
+		WorkStealingPool pool(parameter_sets.empty() ? 1 : parameter_sets[0].threads);
+		ReportCollector collector(out, count);
+		if (tagged && count > 0 && !targets[0].aggregator)
+				out << "set," << REPORT_HEADER;
+		// Only worker i touches idle[i], so it needs no lock.
+		std::vector<std::vector<std::shared_ptr<Run>>> idle(pool.threads());
+		// Each task runs one chunk and posts the next one to its own worker,
+		// pinned there with a sticky placement so that the simulation stays
+		// with the agents it first touched.
+		const bool sticky = placement_policy().sticky;
+		std::function<void(std::shared_ptr<Run>, size_t)> advance =
+				[&](std::shared_ptr<Run> run, size_t worker) {
+						SimulationType &simulation = run->simulation;
+						simulation.worker = worker;
+						simulation.advance(CHUNK_ITERATIONS);
+						bool done = simulation.done();
+						if (done)
+								simulation.finish();
+						else
+								simulation.flush_reports();
+						if (!simulation.writer) {
+								collector.add(run->row, run->rows.str(), done);
+								run->rows.str("");
+						}
+						if (done)
+								idle[worker].push_back(std::move(run));
+						else
+								pool.post([run, &advance](size_t worker) { advance(run, worker); },
+												worker, sticky);
+				};
+		// Simulation i of set s on worker, from start if not null
+		auto launch = [&](size_t s, size_t i, size_t worker, const Start *start) {
+				std::shared_ptr<Run> run;
+				if (idle[worker].empty()) {
+						run = std::make_shared<Run>(i, sets[s], start);
+				} else {
+						run = std::move(idle[worker].back());
+						idle[worker].pop_back();
+						if (start)
+								run->simulation.reset(i, sets[s], *start);
+						else
+								run->simulation.reset(i, sets[s]);
+				}
+				run->attach(targets[s]);
+				run->simulation.worker = worker;
+				run->row = first[s] + i;
+				run->simulation.tag = tagged ? std::to_string(s) + "," : "";
+				return run;
+		};
+		// Deques are popped from the back, so post the highest identities
+		// first to start the lowest first.
+		for (size_t i = most; i-- > 0;) {
+				for (size_t g = groups.size(); g-- > 0;) {
+						std::vector<size_t> members;
+						for (size_t s: groups[g])
+								if (i < sets[s].simulations)
+										members.push_back(s);
+						if (members.empty())
+								continue;
+						pool.post([i, members, &launch, &advance, &pool](size_t worker) {
+										std::shared_ptr<Run> run = launch(members[0], i, worker, nullptr);
+										if (members.size() > 1) {
+												auto start = std::make_shared<Start>();
+												run->simulation.save_start(*start);
+												for (size_t m = members.size(); m-- > 1;) {
+														size_t s = members[m];
+														pool.post([i, s, start, &launch, &advance](size_t worker) {
+																		std::shared_ptr<Run> run =
+																				launch(s, i, worker, start.get());
+																		run->simulation.start();
+																		advance(run, worker);
+																		}, worker);
+												}
+										}
+										run->simulation.start();
+										advance(run, worker);
+										}, (first[members[0]] + i) % pool.threads());
+				}
+		}
+		pool.run();
+}
+
+/// Runs simulations 0 to parameters.simulations - 1 as run_sets() does
+template <typename SimulationType>
+void run_simulations(const Parameters &parameters, std::ostream &out,
+				OutputTargets targets = OutputTargets()) {
+		run_sets<SimulationType>({parameters}, out, {targets}, false);
+}
+
+/// Runs the simulations of every parameter set of a sweep as run_sets()
+/// does, the report rows tagged with the set's index. targets holds one per
+/// set, without writers.
+template <typename SimulationType>
+void run_sweep(const std::vector<Parameters> &sets, std::ostream &out,
+				const std::vector<OutputTargets> &targets) {
+		run_sets<SimulationType>(sets, out, targets, true);
+}
+
+#endif
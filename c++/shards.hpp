@@ -0,0 +1,356 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+//! Agent storage for a single simulation that runs on several threads.
+
+#ifndef ABM_SHARDS_HPP
+#define ABM_SHARDS_HPP
+
+#include <memory>
+
+#include "abm.hpp"
+
+/// Agent storage split into AgentColumns shards. Positions are dealt out to
+/// the shards in chunks of CHUNK, round robin, so new agents spread evenly.
+/// The kernel events run on all shards in parallel, each shard drawing from
+/// its own Philox key, so the results depend on the number of shards but not
+/// on the number of threads. Events that draw from the simulation's engine
+/// (transition() and sample()) visit the shards one after the other.
+struct AgentShards {
+		/// Positions per chunk, a multiple of KERNEL_BLOCK
+		static const size_t CHUNK = 4096;
+
+		std::vector<AgentColumns> shards;
+		std::shared_ptr<ForkJoin> pool;
+
+		/// Buffers of step() and encounter(), kept so that they do not allocate
+		struct Scratch {
+				std::vector<Statistics> moved;
+				std::vector<uint32_t> first, second, home;
+				std::vector<size_t> infections;
+		} scratch;
+
+		/// Sets up shards shards that run on pool; shards = 0 makes one shard
+		/// per thread. Shards that are already there are kept, agents and all.
+		void configure(size_t shards, std::shared_ptr<ForkJoin> pool) {
+				this->pool = pool;
+				if (shards == 0)
+						shards = pool->threads();
+				if (this->shards.size() != shards)
+						this->shards = std::vector<AgentColumns>(shards);
+		}
+
+		size_t size() const {
+				return count;
+		}
+
+		int identity(size_t i) const {
+				return shard(i).identity(local(i));
+		}
+
+		State state(size_t i) const {
+				return shard(i).state(local(i));
+		}
+
+		void set_state(size_t i, State state) {
+				shard(i).set_state(local(i), state);
+		}
+
+		/// Agents are appended in position order, so position count is always
+		/// at the end of its shard.
+		void push_back(int identity, State state) {
+				if (shards.empty())
+						configure(1, std::make_shared<ForkJoin>(1));
+				shard(count).push_back(identity, state);
+				++count;
+		}
+
+		void append(int identity, State state, size_t count) {
+				for (size_t i = 0; i < count; i++)
+						push_back(identity + i, state);
+		}
+
+		void clear() {
+				for (AgentColumns &s: shards)
+						s.clear();
+				count = 0;
+		}
+
+		/// Makes room for n agents, spread over the shards
+		void reserve(size_t n) {
+				if (shards.empty())
+						configure(1, std::make_shared<ForkJoin>(1));
+				for (AgentColumns &s: shards)
+						s.reserve(n / shards.size() + CHUNK);
+		}
+
+		void prefetch(size_t i) const {
+				shard(i).prefetch(local(i));
+		}
+
+		void advise(Access access) const {
+				for (const AgentColumns &s: shards)
+						s.advise(access);
+		}
+
+		void swap(size_t i, size_t j) {
+				AgentColumns &a = shard(i), &b = shard(j);
+				if (&a == &b) {
+						a.swap(local(i), local(j));
+						return;
+				}
+				State state = a.state(local(i));
+				a.set_state(local(i), b.state(local(j)));
+				b.set_state(local(j), state);
+				std::swap(a.identities[local(i)], b.identities[local(j)]);
+		}
+
+		size_t living() const {
+				size_t living = 0;
+				for (const AgentColumns &s: shards)
+						living += s.living();
+				return living;
+		}
+
+		Statistics statistics() const {
+				Statistics stats;
+				for (const AgentColumns &s: shards)
+						add(stats, s.statistics());
+				return stats;
+		}
+
+		Statistics recount() const {
+				Statistics stats;
+				for (const AgentColumns &s: shards)
+						add(stats, s.recount());
+				return stats;
+		}
+
+		/// As AgentColumns::transition(), shard by shard. f gets the global
+		/// position.
+		template <typename F>
+		void transition(std::initializer_list<State> from, F f) {
+				for (size_t k = 0; k < shards.size(); k++)
+						shards[k].transition(from, [this, k, &f](size_t i, State state) {
+										return f(global(k, i), state);
+										});
+		}
+
+		template <typename Engine>
+		size_t sample(State from, State to, double prob, Engine &rng) {
+				size_t moved = 0;
+				for (AgentColumns &s: shards)
+						moved += s.sample(from, to, prob, rng);
+				return moved;
+		}
+
+		Statistics step(const TransitionTable &table, const Philox2x32 &philox,
+						uint64_t stream) {
+				std::vector<Statistics> &moved = scratch.moved;
+				moved.assign(shards.size(), Statistics());
+				pool->run(shards.size(), [&](size_t k) {
+								moved[k] = shards[k].step(table, key(philox, k), stream);
+								});
+				Statistics total;
+				for (const Statistics &m: moved)
+						add(total, m);
+				return total;
+		}
+
+		void step(const TransitionTable *stages, size_t count,
+						const Philox2x32 &philox, uint64_t stream, Statistics *moved) {
+				std::vector<Statistics> &shard_moved = scratch.moved;
+				shard_moved.assign(shards.size() * count, Statistics());
+				pool->run(shards.size(), [&](size_t k) {
+								shards[k].step(stages, count, key(philox, k), stream,
+												&shard_moved[k * count]);
+								});
+				for (size_t k = 0; k < shards.size(); k++)
+						for (size_t s = 0; s < count; s++)
+								add(moved[s], shard_moved[k * count + s]);
+		}
+
+		/// Places the agent with identity i at position i, as
+		/// AgentColumns::sort_by_identity() does.
+		void sort_by_identity() {
+				std::vector<uint8_t> sorted(count);
+				for (size_t i = 0; i < count; i++)
+						sorted[identity(i)] = state(i);
+				for (size_t i = 0; i < count; i++) {
+						shard(i).identities[local(i)] = i;
+						set_state(i, (State) sorted[i]);
+				}
+		}
+
+		/// Shard k's substream: shard 0 draws what an AgentColumns would, the
+		/// others with a key hashed from the simulation's key and k. Adding
+		/// multiples of 0x9e3779b9 instead would give Philox's own round keys,
+		/// shard k running shard 0's rounds shifted.
+		static Philox2x32 key(const Philox2x32 &philox, size_t k) {
+				Philox2x32 result = philox;
+				if (k > 0) {
+						uint64_t seed = ((uint64_t) philox.key << 32) | k;
+						result.key = (uint32_t) splitmix64(seed);
+				}
+				return result;
+		}
+
+		size_t shard_of(size_t i) const {
+				return (i / CHUNK) % shards.size();
+		}
+
+		size_t local(size_t i) const {
+				return (i / CHUNK / shards.size()) * CHUNK + i % CHUNK;
+		}
+
+		/// Global position of shard k's agent at local position i
+		size_t global(size_t k, size_t i) const {
+				return ((i / CHUNK) * shards.size() + k) * CHUNK + i % CHUNK;
+		}
+
+		/// Slot of agent i in its shard's index set
+		uint32_t slot(size_t i) const {
+				return shard(i).slots[local(i)];
+		}
+
+		/// AgentColumns::set_slots() with order by global position
+		void set_slots(const uint32_t *order) {
+				for (size_t i = 0; i < count; i++) {
+						AgentColumns &columns = shard(i);
+						size_t j = local(i);
+						columns.slots[j] = order[i];
+						columns.members[columns.states[j]][order[i]] = j;
+				}
+		}
+
+private:
+		size_t count = 0; // Agents in all the shards
+
+		AgentColumns& shard(size_t i) {
+				return shards[shard_of(i)];
+		}
+
+		const AgentColumns& shard(size_t i) const {
+				return shards[shard_of(i)];
+		}
+
+		static void add(Statistics &total, Statistics stats) {
+				for (size_t s = 0; s < STATE_COUNT; s++)
+						total[(State) s] += stats[(State) s];
+		}
+};
+
+inline void configure(AgentShards &agents, const Parameters &parameters,
+				std::shared_ptr<ForkJoin> pool) {
+		agents.configure(parameters.shards,
+						pool ? pool : std::make_shared<ForkJoin>(1));
+}
+
+inline uint32_t index_slot(const AgentShards &agents, size_t i) {
+		return agents.slot(i);
+}
+
+inline void set_index_slots(AgentShards &agents, const uint32_t *slots) {
+		agents.set_slots(slots);
+}
+
+/// Each shard's slots of each state are each of the set's slots once.
+inline bool index_slots_valid(const AgentShards &agents, const uint8_t *states,
+				const uint32_t *slots, size_t count) {
+		return index_sets_valid(slots, count, agents.shards.size() * STATE_COUNT,
+						[&agents, states](size_t i) {
+						return agents.shard_of(i) * STATE_COUNT + states[i];
+						});
+}
+
+/// infect_all() with each shard setting its own agents
+inline void infect_all(AgentShards &agents, const uint32_t *positions,
+				size_t count, ForkJoin &pool) {
+		pool.run(agents.shards.size(), [&](size_t k) {
+						AgentColumns &shard = agents.shards[k];
+						for (size_t j = 0; j < count; j++)
+								if (agents.shard_of(positions[j]) == k)
+										shard.set_state(agents.local(positions[j]), State::INFECTIOUS);
+						});
+}
+
+/// encounter() over the shards. The encounters are drawn in parallel. Then
+/// each shard runs, in order, the encounters between two of its own agents,
+/// and finally the encounters across shards run in order on one thread. Every
+/// encounter still sees the results of the earlier ones in its own phase, so
+/// this only changes the order of the encounters within an iteration, and
+/// the result does not depend on the number of threads.
+inline size_t encounter(AgentShards &agents, size_t count,
+				const Philox2x32 &philox, uint64_t stream) {
+		const size_t shards = agents.shards.size();
+		std::vector<uint32_t> &first = agents.scratch.first,
+				&second = agents.scratch.second, &home = agents.scratch.home;
+		first.resize(count);
+		second.resize(count);
+		home.resize(count);
+		const size_t slice = (count + shards - 1) / shards;
+		agents.pool->run(shards, [&](size_t k) {
+						for (size_t i = k * slice; i < std::min(count, (k + 1) * slice); i++) {
+								first[i] = encounter_position(philox, stream, i, 0, agents.size());
+								second[i] = encounter_position(philox, stream, i, 1, agents.size());
+								size_t a = agents.shard_of(first[i]), b = agents.shard_of(second[i]);
+								home[i] = a == b ? a : shards;
+						}
+						});
+		// Infects a if it is susceptible and b infectious, or the other way
+		// round.
+		auto meet = [](State &a, State &b) {
+				if (a == State::SUSCEPTIBLE && b == State::INFECTIOUS) {
+						a = State::INFECTIOUS;
+						return true;
+				}
+				if (a == State::INFECTIOUS && b == State::SUSCEPTIBLE) {
+						b = State::INFECTIOUS;
+						return true;
+				}
+				return false;
+		};
+		std::vector<size_t> &infections = agents.scratch.infections;
+		infections.assign(shards + 1, 0);
+		agents.pool->run(shards, [&](size_t k) {
+						AgentColumns &shard = agents.shards[k];
+						for (size_t i = 0; i < count; i++) {
+								if (home[i] != k)
+										continue;
+								size_t a = agents.local(first[i]), b = agents.local(second[i]);
+								State sa = shard.state(a), sb = shard.state(b);
+								if (meet(sa, sb)) {
+										shard.set_state(a, sa);
+										shard.set_state(b, sb);
+										++infections[k];
+								}
+						}
+						});
+		for (size_t i = 0; i < count; i++) {
+				if (home[i] != shards)
+						continue;
+				State sa = agents.state(first[i]), sb = agents.state(second[i]);
+				if (meet(sa, sb)) {
+						agents.set_state(first[i], sa);
+						agents.set_state(second[i], sb);
+						++infections[shards];
+				}
+		}
+		size_t total = 0;
+		for (size_t n: infections)
+				total += n;
+		return total;
+}
+
+#endif
@@ -0,0 +1,218 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//! Reading and writing the binary agent snapshots.
+
+#include "snapshot.hpp"
+
+#include "aggregate.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <system_error>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/// base without its extension
+static std::string stem(const std::string &base)
+{
+		size_t dot = base.find_last_of('.');
+		size_t slash = base.find_last_of('/');
+		if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+				return base.substr(0, dot);
+		return base;
+}
+
+std::string snapshot_filename(const std::string &base, size_t identity,
+				size_t iteration)
+{
+		return stem(base) + "_" + std::to_string(identity) + "_" +
+				std::to_string(iteration) + ".bin";
+}
+
+/// Writes size bytes to fd (short writes are continued) and closes it
+static void write_all(int fd, const uint8_t *data, size_t size,
+				const std::string &path)
+{
+		size_t written = 0;
+		while (written < size) {
+				ssize_t n = ::write(fd, data + written, size - written);
+				if (n < 0 && errno == EINTR)
+						continue;
+				if (n < 0) {
+						int error = errno;
+						::close(fd);
+						throw std::system_error(error, std::generic_category(), path);
+				}
+				written += n;
+		}
+}
+
+/// write_all() of the count buffers of parts one after the other, with
+/// writev(). parts is advanced past what has been written.
+static void write_all(int fd, iovec *parts, int count, const std::string &path)
+{
+		while (count > 0) {
+				ssize_t n = ::writev(fd, parts, count);
+				if (n < 0 && errno == EINTR)
+						continue;
+				if (n < 0) {
+						int error = errno;
+						::close(fd);
+						throw std::system_error(error, std::generic_category(), path);
+				}
+				// A short write may end inside a part.
+				size_t left = n;
+				while (count > 0 && left >= parts->iov_len) {
+						left -= parts->iov_len;
+						++parts;
+						--count;
+				}
+				if (count > 0) {
+						parts->iov_base = (char*) parts->iov_base + left;
+						parts->iov_len -= left;
+				}
+		}
+}
+
+void write_snapshot(const std::string &path, const SnapshotHeader &header,
+				const std::vector<uint8_t> &states)
+{
+		int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+				throw std::system_error(errno, std::generic_category(), path);
+		// The state column is written from where it is, not copied behind
+		// the header, which would double the memory of a large population.
+		iovec parts[2] = {{(void*) &header, sizeof(header)},
+				{(void*) states.data(), states.size()}};
+		write_all(fd, parts, 2, path);
+		if (::close(fd) != 0)
+				throw std::system_error(errno, std::generic_category(), path);
+}
+
+void read_snapshot(const std::string &path, SnapshotHeader &header,
+				std::vector<uint8_t> &states)
+{
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+				throw std::system_error(errno, std::generic_category(), path);
+		// Reads exactly n bytes at offset, false at the end of the file.
+		auto read_at = [fd](void *out, size_t n, off_t offset) {
+				size_t done = 0;
+				while (done < n) {
+						ssize_t r = ::pread(fd, (char*) out + done, n - done, offset + done);
+						if (r < 0 && errno == EINTR)
+								continue;
+						if (r <= 0)
+								return false;
+						done += r;
+				}
+				return true;
+		};
+		SnapshotHeader expected;
+		bool ok = read_at(&header, sizeof(header), 0) &&
+				std::memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0 &&
+				header.version == expected.version &&
+				header.header_size >= sizeof(header);
+		if (ok) {
+				states.resize(header.agents);
+				ok = read_at(states.data(), states.size(), header.header_size);
+		}
+		::close(fd);
+		if (!ok)
+				throw std::runtime_error(path + ": not a complete agent snapshot");
+}
+
+size_t checkpoint_size(const CheckpointHeader &header)
+{
+		return header.header_size + header.reported * (1 + ReportAggregate::VALUES) * sizeof(uint64_t) +
+				header.state.agents * (sizeof(int32_t) + sizeof(uint32_t) + 1) +
+				header.cold * sizeof(int32_t) + header.arrangement * sizeof(uint32_t);
+}
+
+std::string checkpoint_filename(const std::string &base, size_t identity)
+{
+		return stem(base) + "_" + std::to_string(identity) + ".ckpt";
+}
+
+void write_checkpoint(const std::string &path, const std::vector<uint8_t> &data)
+{
+		std::string temporary = path + ".tmp";
+		int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+				throw std::system_error(errno, std::generic_category(), temporary);
+		write_all(fd, data.data(), data.size(), temporary);
+		// The rename must not reach the disk before the data does.
+		if (::fsync(fd) != 0) {
+				int error = errno;
+				::close(fd);
+				throw std::system_error(error, std::generic_category(), temporary);
+		}
+		if (::close(fd) != 0)
+				throw std::system_error(errno, std::generic_category(), temporary);
+		if (::rename(temporary.c_str(), path.c_str()) != 0)
+				throw std::system_error(errno, std::generic_category(), path);
+		// The rename itself is only durable once the directory is synced.
+		size_t slash = path.rfind('/');
+		std::string directory = slash == std::string::npos ? "." :
+				slash == 0 ? "/" : path.substr(0, slash);
+		int dir = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+		if (dir < 0)
+				throw std::system_error(errno, std::generic_category(), directory);
+		if (::fsync(dir) != 0) {
+				int error = errno;
+				::close(dir);
+				throw std::system_error(error, std::generic_category(), directory);
+		}
+		::close(dir);
+}
+
+std::vector<uint8_t> read_checkpoint(const std::string &path)
+{
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+				throw std::system_error(errno, std::generic_category(), path);
+		struct stat status;
+		if (::fstat(fd, &status) != 0) {
+				int error = errno;
+				::close(fd);
+				throw std::system_error(error, std::generic_category(), path);
+		}
+		std::vector<uint8_t> data(status.st_size);
+		size_t done = 0;
+		while (done < data.size()) {
+				ssize_t r = ::read(fd, data.data() + done, data.size() - done);
+				if (r < 0 && errno == EINTR)
+						continue;
+				if (r <= 0)
+						break;
+				done += r;
+		}
+		::close(fd);
+		CheckpointHeader header, expected;
+		bool ok = done == data.size() && data.size() >= sizeof(header);
+		if (ok) {
+				std::memcpy(&header, data.data(), sizeof(header));
+				ok = std::memcmp(header.magic, expected.magic, sizeof(header.magic)) == 0 &&
+						header.version == expected.version &&
+						header.header_size >= sizeof(header) &&
+						checkpoint_size(header) == data.size();
+		}
+		if (!ok)
+				throw std::runtime_error(path + ": not a complete checkpoint");
+		return data;
+}
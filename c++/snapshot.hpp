@@ -0,0 +1,99 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//! Binary agent snapshots: a fixed header followed by the packed state
+//! column, one byte per agent in identity order. All fields are stored in the
+//! byte order of the machine that wrote them (little endian on every target
+//! this builds for). Checkpoints extend the snapshot header with what a
+//! simulation needs to carry on exactly where it stopped.
+
+#ifndef ABM_SNAPSHOT_HPP
+#define ABM_SNAPSHOT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// Header of a snapshot file. A reader must check magic and version and can
+/// find the state column at header_size.
+struct SnapshotHeader {
+		char magic[8] = {'A', 'B', 'M', 'S', 'N', 'A', 'P', '\0'};
+		uint32_t version = 1;
+		uint32_t header_size = sizeof(SnapshotHeader);
+		uint64_t identity = 0; // Simulation
+		uint64_t iteration = 0;
+		uint64_t agents = 0; // Length of the state column
+		uint64_t total_infections = 0;
+		uint64_t infection_deaths = 0;
+		uint64_t kernel_stream = 0; // Next Philox counter block
+		uint32_t generator = 0; // Generator of the engine in rng
+		uint32_t philox_key = 0;
+		uint8_t rng[32] = {}; // Raw state of the simulation's engine
+};
+
+static_assert(sizeof(SnapshotHeader) == 104, "snapshot header has padding");
+
+/// File of simulation identity's snapshot at iteration: the extension of
+/// base is replaced, so agents.csv gives agents_<identity>_<iteration>.bin.
+std::string snapshot_filename(const std::string &base, size_t identity,
+				size_t iteration);
+
+/// Writes header and the state column to path with a single writev() (short
+/// writes are continued), without copying them together. Throws std::system_error if the file cannot be
+/// written.
+void write_snapshot(const std::string &path, const SnapshotHeader &header,
+				const std::vector<uint8_t> &states);
+
+/// Reads a snapshot written by write_snapshot(). Throws std::system_error if
+/// the file cannot be read and std::runtime_error if it is not a snapshot.
+void read_snapshot(const std::string &path, SnapshotHeader &header,
+				std::vector<uint8_t> &states);
+
+/// Header of a checkpoint file. The sections follow it in this order:
+/// reported rows of (iteration, S, I, R, V, D, TI, TID) as uint64, then
+/// identities (int32), index set slots (uint32), the compacted identities
+/// (int32) and the arrangement (uint32), and last the states (uint8). The
+/// stored agents are in position order, not identity order.
+struct CheckpointHeader {
+		char magic[8] = {'A', 'B', 'M', 'C', 'K', 'P', 'T', '\0'};
+		uint32_t version = 1;
+		uint32_t header_size = sizeof(CheckpointHeader);
+		SnapshotHeader state; // iteration = iterations done, agents = stored agents
+		uint32_t storage = 0; // StorageLayout of the agents
+		uint32_t shuffle = 0; // Shuffle of the run
+		uint64_t cold = 0; // Compacted identities
+		uint64_t arrangement = 0; // Entries of the arrangement
+		uint64_t reported = 0; // Rows of the aggregate not yet merged
+};
+
+static_assert(sizeof(CheckpointHeader) == 152, "checkpoint header has padding");
+
+/// Bytes of a checkpoint with header's section lengths
+size_t checkpoint_size(const CheckpointHeader &header);
+
+/// File of simulation identity's checkpoint: the extension of base is
+/// replaced, so checkpoint.bin gives checkpoint_<identity>.ckpt.
+std::string checkpoint_filename(const std::string &base, size_t identity);
+
+/// Writes a whole checkpoint to path + ".tmp" and renames it to path once
+/// it is on disk, so path always holds the last complete checkpoint. Throws
+/// std::system_error if the file cannot be written.
+void write_checkpoint(const std::string &path, const std::vector<uint8_t> &data);
+
+/// Reads a checkpoint written by write_checkpoint(). Throws
+/// std::system_error if the file cannot be read and std::runtime_error if it
+/// is not a complete checkpoint.
+std::vector<uint8_t> read_checkpoint(const std::string &path);
+
+#endif
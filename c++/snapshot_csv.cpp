@@ -0,0 +1,43 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//! Converts a binary agent snapshot to the CSV that print_agents() writes.
+
+#include <fstream>
+#include <iostream>
+
+#include "abm.hpp"
+#include "snapshot.hpp"
+
+int main(int argc, char **argv) {
+		if (argc < 2 || argc > 3) {
+				std::cerr << "usage: " << argv[0] << " snapshot.bin [agents.csv]\n";
+				return 2;
+		}
+		SnapshotHeader header;
+		std::vector<uint8_t> states;
+		try {
+				read_snapshot(argv[1], header, states);
+		} catch (const std::exception &e) {
+				std::cerr << e.what() << "\n";
+				return 1;
+		}
+		std::ofstream file;
+		if (argc == 3)
+				file.open(argv[2]);
+		std::ostream &out = argc == 3 ? file : std::cout;
+		out << "id,state\n";
+		for (size_t i = 0; i < states.size(); i++)
+				out << i << "," << (State) states[i] << "\n";
+		return out ? 0 : 1;
+}
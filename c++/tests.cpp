@@ -2,7 +2,14 @@
 #include <boost/process.hpp>
 #include <boost/test/included/unit_test.hpp>
 
+#include <limits>
+#include <set>
+
 #include "abm.hpp"
+#include "device.hpp"
+#include "metrics.hpp"
+#include "scheduler.hpp"
+#include "shards.hpp"
 
 BOOST_AUTO_TEST_CASE(simulation_test_example) {
   Parameters parameters;
@@ -12,3 +19,1683 @@ BOOST_AUTO_TEST_CASE(simulation_test_example) {
   simulation.simulate();
   BOOST_TEST(simulation.agents.size() > 10000);
 }
+
+BOOST_AUTO_TEST_CASE(columns_index_sets_test) {
+  Parameters parameters;
+  parameters.infection_method = InfectionMethod::ONE;
+  BasicSimulation<AgentColumns> simulation(5, parameters);
+  simulation.simulate();
+  const AgentColumns &agents = simulation.agents;
+  size_t members = 0;
+  for (size_t s = 0; s < STATE_COUNT; s++) {
+    members += agents.members[s].size();
+    for (size_t k = 0; k < agents.members[s].size(); k++) {
+      size_t i = agents.members[s][k];
+      BOOST_REQUIRE(agents.states[i] == s);
+      BOOST_REQUIRE(agents.slots[i] == k);
+    }
+  }
+  BOOST_TEST(members == agents.size());
+  BOOST_TEST(agents.size() > 10000);
+}
+
+BOOST_AUTO_TEST_CASE(state_counters_test) {
+  Parameters parameters;
+  parameters.iterations = 300;
+  Simulation reference(2, parameters);
+  BasicSimulation<AgentColumns> columns(2, parameters);
+  reference.simulate();
+  columns.simulate();
+  BOOST_TEST((reference.agents.statistics() == reference.agents.recount()));
+  BOOST_TEST((columns.agents.statistics() == columns.agents.recount()));
+  BOOST_TEST(reference.agents.living() ==
+             reference.agents.size() - reference.agents.recount().dead);
+}
+
+BOOST_AUTO_TEST_CASE(skip_sampling_test) {
+  AgentColumns agents;
+  for (size_t i = 0; i < 100000; i++)
+    agents.push_back(i, State::INFECTIOUS);
+  Rng rng(1);
+  size_t moved = agents.sample(State::INFECTIOUS, State::RECOVERED, 0.01, rng);
+  // Binomial(100000, 0.01) has a standard deviation of about 31.5
+  BOOST_TEST(moved > 1000 - 5 * 32);
+  BOOST_TEST(moved < 1000 + 5 * 32);
+  BOOST_TEST(agents.statistics().recovered == moved);
+  BOOST_TEST((agents.statistics() == agents.recount()));
+
+  // The gaps of the legacy engine are drawn finer than its 15 bits.
+  Rng legacy(5);
+  size_t fine = 0;
+  for (size_t i = 0; i < 10000; i++) {
+    double u = gap_real(legacy);
+    BOOST_REQUIRE(u >= 0.0);
+    BOOST_REQUIRE(u < 1.0);
+    if (u * 32768 != std::floor(u * 32768))
+      ++fine;
+  }
+  BOOST_TEST(fine > 9900);
+
+  Parameters parameters;
+  parameters.sampling = Sampling::SKIP;
+  BasicSimulation<AgentColumns> simulation(3, parameters);
+  simulation.simulate();
+  BOOST_TEST((simulation.agents.statistics() == simulation.agents.recount()));
+}
+
+template <typename Engine>
+void check_engine() {
+  Engine rng(11), copy(11);
+  uint64_t bulk[64];
+  rng.fill(bulk, 64);
+  for (size_t i = 0; i < 64; i++)
+    BOOST_REQUIRE(bulk[i] == copy.uint());
+  // The legacy engine never returns indices past 32767.
+  uint64_t highest = 0;
+  size_t fine = 0; // Draws that are not multiples of 1/32768
+  for (size_t i = 0; i < 100000; i++) {
+    uint64_t r = rng.to(1000000);
+    BOOST_REQUIRE(r < 1000000);
+    highest = std::max(highest, r);
+    double x = rng.real();
+    BOOST_REQUIRE(x >= 0.0);
+    BOOST_REQUIRE(x < 1.0);
+    if (x * 32768 != std::floor(x * 32768))
+      ++fine;
+  }
+  BOOST_TEST(highest > 990000);
+  BOOST_TEST(fine > 99000);
+  BasicSimulation<AgentColumns, Engine> simulation(1, Parameters());
+  simulation.simulate();
+  BOOST_TEST((simulation.agents.statistics() == simulation.agents.recount()));
+}
+
+BOOST_AUTO_TEST_CASE(engines_test) {
+  check_engine<Xoshiro256pp>();
+  check_engine<Pcg64>();
+  LegacyRng legacy(11);
+  for (size_t i = 0; i < 100000; i++)
+    BOOST_REQUIRE(legacy.to(1000000) < 32768);
+}
+
+BOOST_AUTO_TEST_CASE(simd_kernel_test) {
+  // The kernel draws are counter based, so both storages agree exactly.
+  Parameters parameters;
+  parameters.kernel = EventKernel::SIMD;
+  parameters.infection_method = InfectionMethod::ONE;
+  BasicSimulation<AgentArray, Xoshiro256pp> array(6, parameters);
+  BasicSimulation<AgentColumns, Xoshiro256pp> columns(6, parameters);
+  array.simulate();
+  columns.simulate();
+  BOOST_TEST((array.agents.statistics() == columns.agents.statistics()));
+  BOOST_TEST((columns.agents.statistics() == columns.agents.recount()));
+  BOOST_TEST(array.infection_deaths == columns.infection_deaths);
+  BOOST_TEST(array.total_infections == columns.total_infections);
+
+  AgentColumns agents;
+  for (size_t i = 0; i < 100000; i++)
+    agents.push_back(i, i % 2 ? State::SUSCEPTIBLE : State::INFECTIOUS);
+  TransitionTable table;
+  table.add(State::SUSCEPTIBLE, State::VACCINATED, 0.01);
+  table.add(State::INFECTIOUS, State::DEAD, 0.02);
+  Statistics moved = agents.step(table, Philox2x32(3), 0);
+  BOOST_TEST((agents.statistics() == agents.recount()));
+  BOOST_TEST(moved.susceptible > 500 - 5 * 23);
+  BOOST_TEST(moved.susceptible < 500 + 5 * 23);
+  BOOST_TEST(moved.infectious > 1000 - 5 * 32);
+  BOOST_TEST(moved.infectious < 1000 + 5 * 32);
+  BOOST_TEST(agents.statistics().vaccinated == moved.susceptible);
+  BOOST_TEST(agents.statistics().dead == moved.infectious);
+}
+
+BOOST_AUTO_TEST_CASE(kernel_dispatch_test) {
+  // Every kernel this CPU supports draws exactly what the scalar one does.
+  std::vector<uint8_t> states(KERNEL_BLOCK * 4 + 77);
+  for (size_t i = 0; i < states.size(); i++)
+    states[i] = (i * 7 + i / 3) % STATE_COUNT;
+  TransitionTable table;
+  table.add(State::SUSCEPTIBLE, State::DEAD, 0.2);
+  table.add(State::RECOVERED, State::SUSCEPTIBLE, 0.5);
+  table.add(State::DEAD, State::DEAD, 0.9);
+  std::vector<TransitionKernel> kernels = supported_kernels();
+  Philox2x32 philox(9);
+  for (size_t first = 0; first < states.size(); first += KERNEL_BLOCK) {
+    size_t n = std::min(KERNEL_BLOCK, states.size() - first);
+    uint64_t expected[KERNEL_BLOCK / 64];
+    size_t count = kernels[0](&states[first], n, table, philox, 5, first, expected);
+    size_t bits = 0;
+    for (size_t i = 0; i < n; i++) {
+      bool hit = kernel_draw(philox, 5, first + i) < table.thresholds[states[first + i]];
+      BOOST_REQUIRE(hit == ((expected[i / 64] >> (i % 64)) & 1));
+      bits += hit;
+    }
+    BOOST_REQUIRE(count == bits);
+    for (TransitionKernel kernel: kernels) {
+      uint64_t hits[KERNEL_BLOCK / 64];
+      BOOST_REQUIRE(kernel(&states[first], n, table, philox, 5, first, hits) == count);
+      for (size_t i = 0; i < n; i++)
+        BOOST_REQUIRE(((hits[i / 64] >> (i % 64)) & 1) ==
+                      ((expected[i / 64] >> (i % 64)) & 1));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(fused_step_test) {
+  // With the kernels, fusing the events only changes the memory traffic.
+  Parameters parameters;
+  parameters.kernel = EventKernel::SIMD;
+  BasicSimulation<AgentColumns, Pcg64> sequential(7, parameters);
+  parameters.fused = true;
+  BasicSimulation<AgentColumns, Pcg64> fused(7, parameters);
+  BasicSimulation<AgentArray, Pcg64> fused_array(7, parameters);
+  sequential.simulate();
+  fused.simulate();
+  fused_array.simulate();
+  BOOST_TEST((sequential.agents.statistics() == fused.agents.statistics()));
+  BOOST_TEST((fused.agents.statistics() == fused_array.agents.statistics()));
+  BOOST_TEST((fused.agents.statistics() == fused.agents.recount()));
+  BOOST_TEST(sequential.infection_deaths == fused.infection_deaths);
+  BOOST_TEST(sequential.total_infections == fused.total_infections);
+
+  parameters.kernel = EventKernel::SCALAR;
+  Simulation engine(7, parameters);
+  engine.simulate();
+  BOOST_TEST((engine.agents.statistics() == engine.agents.recount()));
+  BOOST_TEST(engine.agents.size() > 10000);
+}
+
+BOOST_AUTO_TEST_CASE(partial_shuffle_test) {
+  // The first entry of a partial shuffle is uniform over the positions.
+  Xoshiro256pp rng(5);
+  std::vector<size_t> first(10);
+  for (size_t trial = 0; trial < 10000; trial++) {
+    std::vector<uint32_t> sample = partial_shuffle(10, 4, rng);
+    BOOST_REQUIRE(sample.size() == 4);
+    std::sort(sample.begin(), sample.end());
+    BOOST_REQUIRE(std::adjacent_find(sample.begin(), sample.end()) == sample.end());
+    BOOST_REQUIRE(sample.back() < 10);
+    ++first[partial_shuffle(10, 1, rng)[0]];
+  }
+  for (size_t count: first) {
+    BOOST_TEST(count > 1000 - 5 * 30);
+    BOOST_TEST(count < 1000 + 5 * 30);
+  }
+
+  // Partial shuffling leaves the agents in order and infects as many agents
+  // as full shuffling on average (the standard deviation per run is about 600).
+  Parameters parameters;
+  parameters.infection_method = InfectionMethod::TWO;
+  double full = 0, partial = 0;
+  const size_t runs = 16;
+  for (size_t i = 1; i <= runs; i++) {
+    parameters.shuffle = Shuffle::FULL;
+    Simulation reference(i, parameters);
+    reference.simulate();
+    full += reference.total_infections;
+    parameters.shuffle = Shuffle::PARTIAL;
+    BasicSimulation<AgentColumns> sampled(i, parameters);
+    sampled.simulate();
+    partial += sampled.total_infections;
+    BOOST_TEST((sampled.agents.statistics() == sampled.agents.recount()));
+    for (size_t j = 0; j < sampled.agents.size(); j++)
+      BOOST_REQUIRE(sampled.agents.identity(j) == (int) j);
+  }
+  BOOST_TEST(std::abs(full - partial) / runs < 4 * 600 / std::sqrt(runs / 2.0));
+}
+
+BOOST_AUTO_TEST_CASE(scheduler_test) {
+  // The rows come out in (identity, iteration) order, the same as running
+  // the simulations one after the other, whatever the number of threads.
+  Parameters parameters;
+  parameters.simulations = 6;
+  parameters.iterations = 250;
+  parameters.agents = 2000;
+  std::ostringstream expected;
+  for (size_t i = 0; i < parameters.simulations; i++) {
+    Simulation simulation(i, parameters);
+    simulation.output = &expected;
+    simulation.simulate();
+  }
+  for (size_t threads: {1, 3, 8}) {
+    parameters.threads = threads;
+    std::ostringstream out;
+    run_simulations<Simulation>(parameters, out);
+    BOOST_TEST(out.str() == expected.str());
+  }
+
+  // Tasks posted by tasks run too.
+  WorkStealingPool pool(4);
+  std::atomic<size_t> ran(0);
+  std::function<void(size_t, size_t)> spawn = [&](size_t depth, size_t worker) {
+    ++ran;
+    if (depth > 0)
+      for (int i = 0; i < 2; i++)
+        pool.post([&spawn, depth](size_t w) { spawn(depth - 1, w); }, worker);
+  };
+  pool.post([&spawn](size_t w) { spawn(9, w); }, 0);
+  pool.run();
+  BOOST_TEST(ran == 1023);
+}
+
+BOOST_AUTO_TEST_CASE(shards_test) {
+  Parameters parameters;
+  parameters.simulations = 1;
+  parameters.agents = 30000;
+  parameters.storage = StorageLayout::SHARDS;
+  parameters.kernel = EventKernel::SIMD;
+  // One shard draws what the unsharded columns do.
+  parameters.shards = 1;
+  BasicSimulation<AgentColumns> columns(2, parameters);
+  BasicSimulation<AgentShards> one(2, parameters);
+  columns.simulate();
+  one.simulate();
+  BOOST_TEST((columns.agents.statistics() == one.agents.statistics()));
+  BOOST_TEST(columns.total_infections == one.total_infections);
+
+  // More shards change the draws but not the number of threads.
+  parameters.shards = 5;
+  parameters.threads = 1;
+  BasicSimulation<AgentShards> serial(2, parameters);
+  parameters.threads = 3;
+  BasicSimulation<AgentShards> parallel(2, parameters);
+  serial.simulate();
+  parallel.simulate();
+  BOOST_TEST((serial.agents.statistics() == parallel.agents.statistics()));
+  BOOST_TEST((parallel.agents.statistics() == parallel.agents.recount()));
+  BOOST_TEST(serial.total_infections == parallel.total_infections);
+  for (size_t i = 0; i < parallel.agents.size(); i += 997)
+    BOOST_REQUIRE(parallel.agents.state(i) == serial.agents.state(i));
+
+  // Positions map to distinct (shard, local) pairs and back.
+  AgentShards shards;
+  shards.configure(3, std::make_shared<ForkJoin>(1));
+  for (size_t i = 0; i < 5 * AgentShards::CHUNK; i++) {
+    shards.push_back(i, State::SUSCEPTIBLE);
+    BOOST_REQUIRE(shards.global(shards.shard_of(i), shards.local(i)) == i);
+    BOOST_REQUIRE(shards.identity(i) == (int) i);
+  }
+  shards.swap(1, 3 * AgentShards::CHUNK + 1);
+  shards.set_state(1, State::DEAD);
+  shards.sort_by_identity();
+  BOOST_TEST(shards.state(3 * AgentShards::CHUNK + 1) == State::DEAD);
+  BOOST_TEST((shards.statistics() == shards.recount()));
+
+  // Shard keys are hashed, not Philox's own round keys shifted.
+  Philox2x32 philox(9);
+  std::set<uint32_t> keys;
+  for (size_t k = 0; k < 64; k++) {
+    uint32_t key = AgentShards::key(philox, k).key;
+    keys.insert(key);
+    if (k > 0)
+      BOOST_TEST(key - philox.key != (uint32_t) (k * 0x9e3779b9));
+  }
+  BOOST_TEST(AgentShards::key(philox, 0).key == philox.key);
+  BOOST_TEST(keys.size() == 64);
+
+  ForkJoin pool(4);
+  std::vector<size_t> calls(100);
+  for (size_t round = 0; round < 50; round++)
+    pool.run(calls.size(), [&calls](size_t i) { ++calls[i]; });
+  BOOST_TEST(std::count(calls.begin(), calls.end(), 50) == 100);
+}
+
+BOOST_AUTO_TEST_CASE(encounter_batch_test) {
+  // An agent infected in a batch does not infect others in the same batch:
+  // with one infectious agent among 50, 200 encounters meet it about 8 times.
+  Philox2x32 philox(4);
+  std::vector<Statistics> results;
+  for (size_t threads: {1, 4}) {
+    AgentColumns agents;
+    for (size_t i = 0; i < 50; i++)
+      agents.push_back(i, i == 0 ? State::INFECTIOUS : State::SUSCEPTIBLE);
+    ForkJoin pool(threads);
+    ScratchArena arena;
+    size_t infections = encounter_batch(agents, 200, philox, 0, pool, arena);
+    BOOST_TEST(infections > 0);
+    BOOST_TEST(infections < 20);
+    BOOST_TEST(agents.statistics().infectious == 1 + infections);
+    BOOST_TEST((agents.statistics() == agents.recount()));
+    results.push_back(agents.statistics());
+  }
+  BOOST_TEST((results[0] == results[1]));
+
+  // Batches of several blocks come out the same on any number of threads and
+  // on any storage.
+  Parameters parameters;
+  parameters.simulations = 1;
+  parameters.infection_method = InfectionMethod::ONE;
+  parameters.encounters = 3 * ENCOUNTER_BLOCK + 5;
+  parameters.iterations = 200;
+  parameters.encounter_mode = EncounterMode::BATCHED;
+  parameters.kernel = EventKernel::SIMD;
+  parameters.threads = 1;
+  BasicSimulation<AgentArray> array(1, parameters);
+  parameters.threads = 3;
+  BasicSimulation<AgentColumns> columns(1, parameters);
+  parameters.storage = StorageLayout::SHARDS;
+  parameters.shards = 1;
+  BasicSimulation<AgentShards> shards(1, parameters);
+  array.simulate();
+  columns.simulate();
+  shards.simulate();
+  BOOST_TEST((array.agents.statistics() == columns.agents.statistics()));
+  BOOST_TEST((columns.agents.statistics() == shards.agents.statistics()));
+  BOOST_TEST(array.total_infections == columns.total_infections);
+  BOOST_TEST(array.total_infections > parameters.infections);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_test) {
+  BOOST_TEST(snapshot_filename("out/agents.csv", 3, 1460) == "out/agents_3_1460.bin");
+  BOOST_TEST(snapshot_filename("run.d/agents", 0, 7) == "run.d/agents_0_7.bin");
+
+  Parameters parameters;
+  parameters.iterations = 100;
+  parameters.output_agents = 100;
+  parameters.agent_format = AgentFormat::BINARY;
+  parameters.agent_filename = "snapshot_test.csv";
+  BasicSimulation<AgentColumns, Xoshiro256pp> simulation(5, parameters);
+  simulation.simulate();
+  SnapshotHeader header;
+  std::vector<uint8_t> states;
+  read_snapshot("snapshot_test_5_100.bin", header, states);
+  BOOST_TEST(header.identity == 5);
+  BOOST_TEST(header.iteration == 100);
+  BOOST_TEST(header.agents == simulation.agents.size());
+  BOOST_TEST(header.total_infections == simulation.total_infections);
+  BOOST_TEST(std::memcmp(header.rng, &simulation.rng, sizeof(simulation.rng)) == 0);
+  Statistics counts;
+  for (uint8_t state: states)
+    ++counts[(State) state];
+  BOOST_TEST((counts == simulation.agents.statistics()));
+  for (size_t i = 0; i < simulation.agents.size(); i++)
+    BOOST_REQUIRE(states[simulation.agents.identity(i)] == simulation.agents.state(i));
+  std::remove("snapshot_test_5_100.bin");
+
+  BOOST_CHECK_THROW(read_snapshot("tests.cpp", header, states), std::runtime_error);
+  BOOST_CHECK_THROW(read_snapshot("no/such/file", header, states), std::system_error);
+}
+
+BOOST_AUTO_TEST_CASE(async_writer_test) {
+  // Every value pushed by several producers comes out exactly once and each
+  // producer's values come out in order.
+  BoundedQueue<size_t> queue(64);
+  BOOST_TEST(queue.capacity() == 64);
+  const size_t producers = 4, count = 20000;
+  std::vector<std::thread> threads;
+  for (size_t p = 0; p < producers; p++)
+    threads.emplace_back([&queue, p]() {
+      for (size_t i = 0; i < count; i++) {
+        size_t value = p * count + i;
+        while (!queue.try_push(value))
+          std::this_thread::yield();
+      }
+    });
+  std::vector<size_t> last(producers, 0);
+  size_t popped = 0, value;
+  while (popped < producers * count) {
+    if (!queue.try_pop(value))
+      continue;
+    size_t p = value / count;
+    BOOST_REQUIRE((value % count == 0 || value % count == last[p] + 1));
+    last[p] = value % count;
+    ++popped;
+  }
+  for (auto &thread: threads)
+    thread.join();
+  BOOST_TEST(!queue.try_pop(value));
+
+  // The writer gives the output of the synchronous path, reordered for
+  // several simulations, and drops no reports even when it is tiny.
+  Parameters parameters;
+  parameters.simulations = 5;
+  parameters.iterations = 300;
+  parameters.agents = 2000;
+  parameters.threads = 3;
+  std::ostringstream expected, out;
+  run_simulations<Simulation>(parameters, expected);
+  {
+    AsyncWriter writer(out, parameters.simulations, 2, OutputFull::DROP);
+    OutputTargets targets;
+    targets.writer = &writer;
+    run_simulations<Simulation>(parameters, out, targets);
+    writer.close();
+  }
+  BOOST_TEST(out.str() == expected.str());
+}
+
+BOOST_AUTO_TEST_CASE(format_report_test) {
+  uint64_t values[7] = {0, 1, 22, 333, 4444, 18446744073709551615ull, 7};
+  char row[REPORT_ROW_MAX];
+  std::string text(row, format_report(row, 12, 1460, values));
+  BOOST_TEST(text == "12,1460,0,1,22,333,4444,18446744073709551615,7\n");
+  uint64_t widest[7];
+  std::fill(widest, widest + 7, UINT64_MAX);
+  BOOST_TEST((size_t) (format_report(row, UINT64_MAX, UINT64_MAX, widest) - row)
+      == REPORT_ROW_MAX);
+}
+
+BOOST_AUTO_TEST_CASE(aggregate_test) {
+  // Merged halves agree with one pass over everything.
+  Moments all, low, high;
+  QuantileSketch sketch, low_sketch, high_sketch;
+  for (size_t i = 0; i <= 1000; i++) {
+    double x = i * i % 1009;
+    all.add(x);
+    sketch.add(x);
+    (i < 300 ? low : high).add(x);
+    (i < 300 ? low_sketch : high_sketch).add(x);
+  }
+  low.merge(high);
+  low_sketch.merge(high_sketch);
+  BOOST_TEST(low.count == all.count);
+  BOOST_TEST(std::abs(low.mean - all.mean) < 1e-9);
+  BOOST_TEST(std::abs(low.variance() - all.variance()) < 1e-6);
+  for (double q: {0.05, 0.5, 0.95})
+    BOOST_TEST(low_sketch.quantile(q) == sketch.quantile(q));
+
+  // Quantiles are within the sketch's relative accuracy of the exact ones.
+  QuantileSketch uniform;
+  for (size_t i = 1; i <= 10000; i++)
+    uniform.add(i);
+  BOOST_TEST(std::abs(uniform.quantile(0.5) - 5000) <= 5000 * 0.011);
+  BOOST_TEST(std::abs(uniform.quantile(0.95) - 9500) <= 9500 * 0.011);
+  BOOST_TEST(uniform.quantile(0.0) == 1);
+  BOOST_TEST(uniform.quantile(1.0) == 10000);
+
+  // --aggregate reduces every simulation's reports.
+  Parameters parameters;
+  parameters.simulations = 4;
+  parameters.iterations = 200;
+  parameters.agents = 2000;
+  parameters.report_every = 50;
+  parameters.aggregate = true;
+  ReportAggregator aggregator;
+  OutputTargets targets;
+  targets.aggregator = &aggregator;
+  std::ostringstream rows, table;
+  run_simulations<Simulation>(parameters, rows, targets);
+  BOOST_TEST(rows.str().empty());
+  aggregator.write(table);
+  std::string text = table.str();
+  BOOST_TEST(text.find("iter,stat,n,mean,var,p5,p50,p95\n0,S,4,1990,0,1990,1990,1990\n")
+      == 0);
+  // Iterations 0, 50, 100, 150 and 200 with seven statistics each
+  BOOST_TEST(std::count(text.begin(), text.end(), '\n') == 1 + 5 * 7);
+}
+
+template <typename SimulationType>
+size_t steady_state_allocations(const Parameters &parameters) {
+  SimulationType simulation(parameters.infection_method == InfectionMethod::TWO,
+                            parameters);
+  std::ostringstream rows;
+  simulation.output = &rows;
+  simulation.start();
+  simulation.advance(150);
+  size_t before = allocation_count();
+  simulation.advance(200);
+  return allocation_count() - before;
+}
+
+BOOST_AUTO_TEST_CASE(steady_state_allocation_test) {
+#ifndef NDEBUG
+  size_t counted = allocation_count();
+  std::unique_ptr<int> p(new int(1));
+  BOOST_TEST(allocation_count() == counted + 1);
+  // Over-aligned types are counted too.
+  struct alignas(64) Line {
+    char bytes[64];
+  };
+  std::unique_ptr<Line> line(new Line());
+  BOOST_TEST(allocation_count() == counted + 2);
+  BOOST_TEST((uintptr_t) line.get() % 64 == 0);
+#endif
+
+  // The arena stops allocating once it has seen an iteration's requests.
+  ScratchArena arena;
+  for (size_t round = 0; round < 3; round++) {
+    size_t before = allocation_count();
+    uint32_t *a = arena.allocate<uint32_t>(1000);
+    double *b = arena.allocate<double>(10);
+    a[999] = 1;
+    b[9] = 1;
+    BOOST_TEST((round == 0 || allocation_count() == before));
+    arena.reset();
+  }
+
+  // Once warmed up, no iteration allocates (only debug builds count).
+  Parameters parameters;
+  parameters.simulations = 1;
+  parameters.iterations = 400;
+  parameters.agents = 20000;
+  parameters.growth = 0.001;
+  Parameters one = parameters, two = parameters;
+  one.infection_method = InfectionMethod::ONE;
+  two.infection_method = InfectionMethod::TWO;
+  BOOST_TEST(steady_state_allocations<Simulation>(one) == 0);
+  BOOST_TEST(steady_state_allocations<Simulation>(two) == 0);
+  BOOST_TEST(steady_state_allocations<BasicSimulation<AgentColumns>>(one) == 0);
+  Parameters partial = two;
+  partial.shuffle = Shuffle::PARTIAL;
+  BOOST_TEST(steady_state_allocations<BasicSimulation<AgentColumns>>(partial) == 0);
+  Parameters skip = one;
+  skip.storage = StorageLayout::COLUMNS;
+  skip.sampling = Sampling::SKIP;
+  BOOST_TEST(steady_state_allocations<BasicSimulation<AgentColumns>>(skip) == 0);
+  Parameters simd = skip;
+  simd.kernel = EventKernel::SIMD;
+  BOOST_TEST(steady_state_allocations<BasicSimulation<AgentColumns>>(simd) == 0);
+  BOOST_TEST(steady_state_allocations<BasicSimulation<AgentCompact<4>>>(simd) == 0);
+  simd.fused = true;
+  BOOST_TEST(steady_state_allocations<BasicSimulation<AgentColumns>>(simd) == 0);
+  Parameters batched = simd;
+  batched.encounter_mode = EncounterMode::BATCHED;
+  batched.encounters = 3 * ENCOUNTER_BLOCK;
+  batched.threads = 2;
+  BOOST_TEST(steady_state_allocations<BasicSimulation<AgentColumns>>(batched) == 0);
+  Parameters sharded = simd;
+  sharded.storage = StorageLayout::SHARDS;
+  sharded.shards = 3;
+  sharded.threads = 2;
+  BOOST_TEST(steady_state_allocations<BasicSimulation<AgentShards>>(sharded) == 0);
+  sharded.encounter_mode = EncounterMode::BATCHED;
+  BOOST_TEST(steady_state_allocations<BasicSimulation<AgentShards>>(sharded) == 0);
+}
+
+template <typename SimulationType>
+std::string reset_reports(Parameters parameters, size_t allocations[2]) {
+  std::ostringstream fresh_rows, reused_rows;
+  SimulationType fresh(3, parameters);
+  fresh.output = &fresh_rows;
+  fresh.simulate();
+  SimulationType reused(8, parameters);
+  reused.output = &reused_rows;
+  reused.simulate();
+  for (size_t k = 0; k < 2; k++) {
+    reused_rows.str("");
+    size_t before = allocation_count();
+    reused.reset(3, parameters);
+    allocations[k] = allocation_count() - before;
+    reused.simulate();
+  }
+  BOOST_TEST(fresh_rows.str() == reused_rows.str());
+  return reused_rows.str();
+}
+
+BOOST_AUTO_TEST_CASE(simulation_reset_test) {
+  // A reset simulation runs exactly like a new one and, once a simulation of
+  // as many agents has run, reuses its memory.
+  Parameters parameters;
+  parameters.simulations = 1;
+  parameters.iterations = 200;
+  parameters.agents = 5000;
+  size_t allocations[2];
+  reset_reports<Simulation>(parameters, allocations);
+  BOOST_TEST(allocations[1] == 0);
+  Parameters partial = parameters;
+  partial.shuffle = Shuffle::PARTIAL;
+  partial.infection_method = InfectionMethod::TWO;
+  partial.sampling = Sampling::SKIP;
+  reset_reports<BasicSimulation<AgentColumns>>(partial, allocations);
+  BOOST_TEST(allocations[1] == 0);
+  Parameters sharded = parameters;
+  sharded.storage = StorageLayout::SHARDS;
+  sharded.kernel = EventKernel::SIMD;
+  sharded.shards = 3;
+  sharded.encounter_mode = EncounterMode::BATCHED;
+  reset_reports<BasicSimulation<AgentShards>>(sharded, allocations);
+  BOOST_TEST(allocations[1] == 0);
+
+  // Batches reuse finished simulations and still write what they did.
+  parameters.simulations = 6;
+  std::ostringstream batch, single;
+  run_simulations<Simulation>(parameters, batch);
+  for (size_t i = 0; i < parameters.simulations; i++) {
+    Simulation simulation(i, parameters);
+    simulation.output = &single;
+    simulation.simulate();
+  }
+  BOOST_TEST(batch.str() == single.str());
+}
+
+template <typename SimulationType>
+std::string report_rows(const Parameters &parameters, size_t identity) {
+  std::ostringstream rows;
+  SimulationType simulation(identity, parameters);
+  simulation.output = &rows;
+  simulation.simulate();
+  return rows.str();
+}
+
+BOOST_AUTO_TEST_CASE(compact_storage_test) {
+  // States of odd length packed in nibbles survive appends and swaps.
+  AgentCompact<4> packed;
+  packed.append(0, State::SUSCEPTIBLE, 3);
+  packed.push_back(3, State::DEAD);
+  packed.append(4, State::RECOVERED, 4);
+  packed.set_state(1, State::INFECTIOUS);
+  packed.swap(1, 6);
+  BOOST_TEST(packed.size() == 8);
+  BOOST_TEST(packed.bytes.size() == 4);
+  BOOST_TEST(packed.state(1) == State::RECOVERED);
+  BOOST_TEST(packed.state(3) == State::DEAD);
+  BOOST_TEST(packed.state(6) == State::INFECTIOUS);
+  BOOST_TEST(packed.identity(6) == 6);
+  BOOST_TEST((packed.statistics() == packed.recount()));
+  BOOST_TEST(sizeof(State) == 1);
+
+  // Only the identities differ from the reference, so the reports are the
+  // same, with the engine and with the kernels.
+  Parameters parameters;
+  parameters.iterations = 300;
+  parameters.agents = 3001;
+  for (size_t identity: {0, 1}) {
+    std::string reference = report_rows<Simulation>(parameters, identity);
+    BOOST_TEST(report_rows<BasicSimulation<AgentCompact<8>>>(parameters,
+          identity) == reference);
+    BOOST_TEST(report_rows<BasicSimulation<AgentCompact<4>>>(parameters,
+          identity) == reference);
+  }
+  Parameters simd = parameters;
+  simd.kernel = EventKernel::SIMD;
+  simd.fused = true;
+  std::string columns = report_rows<BasicSimulation<AgentColumns>>(simd, 0);
+  BOOST_TEST(report_rows<BasicSimulation<AgentCompact<4>>>(simd, 0) == columns);
+  simd.encounter_mode = EncounterMode::BATCHED;
+  simd.simulations = 1;
+  columns = report_rows<BasicSimulation<AgentColumns>>(simd, 0);
+  BOOST_TEST(report_rows<BasicSimulation<AgentCompact<8>>>(simd, 0) == columns);
+}
+
+BOOST_AUTO_TEST_CASE(device_storage_test) {
+  AgentDevice agents;
+  agents.append(0, State::SUSCEPTIBLE, 3);
+  agents.push_back(3, State::DEAD);
+  agents.append(4, State::RECOVERED, 4);
+  agents.set_state(1, State::INFECTIOUS);
+  agents.swap(1, 6);
+  BOOST_TEST(agents.size() == 8);
+  BOOST_TEST(agents.state(1) == State::RECOVERED);
+  BOOST_TEST(agents.state(6) == State::INFECTIOUS);
+  BOOST_TEST(agents.identity(6) == 6);
+  BOOST_TEST(agents.living() == 7);
+  BOOST_TEST((agents.statistics() == agents.recount()));
+
+  // The kernel moves the agents the CPU kernels move, and the counts follow
+  // without reading the states back.
+  AgentCompact<8> compact;
+  AgentDevice copy = agents;
+  for (size_t i = 0; i < agents.size(); i++)
+    compact.push_back(i, agents.state(i));
+  TransitionTable table;
+  table.add(State::RECOVERED, State::SUSCEPTIBLE, 0.5);
+  table.add(State::INFECTIOUS, State::DEAD, 0.5);
+  Philox2x32 philox(7);
+  Statistics moved = copy.step(table, philox, 3);
+  BOOST_TEST((moved == compact.step(table, philox, 3)));
+  BOOST_TEST((copy.statistics() == compact.statistics()));
+  BOOST_TEST((copy.statistics() == copy.recount()));
+  for (size_t i = 0; i < copy.size(); i++)
+    BOOST_TEST(copy.state(i) == compact.state(i));
+  // The copy has memory of its own.
+  BOOST_TEST(agents.state(6) == State::INFECTIOUS);
+  AgentDevice moved_to = std::move(copy);
+  BOOST_TEST((moved_to.statistics() == compact.statistics()));
+}
+
+template <typename SimulationType>
+void check_compacted(const SimulationType &simulation) {
+  // Every identity is either stored or cold, and the cold ones are dead.
+  std::vector<uint8_t> states = simulation.states();
+  BOOST_TEST(states.size() == simulation.population());
+  std::vector<bool> seen(states.size());
+  for (size_t i = 0; i < simulation.agents.size(); i++)
+    seen[simulation.agents.identity(i)] = true;
+  for (int identity: simulation.cold) {
+    BOOST_REQUIRE(!seen[identity]);
+    seen[identity] = true;
+  }
+  BOOST_TEST(std::count(seen.begin(), seen.end(), true) == (long) states.size());
+  Statistics stats = simulation.agents.recount();
+  BOOST_TEST(std::count(states.begin(), states.end(), State::DEAD) ==
+             (long) (stats.dead + simulation.cold.size()));
+  // The arrangement holds distinct positions of the population.
+  std::vector<uint32_t> arrangement = simulation.arrangement;
+  std::sort(arrangement.begin(), arrangement.end());
+  BOOST_TEST((std::adjacent_find(arrangement.begin(), arrangement.end()) ==
+              arrangement.end()));
+  BOOST_TEST((arrangement.empty() ||
+              arrangement.back() < simulation.agents.size() +
+              simulation.cold_positions()));
+}
+
+BOOST_AUTO_TEST_CASE(compaction_test) {
+  Parameters parameters;
+  parameters.simulations = 1;
+  parameters.iterations = 300;
+  parameters.agents = 2000;
+  parameters.encounters = 40;
+  parameters.death_prob_susceptible = 0.003;
+  parameters.compact_every = 50;
+  parameters.shuffle = Shuffle::PARTIAL;
+  for (Compaction compaction: {Compaction::LIVE, Compaction::EQUIVALENT}) {
+    parameters.compaction = compaction;
+    for (size_t identity: {0, 1}) {
+      Simulation array(identity, parameters);
+      array.simulate();
+      BOOST_TEST(array.cold.size() > 0);
+      check_compacted(array);
+      parameters.kernel = EventKernel::SIMD;
+      BasicSimulation<AgentColumns> columns(identity, parameters);
+      columns.simulate();
+      BOOST_TEST(columns.cold.size() > 0);
+      check_compacted(columns);
+      parameters.kernel = EventKernel::SCALAR;
+    }
+  }
+
+  // EQUIVALENT is equivalent in distribution to no compaction (with a
+  // generator whose consecutive draws are independent).
+  parameters.generator = Generator::XOSHIRO;
+  parameters.iterations = 200;
+  parameters.agents = 1000;
+  parameters.compact_every = 20;
+  for (InfectionMethod method: {InfectionMethod::ONE, InfectionMethod::TWO}) {
+    parameters.infection_method = method;
+    Moments moments[2];
+    for (size_t mode = 0; mode < 2; mode++) {
+      parameters.compaction = mode == 0 ? Compaction::OFF : Compaction::EQUIVALENT;
+      for (size_t identity = 0; identity < 60; identity++) {
+        BasicSimulation<AgentArray, Xoshiro256pp> simulation(identity, parameters);
+        simulation.simulate();
+        moments[mode].add(simulation.total_infections);
+      }
+    }
+    double error = std::sqrt((moments[0].variance() + moments[1].variance()) / 60);
+    BOOST_TEST(std::abs(moments[0].mean - moments[1].mean) < 3 * error);
+  }
+}
+
+/// Runs a simulation that checkpoints every 70 iterations, resumes it from
+/// the checkpoint it wrote last and returns whether the resumed run wrote
+/// exactly the rows the first run wrote after that checkpoint.
+template <typename SimulationType>
+bool resumes_exactly(Parameters parameters) {
+  parameters.simulations = 1;
+  parameters.iterations = 200;
+  parameters.report_every = 10;
+  parameters.checkpoint_every = 70;
+  parameters.checkpoint_file = "checkpoint_test.bin";
+  std::ostringstream rows, resumed_rows;
+  SimulationType simulation(4, parameters);
+  simulation.output = &rows;
+  simulation.simulate();
+  SimulationType resumed(parameters,
+      read_checkpoint(checkpoint_filename(parameters.checkpoint_file, 4)));
+  std::remove("checkpoint_test_4.ckpt");
+  resumed.output = &resumed_rows;
+  resumed.advance(parameters.iterations);
+  resumed.finish();
+  // The last checkpoint was taken after iteration 139.
+  std::string after = rows.str().substr(rows.str().find("\n4,140,") + 1);
+  return resumed.iteration == parameters.iterations &&
+      resumed_rows.str() == after;
+}
+
+BOOST_AUTO_TEST_CASE(checkpoint_test) {
+  BOOST_TEST(checkpoint_filename("run.d/checkpoint.bin", 4) == "run.d/checkpoint_4.ckpt");
+
+  Parameters parameters;
+  parameters.agents = 3000;
+  BOOST_TEST((resumes_exactly<Simulation>(parameters)));
+  Parameters skip = parameters;
+  skip.sampling = Sampling::SKIP;
+  skip.shuffle = Shuffle::PARTIAL;
+  BOOST_TEST((resumes_exactly<BasicSimulation<AgentColumns>>(skip)));
+  Parameters columns = parameters;
+  columns.storage = StorageLayout::COLUMNS;
+  columns.compaction = Compaction::LIVE;
+  columns.compact_dead = 0.01;
+  BOOST_TEST((resumes_exactly<BasicSimulation<AgentColumns, Pcg64>>(columns)));
+  Parameters equivalent = parameters;
+  equivalent.compaction = Compaction::EQUIVALENT;
+  equivalent.shuffle = Shuffle::PARTIAL;
+  equivalent.compact_every = 50;
+  BOOST_TEST((resumes_exactly<BasicSimulation<AgentArray, Xoshiro256pp>>(equivalent)));
+  Parameters sharded = parameters;
+  sharded.storage = StorageLayout::SHARDS;
+  sharded.kernel = EventKernel::SIMD;
+  sharded.shards = 3;
+  sharded.encounter_mode = EncounterMode::BATCHED;
+  BOOST_TEST((resumes_exactly<BasicSimulation<AgentShards>>(sharded)));
+  Parameters packed = parameters;
+  packed.storage = StorageLayout::PACKED;
+  BOOST_TEST((resumes_exactly<BasicSimulation<AgentCompact<4>>>(packed)));
+
+  // The aggregate of the rows before the checkpoint is carried over.
+  ReportAggregator whole, split;
+  Parameters aggregated = parameters;
+  aggregated.iterations = 200;
+  aggregated.checkpoint_every = 100;
+  aggregated.checkpoint_file = "checkpoint_test.bin";
+  Simulation simulation(4, aggregated);
+  simulation.aggregator = &whole;
+  simulation.simulate();
+  Simulation resumed(aggregated, read_checkpoint("checkpoint_test_4.ckpt"));
+  resumed.aggregator = &split;
+  resumed.advance(aggregated.iterations);
+  resumed.finish();
+  std::ostringstream whole_table, split_table;
+  whole.write(whole_table);
+  split.write(split_table);
+  BOOST_TEST(whole_table.str() == split_table.str());
+
+  // Another storage is refused, as are truncated files.
+  Parameters other = aggregated;
+  other.storage = StorageLayout::COLUMNS;
+  std::vector<uint8_t> data = read_checkpoint("checkpoint_test_4.ckpt");
+  BOOST_CHECK_THROW((BasicSimulation<AgentColumns>(other, data)),
+      std::runtime_error);
+  // So are checkpoints whose agents cannot be, before anything is indexed
+  // with them: an identity out of range, a repeated one and a bad state.
+  CheckpointHeader header;
+  std::memcpy(&header, data.data(), sizeof(header));
+  const size_t identities = header.header_size +
+      header.reported * (1 + ReportAggregate::VALUES) * sizeof(uint64_t);
+  const size_t states = data.size() - header.state.agents;
+  for (size_t corruption = 0; corruption < 3; corruption++) {
+    std::vector<uint8_t> corrupt = data;
+    if (corruption == 0)
+      std::memset(corrupt.data() + identities, 0x7f, sizeof(int32_t));
+    else if (corruption == 1)
+      std::memcpy(corrupt.data() + identities,
+          corrupt.data() + identities + sizeof(int32_t), sizeof(int32_t));
+    else
+      corrupt[states] = STATE_COUNT;
+    BOOST_CHECK_THROW((Simulation(aggregated, corrupt)), std::runtime_error);
+  }
+  BOOST_CHECK_NO_THROW((Simulation(aggregated, data)));
+  data.pop_back();
+  BOOST_CHECK_THROW((Simulation(aggregated, data)), std::runtime_error);
+  write_checkpoint("checkpoint_test_4.ckpt", data);
+  BOOST_CHECK_THROW(read_checkpoint("checkpoint_test_4.ckpt"), std::runtime_error);
+  std::remove("checkpoint_test_4.ckpt");
+  BOOST_CHECK_THROW(read_checkpoint("no/such/file"), std::system_error);
+
+  // Next-event timing is refused: its calendar is not in the checkpoint.
+  std::ostringstream ignored;
+  Parameters timed = aggregated;
+  timed.shuffle = Shuffle::PARTIAL;
+  Simulation steps(4, timed);
+  steps.output = &ignored;
+  steps.simulate();
+  timed.timing = Timing::EVENTS;
+  BOOST_CHECK_THROW(Simulation(timed, read_checkpoint("checkpoint_test_4.ckpt")),
+      std::runtime_error);
+  timed.timing = Timing::STEPS;
+  BOOST_CHECK_NO_THROW(Simulation(timed, read_checkpoint("checkpoint_test_4.ckpt")));
+  std::remove("checkpoint_test_4.ckpt");
+
+  // Writes handed to the checkpoint writer land in turn, and a write error
+  // comes back from wait().
+  CheckpointWriter writer;
+  for (uint8_t k = 0; k < 5; k++) {
+    std::vector<uint8_t> &buffer = writer.buffer();
+    buffer.assign(sizeof(CheckpointHeader), 0);
+    CheckpointHeader header;
+    header.state.identity = k;
+    std::memcpy(buffer.data(), &header, sizeof(header));
+    writer.write("checkpoint_test_writer.ckpt");
+  }
+  writer.wait();
+  CheckpointHeader last;
+  std::memcpy(&last, read_checkpoint("checkpoint_test_writer.ckpt").data(), sizeof(last));
+  BOOST_TEST(last.state.identity == 4);
+  std::remove("checkpoint_test_writer.ckpt");
+  writer.buffer().clear();
+  writer.write("no/such/dir/checkpoint.ckpt");
+  BOOST_CHECK_THROW(writer.wait(), std::system_error);
+}
+
+BOOST_AUTO_TEST_CASE(mapped_storage_test) {
+  // Mapped columns run exactly like heap ones and are mapped from the
+  // threshold up, huge page aligned when anonymous.
+  Parameters parameters;
+  parameters.simulations = 1;
+  parameters.iterations = 200;
+  parameters.agents = 5000;
+  Parameters columns = parameters;
+  columns.storage = StorageLayout::COLUMNS;
+  columns.sampling = Sampling::SKIP;
+  Parameters packed = parameters;
+  packed.storage = StorageLayout::PACKED;
+  std::string rows[3] = {report_rows<Simulation>(parameters, 2),
+      report_rows<BasicSimulation<AgentColumns>>(columns, 2),
+      report_rows<BasicSimulation<AgentCompact<4>>>(packed, 2)};
+  MappingPolicy &policy = mapping_policy();
+  policy.threshold = 4096;
+  policy.directory = ".";
+  for (AgentMemory memory: {AgentMemory::HUGE_PAGES, AgentMemory::FILE_BACKED}) {
+    policy.memory = memory;
+    BOOST_TEST(report_rows<Simulation>(parameters, 2) == rows[0]);
+    BOOST_TEST(report_rows<BasicSimulation<AgentColumns>>(columns, 2) == rows[1]);
+    BOOST_TEST(report_rows<BasicSimulation<AgentCompact<4>>>(packed, 2) == rows[2]);
+    AgentColumns agents;
+    agents.append(0, State::SUSCEPTIBLE, 10000);
+    BOOST_TEST(agents.states.get_allocator().maps(agents.states.capacity()));
+    AgentVector<uint8_t> small(100);
+    BOOST_TEST(!small.get_allocator().maps(small.capacity()));
+    if (memory == AgentMemory::HUGE_PAGES)
+      BOOST_TEST((uintptr_t) agents.states.data() % HUGE_PAGE_SIZE == 0);
+    agents.advise(Access::STREAM);
+    agents.advise(Access::RANDOM);
+  }
+  policy = MappingPolicy();
+}
+
+BOOST_AUTO_TEST_CASE(profile_test) {
+  // Disabled timers are empty and enabled ones count every scope.
+  BOOST_TEST(std::is_empty<EventTimer<false>>::value);
+  EventProfile profile;
+  for (size_t i = 0; i < 10; i++) {
+    EventTimer<true> timer(profile, PROFILE_RECOVER, 100);
+  }
+  BOOST_TEST(profile.events[PROFILE_RECOVER].calls == 10);
+  BOOST_TEST(profile.events[PROFILE_RECOVER].agents == 1000);
+  BOOST_TEST(profile.events[PROFILE_DIE].calls == 0);
+  // Agent iterations are counted apart from the events, as grow() may not
+  // run at all.
+  profile.agent_iterations = 1000;
+  std::ostringstream summary;
+  profile.write(summary);
+  BOOST_TEST(summary.str().find(" 0 agent iterations/s") == std::string::npos);
+
+  // Simulations hand their profiles over when they finish.
+  Parameters parameters;
+  parameters.simulations = 3;
+  parameters.iterations = 20;
+  ProfileCollector collector;
+  OutputTargets targets;
+  targets.profiler = &collector;
+  std::ostringstream rows, table;
+  run_simulations<Simulation>(parameters, rows, targets);
+  collector.merge(profile);
+  collector.write(table);
+  BOOST_TEST(table.str().find("recover") != std::string::npos);
+  BOOST_TEST(table.str().find("die") == std::string::npos);
+  BOOST_TEST(table.str().find("\n3 simulations") != std::string::npos);
+}
+
+/// Rows of simulation identity with parameters, started from the population
+/// of that identity's simulation with from
+template <typename SimulationType>
+std::string started_rows(const Parameters &from, const Parameters &parameters,
+    size_t identity) {
+  typename SimulationType::Start start;
+  SimulationType(identity, from).save_start(start);
+  std::ostringstream rows;
+  SimulationType simulation(identity, parameters, start);
+  simulation.output = &rows;
+  simulation.simulate();
+  return rows.str();
+}
+
+BOOST_AUTO_TEST_CASE(sweep_test) {
+  // A simulation started from a same_start() population runs exactly like
+  // one that made its own, in every storage.
+  Parameters parameters;
+  parameters.simulations = 1;
+  parameters.iterations = 150;
+  parameters.agents = 3000;
+  Parameters other = parameters;
+  other.recovery_prob = 0.3;
+  other.growth = 0.02;
+  BOOST_TEST(Simulation::same_start(parameters, other));
+  BOOST_TEST(started_rows<Simulation>(parameters, other, 3) ==
+      report_rows<Simulation>(other, 3));
+  Parameters partial = other;
+  partial.shuffle = Shuffle::PARTIAL;
+  partial.storage = StorageLayout::COLUMNS;
+  partial.sampling = Sampling::SKIP;
+  Parameters fewer = partial;
+  fewer.encounters = 50;
+  BOOST_TEST(!Simulation::same_start(partial, fewer));
+  BOOST_TEST(started_rows<BasicSimulation<AgentColumns>>(partial, fewer, 1) !=
+      report_rows<BasicSimulation<AgentColumns>>(fewer, 1));
+  fewer.encounters = partial.encounters;
+  BOOST_TEST(started_rows<BasicSimulation<AgentColumns>>(partial, fewer, 1) ==
+      report_rows<BasicSimulation<AgentColumns>>(fewer, 1));
+  Parameters sharded = other;
+  sharded.storage = StorageLayout::SHARDS;
+  sharded.kernel = EventKernel::SIMD;
+  sharded.shards = 3;
+  Parameters sharded_other = sharded;
+  sharded_other.vaccination_prob = 0.1;
+  BOOST_TEST(started_rows<BasicSimulation<AgentShards>>(sharded, sharded_other,
+      2) == report_rows<BasicSimulation<AgentShards>>(sharded_other, 2));
+  Parameters packed = partial;
+  packed.storage = StorageLayout::PACKED;
+  BOOST_TEST(started_rows<BasicSimulation<AgentCompact<4>>>(partial, packed, 4)
+      == report_rows<BasicSimulation<AgentCompact<4>>>(packed, 4));
+
+  // A sweep writes each set's rows, tagged with its index, as a batch of
+  // the set alone would, in set order, whatever the number of threads.
+  std::vector<Parameters> sets = {parameters, other, parameters};
+  sets[0].simulations = 3;
+  sets[1].simulations = 4;
+  sets[2].simulations = 2;
+  sets[2].infections = 40;
+  std::string expected = std::string("set,") + REPORT_HEADER;
+  for (size_t s = 0; s < sets.size(); s++) {
+    std::ostringstream batch;
+    run_simulations<Simulation>(sets[s], batch);
+    std::istringstream rows(batch.str());
+    std::string row;
+    while (std::getline(rows, row))
+      if (row != "#,iter,S,I,R,V,D,TI,TID")
+        expected += std::to_string(s) + "," + row + "\n";
+  }
+  for (size_t threads: {1, 4}) {
+    for (Parameters &set: sets)
+      set.threads = threads;
+    std::ostringstream out;
+    run_sweep<Simulation>(sets, out, std::vector<OutputTargets>(sets.size()));
+    BOOST_TEST(out.str() == expected);
+  }
+
+  // Aggregated sets keep apart.
+  std::vector<ReportAggregator> aggregators(sets.size());
+  std::vector<OutputTargets> targets(sets.size());
+  for (size_t s = 0; s < sets.size(); s++)
+    targets[s].aggregator = &aggregators[s];
+  std::ostringstream rows, table;
+  run_sweep<Simulation>(sets, rows, targets);
+  BOOST_TEST(rows.str().empty());
+  for (size_t s = 0; s < sets.size(); s++)
+    aggregators[s].write(table, std::to_string(s), s == 0);
+  BOOST_TEST(table.str().find("set,iter,stat") == 0);
+  BOOST_TEST(table.str().find("\n1,150,S,4,") != std::string::npos);
+  BOOST_TEST(table.str().find("\n2,0,I,2,40,") != std::string::npos);
+}
+
+// The differential suite: every optimized engine against the reference
+// on the same parameters. Engines that claim to draw the reference's
+// stream must report exactly what it does; the others follow other streams
+// and must only agree in distribution.
+
+/// Each runner writes the report rows of one engine's simulation identity
+using EngineRunner = std::function<std::string(size_t identity)>;
+
+template <typename SimulationType>
+EngineRunner runner(const Parameters &parameters) {
+  return [parameters](size_t identity) {
+    return report_rows<SimulationType>(parameters, identity);
+  };
+}
+
+BOOST_AUTO_TEST_CASE(bit_exact_equivalence_test) {
+  Parameters parameters;
+  parameters.simulations = 1;
+  parameters.iterations = 300;
+  parameters.agents = 3001;
+  parameters.report_every = 10;
+  // Groups sharing a stream; each engine must match the group's first.
+  std::vector<std::pair<std::string, std::vector<EngineRunner>>> groups;
+
+  // The reference stream: the engine draws per agent in position order.
+  Parameters packed = parameters;
+  packed.storage = StorageLayout::PACKED;
+  groups.push_back({"engine", {runner<Simulation>(parameters),
+      runner<BasicSimulation<AgentCompact<8>>>(parameters),
+      runner<BasicSimulation<AgentCompact<4>>>(packed)}});
+
+  // The kernels draw from counters, so the storage, shards of one and
+  // fusing do not change what they draw, nor do batched encounters.
+  for (EncounterMode mode: {EncounterMode::SEQUENTIAL, EncounterMode::BATCHED}) {
+    Parameters simd = parameters;
+    simd.kernel = EventKernel::SIMD;
+    simd.encounter_mode = mode;
+    simd.storage = StorageLayout::COLUMNS;
+    Parameters fused = simd;
+    fused.fused = true;
+    Parameters shard = simd;
+    shard.storage = StorageLayout::SHARDS;
+    shard.shards = 1;
+    Parameters fused_shard = shard;
+    fused_shard.fused = true;
+    std::vector<EngineRunner> kernels = {runner<BasicSimulation<AgentColumns>>(simd),
+        runner<BasicSimulation<AgentColumns>>(fused),
+        runner<BasicSimulation<AgentCompact<8>>>(simd),
+        runner<BasicSimulation<AgentCompact<4>>>(fused)};
+    if (mode == EncounterMode::BATCHED) {
+      kernels.push_back(runner<BasicSimulation<AgentShards>>(shard));
+      kernels.push_back(runner<BasicSimulation<AgentShards>>(fused_shard));
+      kernels.push_back(runner<BasicSimulation<AgentDevice>>(simd));
+      kernels.push_back(runner<BasicSimulation<AgentDevice>>(fused));
+    } else {
+      // Sharded runs draw their sequential encounters from the kernel
+      // counters too, so one shard matches the columns with the same
+      // parameters.
+      groups.push_back({"one shard", {runner<BasicSimulation<AgentColumns>>(shard),
+          runner<BasicSimulation<AgentShards>>(shard),
+          runner<BasicSimulation<AgentShards>>(fused_shard)}});
+    }
+    groups.push_back({mode == EncounterMode::BATCHED ? "batched kernels" :
+        "kernels", kernels});
+  }
+
+  // Shards draw by shard, whatever the number of threads.
+  Parameters serial = parameters;
+  serial.storage = StorageLayout::SHARDS;
+  serial.kernel = EventKernel::SIMD;
+  serial.shards = 4;
+  serial.threads = 1;
+  Parameters parallel = serial;
+  parallel.threads = 3;
+  groups.push_back({"shards", {runner<BasicSimulation<AgentShards>>(serial),
+      runner<BasicSimulation<AgentShards>>(parallel)}});
+
+  for (const auto &group: groups) {
+    for (size_t identity: {0, 1}) {
+      std::string reference = group.second[0](identity);
+      for (size_t k = 1; k < group.second.size(); k++)
+        BOOST_TEST(group.second[k](identity) == reference,
+            group.first << " engine " << k << ", simulation " << identity);
+    }
+  }
+}
+
+/// Report values (S, I, R, V, D, TI, TID) of simulation identity after
+/// every report_every iterations
+template <typename SimulationType>
+std::vector<std::array<uint64_t, 7>> trajectory(const Parameters &parameters,
+    size_t identity) {
+  SimulationType simulation(identity, parameters);
+  std::vector<std::array<uint64_t, 7>> values;
+  while (!simulation.done()) {
+    simulation.advance(parameters.report_every);
+    Statistics stats = simulation.agents.statistics();
+    values.push_back({stats.susceptible, stats.infectious, stats.recovered,
+        stats.vaccinated, stats.dead + simulation.cold.size(),
+        simulation.total_infections, simulation.infection_deaths});
+  }
+  return values;
+}
+
+/// Two sample Kolmogorov-Smirnov statistic: the largest distance between
+/// the empirical distribution functions of a and b
+double ks_statistic(std::vector<double> a, std::vector<double> b) {
+  std::sort(a.begin(), a.end());
+  std::sort(b.begin(), b.end());
+  double distance = 0;
+  size_t i = 0, j = 0;
+  while (i < a.size() && j < b.size()) {
+    double x = std::min(a[i], b[j]);
+    while (i < a.size() && a[i] == x)
+      i++;
+    while (j < b.size() && b[j] == x)
+      j++;
+    distance = std::max(distance, std::abs((double) i / a.size() -
+          (double) j / b.size()));
+  }
+  return distance;
+}
+
+/// Seeds of each side of the distributional comparisons
+const size_t KS_RUNS = 120;
+
+/// Trajectories of KS_RUNS simulations of one engine
+using Sample = std::vector<std::vector<std::array<uint64_t, 7>>>;
+
+template <typename SimulationType>
+Sample sample(const Parameters &parameters) {
+  Sample runs;
+  for (size_t k = 0; k < KS_RUNS; k++)
+    runs.push_back(trajectory<SimulationType>(parameters, 1000 + k));
+  return runs;
+}
+
+/// Largest KS statistic over every value and report of a and b, and the
+/// critical value it must stay below: the asymptotic one at 1e-4, as many
+/// comparisons are made
+std::pair<double, double> ks_distance(const Sample &a, const Sample &b) {
+  double largest = 0;
+  for (size_t report = 0; report < a[0].size(); report++) {
+    for (size_t v = 0; v < 7; v++) {
+      std::vector<double> x, y;
+      for (const auto &run: a)
+        x.push_back(run[report][v]);
+      for (const auto &run: b)
+        y.push_back(run[report][v]);
+      largest = std::max(largest, ks_statistic(x, y));
+    }
+  }
+  double n = a.size(), m = b.size();
+  double critical = std::sqrt(-std::log(1e-4 / 2) / 2) * std::sqrt((n + m) / (n * m));
+  return {largest, critical};
+}
+
+/// Largest difference between the means of a and b, in standard errors,
+/// over every value and report, and the bound it must stay below. KS
+/// statistics of so few runs only catch large changes; a shift of the mean
+/// shows up long before that.
+std::pair<double, double> mean_distance(const Sample &a, const Sample &b) {
+  auto moments = [](const Sample &runs, size_t report, size_t v) {
+    double sum = 0, squares = 0;
+    for (const auto &run: runs)
+      sum += run[report][v];
+    double mean = sum / runs.size();
+    for (const auto &run: runs)
+      squares += (run[report][v] - mean) * (run[report][v] - mean);
+    return std::make_pair(mean, squares / (runs.size() - 1) / runs.size());
+  };
+  double largest = 0;
+  for (size_t report = 0; report < a[0].size(); report++) {
+    for (size_t v = 0; v < 7; v++) {
+      auto x = moments(a, report, v), y = moments(b, report, v);
+      double error = std::sqrt(x.second + y.second);
+      double difference = std::abs(x.first - y.first);
+      if (difference > 0)
+        largest = std::max(largest, error > 0 ? difference / error :
+            std::numeric_limits<double>::infinity());
+    }
+  }
+  return {largest, 4.5};
+}
+
+BOOST_AUTO_TEST_CASE(distribution_equivalence_test) {
+  // The reference with xoshiro, so that the comparisons are not about the
+  // legacy engine's 15 bit real(), which makes every probability a multiple
+  // of 1/32768.
+  Parameters parameters;
+  parameters.simulations = 1;
+  parameters.iterations = 200;
+  parameters.agents = 2000;
+  parameters.infections = 20;
+  parameters.report_every = 50;
+  parameters.generator = Generator::XOSHIRO;
+  using Reference = BasicSimulation<AgentArray, Xoshiro256pp>;
+  using Columns = BasicSimulation<AgentColumns, Xoshiro256pp>;
+  std::vector<std::pair<std::string, std::function<Sample(Parameters)>>> engines;
+  auto engine = [&](std::string name, std::function<Sample(Parameters)> run) {
+    engines.push_back({name, run});
+  };
+
+  for (InfectionMethod method: {InfectionMethod::ONE, InfectionMethod::TWO}) {
+    parameters.infection_method = method;
+    Sample reference = sample<Reference>(parameters);
+    engines.clear();
+    engine("columns", [](Parameters p) {
+        p.storage = StorageLayout::COLUMNS;
+        return sample<Columns>(p); });
+    engine("skip sampling", [](Parameters p) {
+        p.storage = StorageLayout::COLUMNS;
+        p.sampling = Sampling::SKIP;
+        return sample<Columns>(p); });
+    engine("simd kernels", [](Parameters p) {
+        p.storage = StorageLayout::COLUMNS;
+        p.kernel = EventKernel::SIMD;
+        return sample<Columns>(p); });
+    engine("fused", [](Parameters p) {
+        p.fused = true;
+        return sample<Reference>(p); });
+    engine("shards", [](Parameters p) {
+        p.storage = StorageLayout::SHARDS;
+        p.kernel = EventKernel::SIMD;
+        p.shards = 3;
+        return sample<BasicSimulation<AgentShards, Xoshiro256pp>>(p); });
+    engine("next-event timing", [](Parameters p) {
+        p.timing = Timing::EVENTS;
+        p.shuffle = Shuffle::PARTIAL;
+        return sample<Reference>(p); });
+    engine("next-event timing, compact", [](Parameters p) {
+        p.timing = Timing::EVENTS;
+        p.shuffle = Shuffle::PARTIAL;
+        p.storage = StorageLayout::COMPACT;
+        return sample<BasicSimulation<AgentCompact<8>, Xoshiro256pp>>(p); });
+    // Batched encounters are left out: an agent infected in a batch infects
+    // no one else in it, which is a model of its own (see below).
+    if (method == InfectionMethod::TWO) {
+      engine("partial shuffle", [](Parameters p) {
+          p.shuffle = Shuffle::PARTIAL;
+          return sample<Reference>(p); });
+      engine("equivalent compaction", [](Parameters p) {
+          p.shuffle = Shuffle::PARTIAL;
+          p.compaction = Compaction::EQUIVALENT;
+          p.compact_every = 20;
+          return sample<Reference>(p); });
+    }
+    for (const auto &e: engines) {
+      Sample runs = e.second(parameters);
+      auto ks = ks_distance(reference, runs);
+      auto mean = mean_distance(reference, runs);
+      BOOST_TEST(ks.first < ks.second, e.first << " with method " << method
+          << ": KS distance " << ks.first << " against " << ks.second);
+      BOOST_TEST(mean.first < mean.second, e.first << " with method " << method
+          << ": means " << mean.first << " standard errors apart");
+    }
+
+    // The checks can tell: deaths three times as likely are caught, and so
+    // are batched encounters, whose infections cannot spread within the
+    // batch. Method two has no batched variant.
+    Parameters deadlier = parameters;
+    deadlier.death_prob_infectious *= 3;
+    auto ks = ks_distance(reference, sample<Reference>(deadlier));
+    BOOST_TEST(ks.first > ks.second);
+    if (method == InfectionMethod::ONE) {
+      Parameters batched = parameters;
+      batched.storage = StorageLayout::COLUMNS;
+      batched.kernel = EventKernel::SIMD;
+      batched.encounter_mode = EncounterMode::BATCHED;
+      Sample runs = sample<Columns>(batched);
+      ks = ks_distance(reference, runs);
+      auto mean = mean_distance(reference, runs);
+      BOOST_TEST(ks.first > ks.second);
+      BOOST_TEST(mean.first > mean.second);
+    }
+  }
+
+  // Next-event timing follows the steps in any order of the events, agents
+  // infected after the per-agent ones included.
+  parameters.infection_method = InfectionMethod::ONE;
+  parameters.events = {EVENT_GROW, EVENT_RECOVER, EVENT_VACCINATE,
+      EVENT_SUSCEPTIBLE, EVENT_DIE, EVENT_INFECT};
+  Parameters timed = parameters;
+  timed.timing = Timing::EVENTS;
+  timed.shuffle = Shuffle::PARTIAL;
+  BOOST_TEST(Reference(0, timed).scheduled);
+  Sample steps = sample<Reference>(parameters), events = sample<Reference>(timed);
+  auto ks = ks_distance(steps, events);
+  auto mean = mean_distance(steps, events);
+  BOOST_TEST(ks.first < ks.second);
+  BOOST_TEST(mean.first < mean.second);
+}
+
+BOOST_AUTO_TEST_CASE(event_pipeline_test) {
+  Parameters parameters;
+  parameters.simulations = 1;
+  parameters.iterations = 200;
+  parameters.agents = 2000;
+  parameters.infections = 20;
+  parameters.report_every = 50;
+  parameters.growth = 0;
+  parameters.vaccination_prob = 0;
+
+  // Only grow() goes for nothing as long as the engine draws per agent;
+  // lazily the zero-probability vaccinate() goes too.
+  BOOST_TEST(Simulation(0, parameters).pipeline.size() == 5);
+  Parameters lazy = parameters;
+  lazy.lazy_events = true;
+  BOOST_TEST(Simulation(0, lazy).pipeline.size() == 4);
+  Parameters skip = parameters;
+  skip.storage = StorageLayout::COLUMNS;
+  skip.sampling = Sampling::SKIP;
+  BOOST_TEST(BasicSimulation<AgentColumns>(0, skip).pipeline.size() == 4);
+
+  // The kernels only skip the dropped events' counters (an entry each): a
+  // probability too small for any draw to fall below gives the same rows.
+  using Columns = BasicSimulation<AgentColumns>;
+  for (bool fused: {false, true}) {
+    Parameters simd = parameters;
+    simd.storage = StorageLayout::COLUMNS;
+    simd.kernel = EventKernel::SIMD;
+    simd.fused = fused;
+    simd.regression_prob = 0;
+    Parameters kept = simd;
+    kept.vaccination_prob = 1e-300;
+    kept.regression_prob = 1e-300;
+    BOOST_TEST(Columns(1, simd).pipeline.size() == (fused ? 2 : 5));
+    BOOST_TEST(report_rows<Columns>(simd, 1) == report_rows<Columns>(kept, 1));
+  }
+
+  // So do batched encounters without infectious agents.
+  Parameters batched = parameters;
+  batched.storage = StorageLayout::COLUMNS;
+  batched.kernel = EventKernel::SIMD;
+  batched.encounter_mode = EncounterMode::BATCHED;
+  batched.infections = 0;
+  std::ostringstream skipped, run;
+  Columns idle(0, batched);
+  idle.output = &skipped;
+  idle.simulate();
+  Columns busy(0, batched);
+  busy.output = &run;
+  busy.skip_idle_infections = false;
+  busy.simulate();
+  BOOST_TEST(skipped.str() == run.str());
+
+  // Lazy events follow other draws but the same distribution.
+  parameters.generator = Generator::XOSHIRO;
+  parameters.regression_prob = 0;
+  parameters.infection_method = InfectionMethod::ONE;
+  lazy = parameters;
+  lazy.lazy_events = true;
+  using Reference = BasicSimulation<AgentArray, Xoshiro256pp>;
+  BOOST_TEST(report_rows<Reference>(lazy, 0) != report_rows<Reference>(parameters, 0));
+  auto ks = ks_distance(sample<Reference>(parameters), sample<Reference>(lazy));
+  BOOST_TEST(ks.first < ks.second);
+
+  // The events run in the order given, fused only where the four per-agent
+  // ones follow each other.
+  Parameters none = parameters;
+  none.events.clear();
+  std::string rows = report_rows<Simulation>(none, 0);
+  BOOST_TEST(rows.find("\n0,200,1980,20,0,0,0,20,0\n") != std::string::npos);
+  Parameters reordered = parameters;
+  reordered.events = {EVENT_DIE, EVENT_RECOVER, EVENT_INFECT, EVENT_SUSCEPTIBLE};
+  Parameters fused = reordered;
+  fused.fused = true;
+  BOOST_TEST(Reference(0, fused).pipeline.size() == 4);
+  BOOST_TEST(report_rows<Reference>(fused, 0) == report_rows<Reference>(reordered, 0));
+  BOOST_TEST(report_rows<Reference>(reordered, 0) != report_rows<Reference>(parameters, 0));
+}
+
+BOOST_AUTO_TEST_CASE(specialized_method_test) {
+  // A method fixed at compile time runs as the parameters would choose it,
+  // whatever they say.
+  Parameters parameters;
+  parameters.simulations = 1;
+  parameters.iterations = 200;
+  parameters.agents = 2000;
+  for (size_t identity: {0, 1}) {
+    Parameters one = parameters, two = parameters;
+    one.infection_method = InfectionMethod::ONE;
+    two.infection_method = InfectionMethod::TWO;
+    BOOST_TEST((report_rows<BasicSimulation<AgentArray, Rng, ONE>>(parameters,
+        identity) == report_rows<Simulation>(one, identity)));
+    BOOST_TEST((report_rows<BasicSimulation<AgentArray, Rng, TWO>>(parameters,
+        identity) == report_rows<Simulation>(two, identity)));
+  }
+  Parameters columns = parameters;
+  columns.storage = StorageLayout::COLUMNS;
+  columns.kernel = EventKernel::SIMD;
+  columns.fused = true;
+  columns.infection_method = InfectionMethod::TWO;
+  BOOST_TEST((report_rows<BasicSimulation<AgentColumns, Xoshiro256pp, TWO>>(
+      columns, 0) == report_rows<BasicSimulation<AgentColumns, Xoshiro256pp>>(
+      columns, 0)));
+}
+
+BOOST_AUTO_TEST_CASE(event_calendar_test) {
+  // Agents fire in their iteration in the order they were filed, however
+  // far ahead, and rescheduled agents only where they were moved to.
+  EventCalendar calendar;
+  calendar.schedule(3, 5);
+  calendar.schedule(1, 5);
+  calendar.schedule(2, 5 + 2 * EventCalendar::WHEEL);
+  calendar.schedule(4, 5);
+  calendar.schedule(4, 6);
+  calendar.schedule(0, EventCalendar::NEVER);
+  BOOST_TEST(calendar.size() == 5);
+  std::vector<uint32_t> fired;
+  auto fire = [&](uint32_t iteration) {
+    fired.clear();
+    calendar.fire(iteration, [&](uint32_t agent) { fired.push_back(agent); });
+    return fired;
+  };
+  BOOST_TEST(fire(5) == std::vector<uint32_t>({3, 1}));
+  BOOST_TEST(fire(6) == std::vector<uint32_t>({4}));
+  BOOST_TEST(fire(5 + EventCalendar::WHEEL).empty());
+  BOOST_TEST(calendar.when(3) == EventCalendar::NEVER);
+  BOOST_TEST(fire(5 + 2 * EventCalendar::WHEEL) == std::vector<uint32_t>({2}));
+
+  // Firing can file agents in the bucket being fired.
+  const uint32_t later = 7 + 2 * EventCalendar::WHEEL;
+  calendar.schedule(1, later);
+  calendar.fire(later, [&](uint32_t agent) {
+    calendar.schedule(agent, later + EventCalendar::WHEEL);
+  });
+  BOOST_TEST(fire(later + EventCalendar::WHEEL) == std::vector<uint32_t>({1}));
+
+  // Agents filed under an iteration that has fired go under the next one.
+  calendar.schedule(3, later);
+  BOOST_TEST(calendar.when(3) == later + EventCalendar::WHEEL + 1);
+  BOOST_TEST(fire(later + EventCalendar::WHEEL + 1) == std::vector<uint32_t>({3}));
+
+  // An iteration's outcomes are those of the four events in a row.
+  Parameters parameters;
+  parameters.recovery_prob = 0.5;
+  parameters.regression_prob = 0.5;
+  parameters.death_prob_susceptible = 0.5;
+  parameters.death_prob_infectious = 0.5;
+  parameters.vaccination_prob = 0;
+  IterationOutcomes outcomes(parameters);
+  BOOST_TEST(outcomes.count[State::SUSCEPTIBLE] == 1);
+  BOOST_TEST(outcomes.leave[State::SUSCEPTIBLE] == 0.5);
+  BOOST_TEST(outcomes.count[State::INFECTIOUS] == 4);
+  BOOST_TEST(outcomes.leave[State::INFECTIOUS] == 0.75);
+  BOOST_TEST(outcomes.leave[State::RECOVERED] == 0.5);
+  BOOST_TEST(outcomes.leave[State::DEAD] == 0.0);
+  BOOST_TEST(outcomes.outcomes[State::INFECTIOUS][outcomes.pick(State::INFECTIOUS,
+      0.1)].infection_death);
+  BOOST_TEST(outcomes.outcomes[State::INFECTIOUS][outcomes.pick(State::INFECTIOUS,
+      0.99)].to == State::DEAD);
+  BOOST_TEST(!outcomes.outcomes[State::INFECTIOUS][outcomes.pick(State::INFECTIOUS,
+      0.99)].infection_death);
+
+  // Scheduled runs only visit the agents that change.
+  parameters = Parameters();
+  parameters.simulations = 1;
+  parameters.iterations = 200;
+  parameters.timing = Timing::EVENTS;
+  parameters.shuffle = Shuffle::PARTIAL;
+  Simulation simulation(0, parameters);
+  BOOST_TEST(simulation.scheduled);
+  std::ostringstream rows;
+  simulation.output = &rows;
+  simulation.simulate();
+  BOOST_TEST(simulation.calendar.size() == simulation.agents.size());
+  Parameters full = parameters;
+  full.shuffle = Shuffle::FULL;
+  BOOST_TEST(!Simulation(0, full).scheduled);
+}
+
+BOOST_AUTO_TEST_CASE(placement_test) {
+  BOOST_TEST(parse_cpu_list("0-3,8,10-11\n") ==
+      std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  BOOST_CHECK_THROW(parse_cpu_list("3-1"), std::invalid_argument);
+  BOOST_CHECK_THROW(parse_cpu_list("a"), std::invalid_argument);
+
+  // Two nodes of unequal size
+  std::vector<std::vector<int>> nodes = {{0, 1, 2}, {4, 5}};
+  BOOST_TEST(worker_cpus(PIN_COMPACT, nodes) == std::vector<int>({0, 1, 2, 4, 5}));
+  BOOST_TEST(worker_cpus(PIN_SCATTER, nodes) == std::vector<int>({0, 4, 1, 5, 2}));
+  BOOST_TEST(worker_cpus(PIN_LIST, nodes, {5, 0}) == std::vector<int>({5, 0}));
+  BOOST_TEST(worker_cpus(PIN_NONE, nodes).empty());
+  std::vector<std::vector<int>> machine = numa_nodes();
+  BOOST_TEST(!machine.empty());
+  BOOST_TEST(!machine[0].empty());
+
+  // Pinned tasks stay with their worker, and sticky pinned runs write what
+  // the others do.
+  PlacementPolicy &policy = placement_policy();
+  policy.pinning = PIN_COMPACT;
+  WorkStealingPool pool(4);
+  std::atomic<size_t> strays(0);
+  std::function<void(size_t, size_t)> chain = [&](size_t left, size_t owner) {
+    pool.post([&, left, owner](size_t worker) {
+        if (worker != owner)
+          ++strays;
+        if (left > 0)
+          chain(left - 1, owner);
+        }, owner, true);
+  };
+  for (size_t worker = 0; worker < 4; worker++)
+    chain(200, worker);
+  pool.run();
+  BOOST_TEST(strays == 0);
+
+  Parameters parameters;
+  parameters.simulations = 5;
+  parameters.iterations = 250;
+  parameters.agents = 2000;
+  parameters.threads = 3;
+  std::ostringstream free, sticky;
+  run_simulations<Simulation>(parameters, free);
+  policy.sticky = true;
+  run_simulations<Simulation>(parameters, sticky);
+  BOOST_TEST(sticky.str() == free.str());
+  policy = PlacementPolicy();
+}
+
+BOOST_AUTO_TEST_CASE(metrics_test) {
+  // Every iteration, simulation and report byte of a run is counted.
+  Parameters parameters;
+  parameters.simulations = 4;
+  parameters.iterations = 250;
+  parameters.agents = 2000;
+  parameters.threads = 2;
+  MetricsSample before = metrics().sample();
+  std::vector<uint64_t> slots(Metrics::SLOTS);
+  for (size_t k = 0; k < Metrics::SLOTS; k++)
+    slots[k] = Metrics::load(metrics().slot(k).iterations);
+  std::ostringstream out;
+  run_simulations<Simulation>(parameters, out);
+  MetricsSample after = metrics().sample();
+  BOOST_TEST(after.iterations - before.iterations == 1000);
+  BOOST_TEST(after.agents - before.agents >= 1000 * 2000);
+  BOOST_TEST(after.started - before.started == 4);
+  BOOST_TEST(after.finished - before.finished == 4);
+  BOOST_TEST(after.planned - before.planned == 4);
+  BOOST_TEST(after.planned_iterations - before.planned_iterations == 1000);
+  BOOST_TEST(after.bytes - before.bytes == out.str().size());
+
+  MetricsSample now;
+  now.seconds = 10;
+  now.iterations = 500;
+  now.agents = 1000000;
+  now.started = 3;
+  now.finished = 1;
+  now.planned = 5;
+  now.planned_iterations = 1000;
+  now.bytes = 2500000;
+  MetricsSample then;
+  then.seconds = 8;
+  then.iterations = 300;
+  BOOST_TEST(format_status(now, then) == "abm: 10.0 s, 500/1000 iterations, "
+      "100 iterations/s, 5e+05 agents/s, simulations 1 finished 2 running 2 "
+      "queued, 2.5 MB written, eta 10 s\n");
+
+  // The endpoint serves the counters to any request, on the loopback
+  // address unless given another.
+  BOOST_CHECK_THROW(MetricsServer(0, "localhost"), std::runtime_error);
+  MetricsServer server(0);
+  BOOST_REQUIRE(server.port() > 0);
+  int client = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(server.port());
+  BOOST_REQUIRE(connect(client, (sockaddr*) &address, sizeof(address)) == 0);
+  const std::string request = "GET /metrics HTTP/1.0\r\n\r\n";
+  BOOST_REQUIRE(send(client, request.data(), request.size(), 0) > 0);
+  std::string response;
+  char buffer[4096];
+  for (ssize_t n; (n = recv(client, buffer, sizeof(buffer), 0)) > 0;)
+    response.append(buffer, n);
+  close(client);
+  BOOST_TEST(response.find("HTTP/1.0 200 OK") == 0);
+  BOOST_TEST(response.find("\nabm_iterations_total " +
+        std::to_string(metrics().sample().iterations) + "\n") != std::string::npos);
+  BOOST_TEST(response.find("abm_thread_iterations_total{thread=\"0\"}") !=
+      std::string::npos);
+}
@@ -0,0 +1,240 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//! The writer thread of AsyncWriter.
+
+#include "writer.hpp"
+
+#include <charconv>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+#include "abm.hpp"
+
+/// The writer writes out its text once it has this much, or when the queue
+/// runs empty.
+static const size_t BATCH_BYTES = 1 << 16;
+
+/// Waits a little longer the more often it has been called in a row.
+static void back_off(size_t attempt)
+{
+		if (attempt < 64)
+				std::this_thread::yield();
+		else
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+}
+
+AsyncWriter::AsyncWriter(std::ostream &out, size_t simulations,
+				size_t capacity, OutputFull full) :
+		out(out), queue(capacity), full(full),
+		held(simulations > 1 ? simulations : 0),
+		finished(simulations > 1 ? simulations : 0, false)
+{
+		thread = std::thread([this]() { run(); });
+}
+
+AsyncWriter::~AsyncWriter()
+{
+		try {
+				close();
+		} catch (...) {
+		}
+}
+
+void AsyncWriter::push(OutputRecord record)
+{
+		for (size_t attempt = 0; !queue.try_push(record); attempt++) {
+				if (full == OutputFull::DROP && record.kind == OutputRecord::AGENTS) {
+						++dropped_count;
+						return;
+				}
+				back_off(attempt);
+		}
+}
+
+void AsyncWriter::close()
+{
+		if (!thread.joinable())
+				return;
+		closing.store(true, std::memory_order_release);
+		thread.join();
+		if (error)
+				std::rethrow_exception(error);
+}
+
+void AsyncWriter::run()
+{
+		OutputRecord record;
+		for (size_t idle = 0;; idle++) {
+				// Everything pushed before closing was set is in the queue by now,
+				// so one more pass after seeing it empties the queue.
+				bool last = closing.load(std::memory_order_acquire);
+				while (queue.try_pop(record)) {
+						idle = 0;
+						try {
+								write(record);
+						} catch (...) {
+								if (!error)
+										error = std::current_exception();
+						}
+						if (batch.size() >= BATCH_BYTES) {
+								out.write(batch.data(), batch.size());
+								ThreadCounters::add(metrics().writer().bytes, batch.size());
+								batch.clear();
+						}
+				}
+				if (!batch.empty()) {
+						out.write(batch.data(), batch.size());
+						ThreadCounters::add(metrics().writer().bytes, batch.size());
+						batch.clear();
+						out.flush();
+				}
+				if (last)
+						break;
+				back_off(idle);
+		}
+		out.flush();
+}
+
+void AsyncWriter::emit(size_t identity, const char *text, size_t size)
+{
+		if (held.empty() || identity == next)
+				batch.append(text, size);
+		else
+				held[identity].append(text, size);
+}
+
+void AsyncWriter::write(OutputRecord &record)
+{
+		switch (record.kind) {
+				case OutputRecord::HEADER:
+						emit(record.identity, REPORT_HEADER, sizeof(REPORT_HEADER) - 1);
+						break;
+				case OutputRecord::REPORT: {
+						char row[REPORT_ROW_MAX];
+						char *end = format_report(row, record.identity, record.iteration,
+										record.values);
+						emit(record.identity, row, end - row);
+						break;
+				}
+				case OutputRecord::FINISHED:
+						if (held.empty())
+								break;
+						finished[record.identity] = true;
+						while (next < finished.size() && finished[next]) {
+								if (++next < held.size()) {
+										batch += held[next];
+										std::string().swap(held[next]);
+								}
+						}
+						break;
+				case OutputRecord::AGENTS: {
+						AgentDump &dump = *record.agents;
+						if (dump.binary) {
+								write_snapshot(dump.path, dump.header, dump.states);
+								ThreadCounters::add(metrics().writer().bytes,
+												sizeof(dump.header) + dump.states.size());
+								break;
+						}
+						char letters[STATE_COUNT];
+						for (size_t s = 0; s < STATE_COUNT; s++) {
+								std::ostringstream letter;
+								letter << (State) s;
+								letters[s] = letter.str()[0];
+						}
+						std::string text = "id,state\n";
+						text.reserve(dump.states.size() * 10);
+						for (size_t i = 0; i < dump.states.size(); i++) {
+								char id[20];
+								text.append(id, std::to_chars(id, id + sizeof(id), i).ptr);
+								text += ',';
+								text += letters[dump.states[i]];
+								text += '\n';
+						}
+						std::ofstream file(dump.path);
+						file.write(text.data(), text.size());
+						ThreadCounters::add(metrics().writer().bytes, text.size());
+						break;
+				}
+		}
+		record.agents.reset();
+}
+
+CheckpointWriter::CheckpointWriter()
+{
+		thread = std::thread([this]() { run(); });
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+		{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+		}
+		changed.notify_all();
+		thread.join();
+}
+
+std::vector<uint8_t>& CheckpointWriter::buffer()
+{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return !queued[filling]; });
+		return buffers[filling];
+}
+
+void CheckpointWriter::write(const std::string &path)
+{
+		{
+				std::lock_guard<std::mutex> lock(mutex);
+				paths[filling] = path;
+				queued[filling] = true;
+				filling ^= 1;
+		}
+		changed.notify_all();
+}
+
+void CheckpointWriter::wait()
+{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return !queued[0] && !queued[1]; });
+		if (error) {
+				std::exception_ptr first = error;
+				error = nullptr;
+				std::rethrow_exception(first);
+		}
+}
+
+void CheckpointWriter::run()
+{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+				// Buffers are handed over in turn, so they are written in turn.
+				changed.wait(lock, [this]() { return queued[writing] || stopping; });
+				if (!queued[writing])
+						return;
+				lock.unlock();
+				try {
+						write_checkpoint(paths[writing], buffers[writing]);
+				} catch (...) {
+						lock.lock();
+						if (!error)
+								error = std::current_exception();
+						lock.unlock();
+				}
+				lock.lock();
+				queued[writing] = false;
+				writing ^= 1;
+				changed.notify_all();
+		}
+}
@@ -0,0 +1,228 @@
+// Copyright 2024 Nathan Geffen
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//! Asynchronous output. Simulations hand their reports and agent snapshots
+//! to a bounded lock-free queue as binary records, and a writer thread
+//! formats and writes them in large batches, so the simulation threads never
+//! wait for the terminal or the file system.
+
+#ifndef ABM_WRITER_HPP
+#define ABM_WRITER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "snapshot.hpp"
+
+/// A bounded multi-producer multi-consumer queue after Dmitry Vyukov. Every
+/// cell carries a sequence number that tells producers and consumers whose
+/// turn it is, so both sides only ever do one compare-and-swap on their own
+/// index.
+template <typename T>
+class BoundedQueue {
+public:
+		/// capacity is rounded up to a power of two
+		explicit BoundedQueue(size_t capacity) {
+				size_t size = 2;
+				while (size < capacity)
+						size *= 2;
+				cells.reset(new Cell[size]);
+				mask = size - 1;
+				for (size_t i = 0; i < size; i++)
+						cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+
+		size_t capacity() const {
+				return mask + 1;
+		}
+
+		/// Moves value into the queue unless it is full
+		bool try_push(T &value) {
+				size_t position = head.load(std::memory_order_relaxed);
+				for (;;) {
+						Cell &cell = cells[position & mask];
+						size_t sequence = cell.sequence.load(std::memory_order_acquire);
+						intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+						if (difference == 0) {
+								if (head.compare_exchange_weak(position, position + 1,
+																std::memory_order_relaxed)) {
+										cell.value = std::move(value);
+										cell.sequence.store(position + 1, std::memory_order_release);
+										return true;
+								}
+						} else if (difference < 0) {
+								return false;
+						} else {
+								position = head.load(std::memory_order_relaxed);
+						}
+				}
+		}
+
+		/// Moves the oldest value out of the queue unless it is empty
+		bool try_pop(T &value) {
+				size_t position = tail.load(std::memory_order_relaxed);
+				for (;;) {
+						Cell &cell = cells[position & mask];
+						size_t sequence = cell.sequence.load(std::memory_order_acquire);
+						intptr_t difference = (intptr_t) sequence - (intptr_t) (position + 1);
+						if (difference == 0) {
+								if (tail.compare_exchange_weak(position, position + 1,
+																std::memory_order_relaxed)) {
+										value = std::move(cell.value);
+										cell.sequence.store(position + mask + 1,
+														std::memory_order_release);
+										return true;
+								}
+						} else if (difference < 0) {
+								return false;
+						} else {
+								position = tail.load(std::memory_order_relaxed);
+						}
+				}
+		}
+
+private:
+		struct Cell {
+				std::atomic<size_t> sequence;
+				T value;
+		};
+
+		std::unique_ptr<Cell[]> cells;
+		size_t mask;
+		alignas(64) std::atomic<size_t> head{0}; // Next cell to push
+		alignas(64) std::atomic<size_t> tail{0}; // Next cell to pop
+};
+
+/// Agents handed to the writer, already in identity order
+struct AgentDump {
+		std::string path;
+		bool binary; // A snapshot.hpp file rather than id,state rows
+		SnapshotHeader header; // Binary only
+		std::vector<uint8_t> states;
+};
+
+/// One item of output. Reports carry their numbers, not text.
+struct OutputRecord {
+		enum Kind : uint8_t {
+				HEADER, // The csv header of the reports
+				REPORT, // One report row
+				FINISHED, // The simulation will send no more reports
+				AGENTS // An agent snapshot
+		};
+		Kind kind = HEADER;
+		uint64_t identity = 0;
+		uint64_t iteration = 0;
+		uint64_t values[7] = {}; // S, I, R, V, D, TI, TID
+		std::unique_ptr<AgentDump> agents;
+};
+
+/// What push() does when the queue is full
+enum OutputFull {
+		WAIT = 0, // Wait for the writer to make room
+		DROP = 1 // Drop agent snapshots (never reports) and count them
+};
+
+/// Owns the queue and the writer thread. Reports go to out. With
+/// simulations > 1 the rows are put in (identity, iteration) order as
+/// ReportCollector does, and each simulation must end with FINISHED.
+class AsyncWriter {
+public:
+		AsyncWriter(std::ostream &out, size_t simulations, size_t capacity,
+						OutputFull full);
+
+		/// Calls close()
+		~AsyncWriter();
+
+		AsyncWriter(const AsyncWriter&) = delete;
+		AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+		/// Hands record to the writer thread
+		void push(OutputRecord record);
+
+		/// Writes everything pushed so far, flushes out and stops the thread.
+		/// Throws the first error the writer thread met.
+		void close();
+
+		/// Snapshots dropped because the queue was full
+		size_t dropped() const {
+				return dropped_count.load();
+		}
+
+private:
+		std::ostream &out;
+		BoundedQueue<OutputRecord> queue;
+		OutputFull full;
+		std::atomic<bool> closing{false};
+		std::atomic<size_t> dropped_count{0};
+		std::exception_ptr error;
+		std::thread thread;
+		// Writer thread only
+		std::string batch; // Formatted text not yet written
+		std::vector<std::string> held; // Rows of later simulations
+		std::vector<bool> finished;
+		size_t next = 0; // Lowest unfinished simulation
+
+		void run();
+		void write(OutputRecord &record);
+		void emit(size_t identity, const char *text, size_t size);
+};
+
+/// Writes the checkpoints of one simulation on a thread of its own. There
+/// are two buffers: the simulation fills one while the other is written, so
+/// it only waits when a checkpoint comes round before the one two back has
+/// reached the disk.
+class CheckpointWriter {
+public:
+		CheckpointWriter();
+		/// Waits for the writes handed over, dropping their errors
+		~CheckpointWriter();
+		CheckpointWriter(const CheckpointWriter&) = delete;
+		CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+		/// The buffer to fill with the next checkpoint, once its last write
+		/// has finished
+		std::vector<uint8_t>& buffer();
+
+		/// Hands the buffer() to the thread, which writes it to path with
+		/// write_checkpoint()
+		void write(const std::string &path);
+
+		/// Waits for every write handed over so far. Throws the first error the
+		/// thread met.
+		void wait();
+
+private:
+		std::mutex mutex;
+		std::condition_variable changed;
+		std::vector<uint8_t> buffers[2];
+		std::string paths[2];
+		bool queued[2] = {false, false}; // Handed over and not yet written
+		size_t filling = 0; // Buffer the simulation fills next
+		size_t writing = 0; // Buffer the thread writes next
+		bool stopping = false;
+		std::exception_ptr error;
+		std::thread thread;
+
+		void run();
+};
+
+#endif